@@ -30,10 +30,16 @@
 #include "config.h"
 #endif
 
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "armsoc_driver.h"
 #include "armsoc_exa.h"
 
 #include "dri2.h"
+#include "dixstruct.h"
 
 /* any point to support earlier? */
 #if DRI2INFOREC_VERSION < 4
@@ -71,15 +77,63 @@ struct ARMSOCDRI2BufferRec {
 	 */
 	unsigned currentPixmap;
 
+	/**
+	 * Age of the contents of each of the pPixmaps, counted in swaps as
+	 * defined by EGL_EXT_buffer_age: 0 means the contents are undefined,
+	 * 1 means the pixmap holds the frame presented by the last swap, and
+	 * so on. Reset whenever the pixmap is (re)allocated.
+	 */
+	unsigned *ages;
+
+	/**
+	 * The bo that holds the frame most recently presented from this
+	 * buffer. Exchanging it back out of the front buffer tells us the
+	 * back buffer receives a frame we presented, rather than whatever X
+	 * rendered into the window.
+	 */
+	struct armsoc_bo *frontFrameBo;
+
 	/**
 	 * Number of Pixmaps to use.
 	 *
 	 * This allows the number of back buffers used to be reduced, for
-	 * example when allocation fails. It cannot be changed to increase the
-	 * number of buffers as we would overflow the pPixmaps array.
+	 * example when allocation fails, or increased up to the capacity of
+	 * the pPixmaps array by adaptive buffering.
 	 */
 	unsigned numPixmaps;
 
+	/**
+	 * Size of the drawable the buffer was created for. The pixmaps may
+	 * be larger while the drawable is being resized, see
+	 * createBackPixmap().
+	 */
+	int width;
+	int height;
+
+	/** Number of slots allocated in the pPixmaps and ages arrays */
+	unsigned capacity;
+
+	/**
+	 * Number of Pixmaps the buffer was created with. Adaptive buffering
+	 * grows the buffer beyond this when the drawable keeps missing
+	 * vblanks, and shrinks it back when it goes idle or scanout memory
+	 * runs short. See adaptBufferCount().
+	 */
+	unsigned basePixmaps;
+	uint64_t lastSwapNs;
+	/* Time the client took to ask for the swap in flight after the
+	 * previous one completed, see ARMSOCDRI2ScheduleSwap() */
+	uint64_t renderNs;
+	unsigned windowSwaps;
+	unsigned windowMisses;
+
+	/** Entry in pARMSOC->adaptiveList while grown beyond basePixmaps */
+	struct xorg_list adaptiveEntry;
+
+	/** Client owning the drawable, whose drawables alone may reuse the
+	 * pixmaps once released to the pool */
+	int client;
+
 	/**
 	 * The DRI2 buffers are reference counted to avoid crashyness when the
 	 * client detaches a dri2 drawable while we are still waiting for a
@@ -100,6 +154,12 @@ struct ARMSOCDRI2BufferRec {
 #define ARMSOCBUF(p)	((struct ARMSOCDRI2BufferRec *)(p))
 #define DRIBUF(p)	((DRI2BufferPtr)(&(p)->base))
 
+/* The age of a back buffer is passed to clients in the upper half of the
+ * DRI2 buffer flags, so that EGL_EXT_buffer_age can be implemented on top of
+ * DRI2GetBuffers.
+ */
+#define ARMSOC_DRI2_BUFFER_AGE_SHIFT	16
+#define ARMSOC_DRI2_BUFFER_AGE_MAX	0xffff
 
 static inline DrawablePtr
 dri2draw(DrawablePtr pDraw, DRI2BufferPtr buf)
@@ -112,6 +172,33 @@ dri2draw(DrawablePtr pDraw, DRI2BufferPtr buf)
 	}
 }
 
+/**
+ * Return the CRTC an unredirected, unobscured window which exactly covers
+ * the viewport of a single CRTC can be flipped on alone, or NULL.
+ */
+static xf86CrtcPtr
+flipcrtc(DrawablePtr pDraw)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	WindowPtr pWin = (WindowPtr)pDraw;
+	BoxRec box;
+
+	if (pDraw->type != DRAWABLE_WINDOW || !pWin->viewable ||
+	    pScreen->GetWindowPixmap(pWin) != pScreen->GetScreenPixmap(pScreen))
+		return NULL;
+
+	box.x1 = pDraw->x;
+	box.y1 = pDraw->y;
+	box.x2 = pDraw->x + pDraw->width;
+	box.y2 = pDraw->y + pDraw->height;
+
+	if (RegionNumRects(&pWin->clipList) != 1 ||
+	    memcmp(RegionExtents(&pWin->clipList), &box, sizeof(box)))
+		return NULL;
+
+	return drmmode_crtc_covering(xf86ScreenToScrn(pScreen), &box);
+}
+
 static Bool
 canflip(DrawablePtr pDraw)
 {
@@ -124,7 +211,7 @@ canflip(DrawablePtr pDraw)
 		return FALSE;
 	} else {
 		return (pDraw->type == DRAWABLE_WINDOW) &&
-				DRI2CanFlip(pDraw);
+				(DRI2CanFlip(pDraw) || flipcrtc(pDraw));
 	}
 }
 
@@ -139,39 +226,326 @@ exchangebufs(DrawablePtr pDraw, DRI2BufferPtr a, DRI2BufferPtr b)
 	return TRUE;
 }
 
+static void
+setBufferFlags(struct ARMSOCDRI2BufferRec *buf)
+{
+	unsigned age = buf->ages[buf->currentPixmap];
+
+	if (age > ARMSOC_DRI2_BUFFER_AGE_MAX)
+		age = ARMSOC_DRI2_BUFFER_AGE_MAX;
+
+	DRIBUF(buf)->flags &= (1 << ARMSOC_DRI2_BUFFER_AGE_SHIFT) - 1;
+	DRIBUF(buf)->flags |= age << ARMSOC_DRI2_BUFFER_AGE_SHIFT;
+}
+
+static void
+resetBufferAges(struct ARMSOCDRI2BufferRec *buf)
+{
+	memset(buf->ages, 0, buf->numPixmaps * sizeof(*buf->ages));
+	armsoc_bo_unreference(buf->frontFrameBo);
+	buf->frontFrameBo = NULL;
+	setBufferFlags(buf);
+}
+
+/**
+ * Update the buffer ages for a swap from pSrcBuffer to pDstBuffer. Must be
+ * called before the buffers are exchanged, as it needs to know which bo
+ * the back buffer is about to receive.
+ */
+static void
+ageBuffers(DrawablePtr pDraw, DRI2BufferPtr pSrcBuffer,
+		DRI2BufferPtr pDstBuffer, Bool exchange)
+{
+	struct ARMSOCDRI2BufferRec *backBuf = ARMSOCBUF(pSrcBuffer);
+	struct armsoc_bo *frontBo, *backBo, *newFrontBo;
+	unsigned i, cur = backBuf->currentPixmap;
+
+	if (pSrcBuffer->attachment != DRI2BufferBackLeft)
+		return;
+
+	frontBo = ARMSOCPixmapBo(draw2pix(dri2draw(pDraw, pDstBuffer)));
+	backBo = ARMSOCPixmapBo(draw2pix(dri2draw(pDraw, pSrcBuffer)));
+
+	for (i = 0; i < backBuf->numPixmaps; i++) {
+		if (i != cur && backBuf->ages[i])
+			backBuf->ages[i]++;
+	}
+
+	if (!exchange) {
+		/* Blitted: the back buffer still holds the frame on screen */
+		backBuf->ages[cur] = 1;
+	} else if (frontBo && frontBo == backBuf->frontFrameBo) {
+		/* Receiving the frame presented by the previous swap */
+		backBuf->ages[cur] = 2;
+	} else {
+		backBuf->ages[cur] = 0;
+	}
+
+	newFrontBo = exchange ? backBo : frontBo;
+	if (newFrontBo)
+		armsoc_bo_reference(newFrontBo);
+	armsoc_bo_unreference(backBuf->frontFrameBo);
+	backBuf->frontFrameBo = newFrontBo;
+
+	setBufferFlags(backBuf);
+}
+
+/*
+ * Pool of back pixmaps released by DRI2 buffers, shared by the drawables of
+ * each client, so that windows which are created and destroyed often
+ * (popups, surfaces recreated on resize) don't keep allocating and freeing
+ * the same sizes. Entries keep their bo, and with it the flink name and,
+ * for scanout memory, the framebuffer.
+ *
+ * Whoever rendered to a released buffer can keep accessing it through its
+ * flink name, so entries only go to drawables of the client which owned the
+ * drawable it was released by, and are freed when that client goes away.
+ * Clients may also still be using a released buffer for a while after they
+ * destroy it (see armsoc_bo_do_pending_deletions()), so entries are only
+ * handed out again once a swap has been scheduled since their release.
+ */
+struct ARMSOCDRI2PoolEntry {
+	struct xorg_list entry;
+	PixmapPtr pPixmap;
+	int client;
+	Bool scanout;
+	uint32_t size;
+	uint64_t releasedNs;
+	unsigned long epoch;
+};
+
+/* Pooled pixmaps which haven't been reused for this long are freed */
+#define ARMSOC_POOL_IDLE_MS		3000
+
+static void
+poolEvict(ScreenPtr pScreen, struct ARMSOCDRI2PoolEntry *e)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+
+	xorg_list_del(&e->entry);
+	pARMSOC->bufferPoolBytes -= e->size;
+	pScreen->DestroyPixmap(e->pPixmap);
+	free(e);
+}
+
+static CARD32
+poolTimerCallback(OsTimerPtr timer, CARD32 time, void *arg)
+{
+	ScreenPtr pScreen = arg;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+	struct ARMSOCDRI2PoolEntry *e, *tmp;
+	uint64_t now = armsoc_monotonic_ns();
+
+	xorg_list_for_each_entry_safe(e, tmp, &pARMSOC->bufferPool, entry) {
+		if (now - e->releasedNs >=
+				(uint64_t)ARMSOC_POOL_IDLE_MS * 1000000) {
+			poolEvict(pScreen, e);
+			pARMSOC->bufferPoolExpiries++;
+		}
+	}
+
+	return xorg_list_is_empty(&pARMSOC->bufferPool) ?
+			0 : ARMSOC_POOL_IDLE_MS;
+}
+
+/**
+ * Hand a back pixmap no longer needed by a DRI2 buffer to the pool, or
+ * destroy it if it doesn't fit in the budget. The caller must already have
+ * deregistered it for external access.
+ */
+static void
+poolRelease(ScreenPtr pScreen, PixmapPtr pPixmap, int client)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+	struct armsoc_bo *bo = ARMSOCPixmapBo(pPixmap);
+	struct ARMSOCDRI2PoolEntry *e;
+
+	/* A bo still on screen through a CRTC of its own can't be reused */
+	if (!pARMSOC->bufferPoolActive || !bo || pPixmap->refcnt != 1 ||
+	    armsoc_bo_size(bo) > pARMSOC->bufferPoolBudget ||
+	    drmmode_scanout_busy(xf86ScreenToScrn(pScreen), bo))
+		goto destroy;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		goto destroy;
+
+	/* Make room by freeing the least recently released entries */
+	while (pARMSOC->bufferPoolBytes + armsoc_bo_size(bo) >
+			pARMSOC->bufferPoolBudget) {
+		poolEvict(pScreen, xorg_list_last_entry(&pARMSOC->bufferPool,
+				struct ARMSOCDRI2PoolEntry, entry));
+		pARMSOC->bufferPoolEvictions++;
+	}
+
+	e->pPixmap = pPixmap;
+	e->client = client;
+	e->scanout = armsoc_bo_buf_type(bo) == ARMSOC_BO_SCANOUT;
+	e->size = armsoc_bo_size(bo);
+	e->releasedNs = armsoc_monotonic_ns();
+	e->epoch = pARMSOC->bufferPoolEpoch;
+
+	if (xorg_list_is_empty(&pARMSOC->bufferPool))
+		pARMSOC->bufferPoolTimer = TimerSet(pARMSOC->bufferPoolTimer,
+				0, ARMSOC_POOL_IDLE_MS, poolTimerCallback,
+				pScreen);
+
+	xorg_list_add(&e->entry, &pARMSOC->bufferPool);
+	pARMSOC->bufferPoolBytes += e->size;
+	return;
+
+destroy:
+	pScreen->DestroyPixmap(pPixmap);
+}
+
+/**
+ * Take a pixmap of the given size and kind of memory, released by the
+ * given client, out of the pool.
+ */
+static PixmapPtr
+poolAcquire(ScreenPtr pScreen, int width, int height, int depth,
+		Bool scanout, int client)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+	struct ARMSOCDRI2PoolEntry *e;
+
+	if (!pARMSOC->bufferPoolActive)
+		return NULL;
+
+	xorg_list_for_each_entry(e, &pARMSOC->bufferPool, entry) {
+		PixmapPtr pPixmap = e->pPixmap;
+		struct armsoc_bo *bo;
+
+		if (pPixmap->drawable.width != width ||
+		    pPixmap->drawable.height != height ||
+		    pPixmap->drawable.depth != depth ||
+		    e->scanout != scanout || e->client != client ||
+		    e->epoch == pARMSOC->bufferPoolEpoch)
+			continue;
+
+		/* Only keep framebuffers for buffers which may be flipped,
+		 * they stop unflippable buffers from being exchanged. */
+		bo = ARMSOCPixmapBo(pPixmap);
+		if (!scanout && armsoc_bo_get_fb(bo))
+			armsoc_bo_rm_fb(bo);
+
+		xorg_list_del(&e->entry);
+		pARMSOC->bufferPoolBytes -= e->size;
+		free(e);
+
+		pARMSOC->bufferPoolHits++;
+		return pPixmap;
+	}
+
+	pARMSOC->bufferPoolMisses++;
+	return NULL;
+}
+
+/**
+ * Free all pooled pixmaps, or just those in scanout memory.
+ */
+static void
+poolFlush(ScreenPtr pScreen, Bool scanoutOnly)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+	struct ARMSOCDRI2PoolEntry *e, *tmp;
+
+	xorg_list_for_each_entry_safe(e, tmp, &pARMSOC->bufferPool, entry) {
+		if (!scanoutOnly || e->scanout)
+			poolEvict(pScreen, e);
+	}
+}
+
+/* Free the pooled pixmaps of clients which have gone away */
+static void
+poolClientState(CallbackListPtr *list, pointer closure, pointer data)
+{
+	ScreenPtr pScreen = closure;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+	ClientPtr client = ((NewClientInfoRec *)data)->client;
+	struct ARMSOCDRI2PoolEntry *e, *tmp;
+
+	if (client->clientState != ClientStateGone &&
+	    client->clientState != ClientStateRetained)
+		return;
+
+	xorg_list_for_each_entry_safe(e, tmp, &pARMSOC->bufferPool, entry) {
+		if (e->client == client->index)
+			poolEvict(pScreen, e);
+	}
+}
+
 static PixmapPtr
 createpix(DrawablePtr pDraw)
 {
 	ScreenPtr pScreen = pDraw->pScreen;
-	int flags = canflip(pDraw) ? ARMSOC_CREATE_PIXMAP_SCANOUT : CREATE_PIXMAP_USAGE_BACKING_PIXMAP;
+	Bool scanout = canflip(pDraw);
+	int flags = scanout ? ARMSOC_CREATE_PIXMAP_SCANOUT : CREATE_PIXMAP_USAGE_BACKING_PIXMAP;
+	PixmapPtr pPixmap;
+
+	pPixmap = poolAcquire(pScreen, pDraw->width, pDraw->height,
+			pDraw->depth, scanout, CLIENT_ID(pDraw->id));
+	if (pPixmap)
+		return pPixmap;
+
 	return pScreen->CreatePixmap(pScreen,
 			pDraw->width, pDraw->height, pDraw->depth, flags);
 }
 
-static inline Bool
-canexchange(DrawablePtr pDraw, struct armsoc_bo *src_bo, struct armsoc_bo *dst_bo)
-{
-	Bool ret = FALSE;
-	ScreenPtr pScreen = pDraw->pScreen;
-	PixmapPtr pRootPixmap, pWindowPixmap;
-	int src_fb_id, dst_fb_id;
+/* Attachments whose buffers coalesce allocations during resizes */
+#define ARMSOC_RESIZE_ATTACHMENTS	(DRI2BufferFakeFrontRight + 1)
+
+/* Interactive resize state of one attachment, see createBackPixmap() */
+struct ARMSOCDRI2ResizeRec {
+	int width;
+	int height;
+	uint64_t lastResizeNs;
+	/* Oversized pixmap shared by the buffers created during a resize
+	 * burst. Holds a reference. */
+	PixmapPtr pixmap;
+};
 
-	pRootPixmap = pScreen->GetWindowPixmap(pScreen->root);
-	pWindowPixmap = pDraw->type == DRAWABLE_PIXMAP ? (PixmapPtr)pDraw : pScreen->GetWindowPixmap((WindowPtr)pDraw);
+/**
+ * Per-window cache of the window half of the canexchange() decision, which
+ * requires walking the window tree and comparing clip regions. It is
+ * invalidated by bumping pARMSOC->exchangeGeneration from the window tree
+ * hooks we wrap below.
+ */
+struct ARMSOCDRI2WindowPrivRec {
+	unsigned long generation;
+	Bool canExchange;
 
-	src_fb_id = armsoc_bo_get_fb(src_bo);
-	dst_fb_id = armsoc_bo_get_fb(dst_bo);
+	/* Interactive resizes, per attachment */
+	struct ARMSOCDRI2ResizeRec resize[ARMSOC_RESIZE_ATTACHMENTS];
 
-	if (pRootPixmap != pWindowPixmap &&
-	    armsoc_bo_width(src_bo) == armsoc_bo_width(dst_bo) &&
-	    armsoc_bo_height(src_bo) == armsoc_bo_height(dst_bo) &&
-	    armsoc_bo_bpp(src_bo) == armsoc_bo_bpp(dst_bo) &&
-	    armsoc_bo_width(src_bo) == pDraw->width &&
-	    armsoc_bo_height(src_bo) == pDraw->height &&
-	    armsoc_bo_bpp(src_bo) == pDraw->bitsPerPixel &&
-	    src_fb_id == 0 && dst_fb_id == 0) {
-		ret = TRUE;
-	}
+	/* Swaps of the window, see recordSwap() */
+	struct ARMSOCDRI2SwapStats swapStats;
+
+	/* CRTC the window has been flipped on alone, which scans out the
+	 * window's buffers instead of the root until the window changes */
+	xf86CrtcPtr flipCrtc;
+};
+
+static DevPrivateKeyRec ARMSOCDRI2WindowPrivateKeyRec;
+#define ARMSOCDRI2WindowPrivateKey (&ARMSOCDRI2WindowPrivateKeyRec)
+
+static inline struct ARMSOCDRI2WindowPrivRec *
+ARMSOCDRI2GetWindowPriv(WindowPtr pWin)
+{
+	return dixLookupPrivate(&pWin->devPrivates, ARMSOCDRI2WindowPrivateKey);
+}
+
+static Bool
+canexchangewindow(WindowPtr pWin)
+{
+	ScreenPtr pScreen = pWin->drawable.pScreen;
+	DrawablePtr pDraw = &pWin->drawable;
+	WindowPtr pWinParent = pWin->parent;
+	PixmapPtr pPixmap = pScreen->GetWindowPixmap(pWin);
+	BoxPtr extents = RegionExtents(&pWin->clipList);
+
+	if (pScreen->GetWindowPixmap(pScreen->root) == pPixmap)
+		return FALSE;
 
 	/*
 	 * Don't exchange for windows which do not own their complete backing storage,
@@ -185,39 +559,521 @@ canexchange(DrawablePtr pDraw, struct armsoc_bo *src_bo, struct armsoc_bo *dst_b
 	 *
 	 * In these cases, fall back to CopyArea which respects the clip.
 	 */
-	if (pDraw->type == DRAWABLE_WINDOW) {
-		ScreenPtr pScreen = pDraw->pScreen;
-		WindowPtr pWin = (WindowPtr) pDraw;
-		WindowPtr pWinParent = pWin->parent;
-		PixmapPtr pPixmap = pScreen->GetWindowPixmap(pWin);
-		BoxPtr extents = RegionExtents(&pWin->clipList);
-
-		if (RegionNumRects(&pWin->clipList) != 1) {
-			if (!RegionEqual(&pWin->clipList, &pWin->borderClip))
-				return FALSE;
+	if (RegionNumRects(&pWin->clipList) != 1) {
+		if (!RegionEqual(&pWin->clipList, &pWin->borderClip))
+			return FALSE;
 
-			while (pWinParent) {
-				PixmapPtr pPixmapParent = pScreen->GetWindowPixmap(pWinParent);
+		while (pWinParent) {
+			PixmapPtr pPixmapParent = pScreen->GetWindowPixmap(pWinParent);
 
-				if (pPixmapParent != pPixmap)
-					break;
-				if (RegionNotEmpty(&pWinParent->clipList))
-					return FALSE;
+			if (pPixmapParent != pPixmap)
+				break;
+			if (RegionNotEmpty(&pWinParent->clipList))
+				return FALSE;
 
-				pWinParent = pWinParent->parent;
-			}
+			pWinParent = pWinParent->parent;
 		}
+	}
 
-		if (extents->x1 != pPixmap->screen_x ||
-		    extents->y1 != pPixmap->screen_y ||
-		    extents->x2 != pDraw->width + pPixmap->screen_x ||
-		    extents->y2 != pDraw->height + pPixmap->screen_y)
-			return FALSE;
+	if (extents->x1 != pPixmap->screen_x ||
+	    extents->y1 != pPixmap->screen_y ||
+	    extents->x2 != pDraw->width + pPixmap->screen_x ||
+	    extents->y2 != pDraw->height + pPixmap->screen_y)
+		return FALSE;
+
+	return TRUE;
+}
+
+static inline Bool
+canexchange(DrawablePtr pDraw, struct armsoc_bo *src_bo, struct armsoc_bo *dst_bo)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCDRI2WindowPrivRec *winPriv;
+	int src_fb_id, dst_fb_id;
+
+	src_fb_id = armsoc_bo_get_fb(src_bo);
+	dst_fb_id = armsoc_bo_get_fb(dst_bo);
+
+	if (armsoc_bo_width(src_bo) != armsoc_bo_width(dst_bo) ||
+	    armsoc_bo_height(src_bo) != armsoc_bo_height(dst_bo) ||
+	    armsoc_bo_bpp(src_bo) != armsoc_bo_bpp(dst_bo) ||
+	    armsoc_bo_width(src_bo) != pDraw->width ||
+	    armsoc_bo_height(src_bo) != pDraw->height ||
+	    armsoc_bo_bpp(src_bo) != pDraw->bitsPerPixel ||
+	    src_fb_id != 0 || dst_fb_id != 0)
+		return FALSE;
+
+	if (pDraw->type != DRAWABLE_WINDOW)
+		return (PixmapPtr)pDraw != pScreen->GetWindowPixmap(pScreen->root);
+
+	winPriv = ARMSOCDRI2GetWindowPriv((WindowPtr)pDraw);
+	if (winPriv->generation == pARMSOC->exchangeGeneration) {
+		pARMSOC->exchangeCacheHits++;
+		return winPriv->canExchange;
+	}
+
+	pARMSOC->exchangeCacheMisses++;
+	winPriv->canExchange = canexchangewindow((WindowPtr)pDraw);
+	winPriv->generation = pARMSOC->exchangeGeneration;
+
+	return winPriv->canExchange;
+}
+
+/*
+ * Window tree hooks. Any change to the clip, geometry, parent or backing
+ * pixmap of a window can change the canexchange() decision for it or for
+ * its descendants, so throw away all cached decisions on the screen.
+ */
+/* Put the CRTC the window has been flipping on alone back on the root.
+ * The window tree hooks leave the mode set for the BlockHandler. */
+static void
+restoreFlipCrtc(WindowPtr pWin, Bool defer)
+{
+	struct ARMSOCDRI2WindowPrivRec *winPriv = ARMSOCDRI2GetWindowPriv(pWin);
+
+	if (winPriv->flipCrtc) {
+		if (defer)
+			drmmode_crtc_defer_restore(winPriv->flipCrtc);
+		else
+			drmmode_crtc_restore_scanout(winPriv->flipCrtc);
+		winPriv->flipCrtc = NULL;
+	}
+}
+
+static void
+ARMSOCDRI2ClipNotify(WindowPtr pWin, int dx, int dy)
+{
+	ScreenPtr pScreen = pWin->drawable.pScreen;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+
+	pARMSOC->exchangeGeneration++;
+	restoreFlipCrtc(pWin, TRUE);
+
+	unwrap(pARMSOC, pScreen, ClipNotify);
+	if (pScreen->ClipNotify)
+		pScreen->ClipNotify(pWin, dx, dy);
+	wrap(pARMSOC, pScreen, ClipNotify, ARMSOCDRI2ClipNotify);
+}
+
+static int
+ARMSOCDRI2ConfigNotify(WindowPtr pWin, int x, int y, int w, int h, int bw,
+		WindowPtr pSib)
+{
+	ScreenPtr pScreen = pWin->drawable.pScreen;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+	int ret = Success;
+
+	pARMSOC->exchangeGeneration++;
+
+	unwrap(pARMSOC, pScreen, ConfigNotify);
+	if (pScreen->ConfigNotify)
+		ret = pScreen->ConfigNotify(pWin, x, y, w, h, bw, pSib);
+	wrap(pARMSOC, pScreen, ConfigNotify, ARMSOCDRI2ConfigNotify);
+
+	return ret;
+}
+
+static void
+ARMSOCDRI2ReparentWindow(WindowPtr pWin, WindowPtr pPriorParent)
+{
+	ScreenPtr pScreen = pWin->drawable.pScreen;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+
+	pARMSOC->exchangeGeneration++;
+
+	unwrap(pARMSOC, pScreen, ReparentWindow);
+	if (pScreen->ReparentWindow)
+		pScreen->ReparentWindow(pWin, pPriorParent);
+	wrap(pARMSOC, pScreen, ReparentWindow, ARMSOCDRI2ReparentWindow);
+}
+
+static void
+ARMSOCDRI2SetWindowPixmap(WindowPtr pWin, PixmapPtr pPixmap)
+{
+	ScreenPtr pScreen = pWin->drawable.pScreen;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+
+	pARMSOC->exchangeGeneration++;
+	restoreFlipCrtc(pWin, TRUE);
+
+	unwrap(pARMSOC, pScreen, SetWindowPixmap);
+	pScreen->SetWindowPixmap(pWin, pPixmap);
+	wrap(pARMSOC, pScreen, SetWindowPixmap, ARMSOCDRI2SetWindowPixmap);
+}
+
+static void
+releaseResizePixmap(ScreenPtr pScreen, struct ARMSOCDRI2ResizeRec *resize)
+{
+	if (resize->pixmap) {
+		pScreen->DestroyPixmap(resize->pixmap);
+		resize->pixmap = NULL;
 	}
+}
+
+static Bool
+ARMSOCDRI2DestroyWindow(WindowPtr pWin)
+{
+	ScreenPtr pScreen = pWin->drawable.pScreen;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+	struct ARMSOCDRI2WindowPrivRec *winPriv = ARMSOCDRI2GetWindowPriv(pWin);
+	Bool ret = TRUE;
+	int i;
+
+	for (i = 0; i < ARMSOC_RESIZE_ATTACHMENTS; i++)
+		releaseResizePixmap(pScreen, &winPriv->resize[i]);
+	restoreFlipCrtc(pWin, TRUE);
+
+	unwrap(pARMSOC, pScreen, DestroyWindow);
+	if (pScreen->DestroyWindow)
+		ret = pScreen->DestroyWindow(pWin);
+	wrap(pARMSOC, pScreen, DestroyWindow, ARMSOCDRI2DestroyWindow);
 
 	return ret;
 }
 
+/*
+ * Interactive resizes: while the user drags a window edge, the client gets
+ * new buffers for every ConfigureNotify. Rather than allocating (and soon
+ * freeing) an exact-size back pixmap each time, buffers created in quick
+ * succession share an oversized pixmap, of which the client only uses the
+ * top left. Swaps blit the sub-rectangle covering the window. Once the size
+ * has been stable for a while, the next swap moves the buffer to an
+ * exact-size pixmap again.
+ */
+
+/* Resizes less than this far apart make up a burst */
+#define ARMSOC_RESIZE_SETTLE_MS		250
+/* Granularity of the oversized pixmaps allocated during a burst */
+#define ARMSOC_RESIZE_STEP		128
+
+static int
+resizeStep(int size)
+{
+	size += size / 4;
+	return (size + ARMSOC_RESIZE_STEP - 1) & ~(ARMSOC_RESIZE_STEP - 1);
+}
+
+/**
+ * Create a back pixmap for an attachment of a drawable, coalescing
+ * allocations for windows that are being resized interactively. Each
+ * attachment is tracked on its own, so that the buffers of one GetBuffers
+ * request never share a pixmap.
+ */
+static PixmapPtr
+createBackPixmap(DrawablePtr pDraw, unsigned int attachment)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+	struct ARMSOCDRI2ResizeRec *resize;
+	PixmapPtr pPixmap;
+	uint64_t now;
+	Bool resized, burst;
+
+	if (pDraw->type != DRAWABLE_WINDOW || canflip(pDraw) ||
+	    attachment >= ARMSOC_RESIZE_ATTACHMENTS)
+		return createpix(pDraw);
+
+	resize = &ARMSOCDRI2GetWindowPriv((WindowPtr)pDraw)->resize[attachment];
+	now = armsoc_monotonic_ns();
+	resized = resize->width &&
+		(resize->width != pDraw->width ||
+		 resize->height != pDraw->height);
+	burst = resized && now - resize->lastResizeNs <
+			(uint64_t)ARMSOC_RESIZE_SETTLE_MS * 1000000;
+
+	if (resized)
+		resize->lastResizeNs = now;
+	resize->width = pDraw->width;
+	resize->height = pDraw->height;
+
+	if (!burst) {
+		releaseResizePixmap(pScreen, resize);
+		return createpix(pDraw);
+	}
+
+	/* Share the pixmap of the previous buffer if the new size fits */
+	pPixmap = resize->pixmap;
+	if (pPixmap && pPixmap->drawable.width >= pDraw->width &&
+	    pPixmap->drawable.height >= pDraw->height &&
+	    pPixmap->drawable.depth == pDraw->depth) {
+		pPixmap->refcnt++;
+		pARMSOC->resizeShared++;
+		return pPixmap;
+	}
+
+	pPixmap = pScreen->CreatePixmap(pScreen, resizeStep(pDraw->width),
+			resizeStep(pDraw->height), pDraw->depth,
+			CREATE_PIXMAP_USAGE_BACKING_PIXMAP);
+	if (!pPixmap)
+		return createpix(pDraw);
+
+	releaseResizePixmap(pScreen, resize);
+	resize->pixmap = pPixmap;
+	pPixmap->refcnt++;
+	pARMSOC->resizeStepped++;
+
+	return pPixmap;
+}
+
+/**
+ * Called after a swap from a back buffer: if the buffer uses an oversized
+ * pixmap from a resize burst that has since settled, replace it with an
+ * exact-size one. Like nextBuffer(), the client picks up the new name on
+ * its next DRI2GetBuffers.
+ */
+static void
+settleBackBuffer(DrawablePtr pDraw, struct ARMSOCDRI2BufferRec *backBuf)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	unsigned int attachment = DRIBUF(backBuf)->attachment;
+	struct ARMSOCDRI2ResizeRec *resize;
+	PixmapPtr pOldPixmap = backBuf->pPixmaps[backBuf->currentPixmap];
+	PixmapPtr pNewPixmap;
+	struct armsoc_bo *old_bo, *new_bo;
+	uint32_t name;
+
+	if (pOldPixmap->drawable.width == backBuf->width &&
+	    pOldPixmap->drawable.height == backBuf->height)
+		return;
+
+	/* Stale buffer, the client will ask for a new one anyway */
+	if (pDraw->type != DRAWABLE_WINDOW ||
+	    attachment >= ARMSOC_RESIZE_ATTACHMENTS ||
+	    pDraw->width != backBuf->width ||
+	    pDraw->height != backBuf->height)
+		return;
+
+	resize = &ARMSOCDRI2GetWindowPriv((WindowPtr)pDraw)->resize[attachment];
+	if (armsoc_monotonic_ns() - resize->lastResizeNs <
+			(uint64_t)ARMSOC_RESIZE_SETTLE_MS * 1000000)
+		return;
+
+	pNewPixmap = createpix(pDraw);
+	if (!pNewPixmap)
+		return;
+
+	new_bo = ARMSOCPixmapBo(pNewPixmap);
+	if (!new_bo || armsoc_bo_get_name(new_bo, &name)) {
+		pScreen->DestroyPixmap(pNewPixmap);
+		return;
+	}
+
+	DEBUG_MSG("settling %dx%d back buffer of drawable %p",
+			backBuf->width, backBuf->height, pDraw);
+
+	ARMSOCRegisterExternalAccess(pNewPixmap);
+	ARMSOCDeregisterExternalAccess(pOldPixmap);
+
+	old_bo = ARMSOCPixmapBo(pOldPixmap);
+	if (backBuf->bo == old_bo) {
+		armsoc_bo_reference(new_bo);
+		armsoc_bo_unreference(backBuf->bo);
+		backBuf->bo = new_bo;
+	}
+
+	poolRelease(pScreen, pOldPixmap, backBuf->client);
+	releaseResizePixmap(pScreen, resize);
+
+	backBuf->pPixmaps[backBuf->currentPixmap] = pNewPixmap;
+	backBuf->ages[backBuf->currentPixmap] = 0;
+	DRIBUF(backBuf)->name = name;
+	DRIBUF(backBuf)->pitch = exaGetPixmapPitch(pNewPixmap);
+	setBufferFlags(backBuf);
+
+	pARMSOC->resizeSettled++;
+}
+
+/*
+ * Adaptive buffering: a flipping drawable which keeps missing vblanks while
+ * its frames were ready in time is given an extra back buffer, and
+ * drawables which go idle, or all of them when scanout memory runs short,
+ * are shrunk back to the number of buffers they were created with.
+ */
+
+/* Most back pixmaps adaptive buffering grows a drawable to (triple
+ * buffering), unless DRI2MaxBuffers asks for more */
+#define ARMSOC_ADAPTIVE_MAX_PIXMAPS	2
+/* Number of consecutive swaps over which missed vblanks are counted */
+#define ARMSOC_ADAPTIVE_WINDOW		32
+/* Missed vblanks within a window that make a drawable grow */
+#define ARMSOC_ADAPTIVE_GROW_MISSES	8
+/* Swaps further apart than this many frames are not consecutive */
+#define ARMSOC_ADAPTIVE_GAP_FRAMES	4
+/* Grown drawables which haven't swapped for this long are shrunk */
+#define ARMSOC_ADAPTIVE_IDLE_MS		2000
+/* Don't grow drawables for this long after running out of scanout memory */
+#define ARMSOC_ADAPTIVE_PRESSURE_MS	10000
+
+/**
+ * Free the extra back pixmaps of a grown buffer. The current pixmap is
+ * never freed: it may be waiting to be flipped, or be rendered to by the
+ * client. The others only hold old frames.
+ */
+static void
+shrinkBuffer(ScreenPtr pScreen, struct ARMSOCDRI2BufferRec *buf)
+{
+	while (buf->numPixmaps > buf->basePixmaps) {
+		unsigned victim = (buf->currentPixmap + 1) % buf->numPixmaps;
+		unsigned i;
+
+		if (buf->pPixmaps[victim]) {
+			ARMSOCDeregisterExternalAccess(buf->pPixmaps[victim]);
+			poolRelease(pScreen, buf->pPixmaps[victim],
+					buf->client);
+		}
+
+		for (i = victim; i + 1 < buf->capacity; i++) {
+			buf->pPixmaps[i] = buf->pPixmaps[i + 1];
+			buf->ages[i] = buf->ages[i + 1];
+		}
+		buf->pPixmaps[buf->capacity - 1] = NULL;
+
+		if (buf->currentPixmap > victim)
+			buf->currentPixmap--;
+		buf->numPixmaps--;
+	}
+
+	xorg_list_del(&buf->adaptiveEntry);
+	xorg_list_init(&buf->adaptiveEntry);
+}
+
+static CARD32
+adaptiveTimerCallback(OsTimerPtr timer, CARD32 time, void *arg)
+{
+	ScreenPtr pScreen = arg;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCDRI2BufferRec *buf, *tmp;
+	uint64_t now = armsoc_monotonic_ns();
+
+	xorg_list_for_each_entry_safe(buf, tmp, &pARMSOC->adaptiveList,
+			adaptiveEntry) {
+		if (now - buf->lastSwapNs <
+				(uint64_t)ARMSOC_ADAPTIVE_IDLE_MS * 1000000)
+			continue;
+
+		DEBUG_MSG("shrinking idle DRI2 buffer %p to %d buffers",
+				buf, buf->basePixmaps + 1);
+		shrinkBuffer(pScreen, buf);
+		pARMSOC->adaptiveIdleShrinks++;
+	}
+
+	return xorg_list_is_empty(&pARMSOC->adaptiveList) ?
+			0 : ARMSOC_ADAPTIVE_IDLE_MS;
+}
+
+/**
+ * Called when scanout memory allocation has failed: give back the memory
+ * held by grown buffers, and stop growing them for a while.
+ */
+static void
+relieveScanoutPressure(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCDRI2BufferRec *buf, *tmp;
+
+	poolFlush(pScreen, TRUE);
+
+	if (!pARMSOC->adaptiveBufs)
+		return;
+
+	pARMSOC->scanoutPressureNs = armsoc_monotonic_ns();
+
+	xorg_list_for_each_entry_safe(buf, tmp, &pARMSOC->adaptiveList,
+			adaptiveEntry) {
+		DEBUG_MSG("shrinking DRI2 buffer %p to %d buffers to free scanout memory",
+				buf, buf->basePixmaps + 1);
+		shrinkBuffer(pScreen, buf);
+		pARMSOC->adaptivePressureShrinks++;
+	}
+}
+
+/**
+ * Called on each completed flip of a back buffer, before moving on to the
+ * next pixmap. Flips which land more than one frame after the previous one,
+ * although the client asked for them within a frame of getting its buffer
+ * back, mean it was kept waiting for a free buffer; if that keeps
+ * happening, let the next nextBuffer() allocate an extra pixmap. Clients
+ * which take longer than a frame to render are not helped by more buffers,
+ * so their late flips don't count.
+ */
+static void
+adaptBufferCount(ScreenPtr pScreen, struct ARMSOCDRI2BufferRec *backBuf)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	uint64_t period = drmmode_frame_period_ns(pScrn, NULL);
+	uint64_t now = armsoc_monotonic_ns();
+	uint64_t delta = now - backBuf->lastSwapNs;
+
+	if (!pARMSOC->adaptiveBufs)
+		return;
+
+	if (backBuf->lastSwapNs && delta < ARMSOC_ADAPTIVE_GAP_FRAMES * period) {
+		backBuf->windowSwaps++;
+		if (delta > period * 3 / 2 && backBuf->renderNs < period) {
+			backBuf->windowMisses++;
+			pARMSOC->adaptiveMissedSwaps++;
+		}
+	}
+	backBuf->lastSwapNs = now;
+
+	if (backBuf->windowSwaps < ARMSOC_ADAPTIVE_WINDOW)
+		return;
+
+	if (backBuf->windowMisses >= ARMSOC_ADAPTIVE_GROW_MISSES &&
+	    backBuf->numPixmaps < backBuf->capacity &&
+	    now - pARMSOC->scanoutPressureNs >
+			(uint64_t)ARMSOC_ADAPTIVE_PRESSURE_MS * 1000000) {
+		DEBUG_MSG("growing DRI2 buffer %p to %d buffers after %u of %u swaps missed vblank",
+				backBuf, backBuf->numPixmaps + 2,
+				backBuf->windowMisses, backBuf->windowSwaps);
+		backBuf->numPixmaps++;
+		pARMSOC->adaptiveGrows++;
+
+		if (xorg_list_is_empty(&backBuf->adaptiveEntry)) {
+			if (xorg_list_is_empty(&pARMSOC->adaptiveList))
+				pARMSOC->adaptiveTimer = TimerSet(
+						pARMSOC->adaptiveTimer, 0,
+						ARMSOC_ADAPTIVE_IDLE_MS,
+						adaptiveTimerCallback, pScreen);
+			xorg_list_add(&backBuf->adaptiveEntry,
+					&pARMSOC->adaptiveList);
+		}
+	}
+
+	backBuf->windowSwaps = 0;
+	backBuf->windowMisses = 0;
+}
+
+/**
+ * A window flipped on a CRTC of its own keeps the root as its front buffer,
+ * so its back buffer needs a second pixmap to render to while the first is
+ * on screen. Returns whether it has, or now may allocate, one.
+ */
+static Bool
+growForCrtcFlip(ScreenPtr pScreen, struct ARMSOCDRI2BufferRec *backBuf)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+
+	if (backBuf->numPixmaps > 1)
+		return TRUE;
+
+	if (backBuf->capacity < 2 ||
+	    armsoc_monotonic_ns() - pARMSOC->scanoutPressureNs <=
+			(uint64_t)ARMSOC_ADAPTIVE_PRESSURE_MS * 1000000)
+		return FALSE;
+
+	/* nextBuffer() allocates it once the first has been flipped */
+	backBuf->numPixmaps = 2;
+	return TRUE;
+}
+
 static Bool CreateBufferResources(DrawablePtr pDraw, DRI2BufferPtr buffer)
 {
 	ScreenPtr pScreen = pDraw->pScreen;
@@ -231,7 +1087,7 @@ static Bool CreateBufferResources(DrawablePtr pDraw, DRI2BufferPtr buffer)
 		pPixmap = draw2pix(pDraw);
 		pPixmap->refcnt++;
 	} else {
-		pPixmap = createpix(pDraw);
+		pPixmap = createBackPixmap(pDraw, buffer->attachment);
 	}
 
 	if (!pPixmap) {
@@ -242,6 +1098,9 @@ static Bool CreateBufferResources(DrawablePtr pDraw, DRI2BufferPtr buffer)
 
 	buf->pPixmaps[0] = pPixmap;
 	assert(buf->currentPixmap == 0);
+	buf->ages[0] = 0;
+	buf->width = pDraw->width;
+	buf->height = pDraw->height;
 
 	bo = ARMSOCPixmapBo(pPixmap);
 	if (!bo) {
@@ -253,6 +1112,7 @@ static Bool CreateBufferResources(DrawablePtr pDraw, DRI2BufferPtr buffer)
 	DRIBUF(buf)->pitch = exaGetPixmapPitch(pPixmap);
 	DRIBUF(buf)->cpp = pPixmap->drawable.bitsPerPixel / 8;
 	DRIBUF(buf)->flags = 0;
+	setBufferFlags(buf);
 
 	ret = armsoc_bo_get_name(bo, &DRIBUF(buf)->name);
 	if (ret) {
@@ -260,7 +1120,8 @@ static Bool CreateBufferResources(DrawablePtr pDraw, DRI2BufferPtr buffer)
 		goto fail;
 	}
 
-	if (canflip(pDraw) && buffer->attachment != DRI2BufferFrontLeft) {
+	if (canflip(pDraw) && buffer->attachment != DRI2BufferFrontLeft &&
+	    !armsoc_bo_get_fb(bo)) {
 		/* Create an fb around this buffer. This will fail and we will
 		 * fall back to blitting if the display controller hardware
 		 * cannot scan out this buffer (for example, if it doesn't
@@ -275,6 +1136,7 @@ static Bool CreateBufferResources(DrawablePtr pDraw, DRI2BufferPtr buffer)
 		if (ret) {
 			WARNING_MSG(
 					"Falling back to blitting a flippable window");
+			relieveScanoutPressure(pScreen);
 		}
 	}
 
@@ -308,19 +1170,14 @@ static void DestroyBufferResources(DrawablePtr pDraw, DRI2BufferPtr buffer)
 	 * instead (since it is at least refcntd)
 	 */
 	ScreenPtr pScreen = buf->pPixmaps[0]->drawable.pScreen;
-	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	int numBuffers, i;
+	unsigned i;
 
-	if (buffer->attachment == DRI2BufferBackLeft) {
-		assert(pARMSOC->driNumBufs > 1);
-		numBuffers = pARMSOC->driNumBufs-1;
-	} else
-		numBuffers = 1;
-
-	for (i = 0; i < numBuffers && buf->pPixmaps[i] != NULL; i++) {
+	for (i = 0; i < buf->capacity && buf->pPixmaps[i] != NULL; i++) {
 		ARMSOCDeregisterExternalAccess(buf->pPixmaps[i]);
-		pScreen->DestroyPixmap(buf->pPixmaps[i]);
+		if (buffer->attachment == DRI2BufferFrontLeft)
+			pScreen->DestroyPixmap(buf->pPixmaps[i]);
+		else
+			poolRelease(pScreen, buf->pPixmaps[i], buf->client);
 	}
 
 	armsoc_bo_unreference(buf->bo);
@@ -353,22 +1210,29 @@ ARMSOCDRI2CreateBuffer(DrawablePtr pDraw, unsigned int attachment,
 		return NULL;
 	}
 
-	if (attachment == DRI2BufferBackLeft && pARMSOC->driNumBufs > 2) {
-		buf->pPixmaps = calloc(pARMSOC->driNumBufs-1,
-				sizeof(PixmapPtr));
+	if (attachment == DRI2BufferBackLeft && pARMSOC->driNumBufs > 2)
 		buf->numPixmaps = pARMSOC->driNumBufs-1;
-	} else {
-		buf->pPixmaps = malloc(sizeof(PixmapPtr));
+	else
 		buf->numPixmaps = 1;
-	}
+	buf->basePixmaps = buf->numPixmaps;
+
+	buf->capacity = buf->numPixmaps;
+	if (attachment == DRI2BufferBackLeft && pARMSOC->adaptiveBufs &&
+	    buf->capacity < ARMSOC_ADAPTIVE_MAX_PIXMAPS)
+		buf->capacity = ARMSOC_ADAPTIVE_MAX_PIXMAPS;
+
+	buf->pPixmaps = calloc(buf->capacity, sizeof(PixmapPtr));
+	buf->ages = calloc(buf->capacity, sizeof(*buf->ages));
+	xorg_list_init(&buf->adaptiveEntry);
 
-	if (!buf->pPixmaps) {
+	if (!buf->pPixmaps || !buf->ages) {
 		ERROR_MSG("Failed to allocate PixmapPtr array for DRI2Buffer");
 		goto fail;
 	}
 
 	DRIBUF(buf)->attachment = attachment;
 	DRIBUF(buf)->format = format;
+	buf->client = CLIENT_ID(pDraw->id);
 	buf->refcnt = 1;
 	if (!CreateBufferResources(pDraw, DRIBUF(buf)))
 		goto fail;
@@ -376,12 +1240,67 @@ ARMSOCDRI2CreateBuffer(DrawablePtr pDraw, unsigned int attachment,
 	return DRIBUF(buf);
 
 fail:
+	free(buf->ages);
 	free(buf->pPixmaps);
 	free(buf);
 
 	return NULL;
 }
 
+/**
+ * Replace the pixmap in slot i of a back buffer with one allocated for the
+ * drawable's current flippability, keeping its contents. Used when a
+ * buffer has to move from ordinary memory to scanout-capable memory.
+ */
+static Bool
+migrateBufferPixmap(DrawablePtr pDraw, struct ARMSOCDRI2BufferRec *buf,
+		unsigned i)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	PixmapPtr pOldPixmap = buf->pPixmaps[i];
+	PixmapPtr pNewPixmap;
+	struct armsoc_bo *old_bo = ARMSOCPixmapBo(pOldPixmap);
+	struct armsoc_bo *new_bo;
+	GCPtr pGC;
+
+	pNewPixmap = createpix(pDraw);
+	if (!pNewPixmap)
+		return FALSE;
+
+	/* Allocation falls back to ordinary memory when scanout memory is
+	 * short, in which case there is no point in migrating. */
+	new_bo = ARMSOCPixmapBo(pNewPixmap);
+	if (!new_bo || armsoc_bo_buf_type(new_bo) != ARMSOC_BO_SCANOUT) {
+		pScreen->DestroyPixmap(pNewPixmap);
+		return FALSE;
+	}
+
+	pGC = GetScratchGC(pNewPixmap->drawable.depth, pScreen);
+	if (!pGC) {
+		pScreen->DestroyPixmap(pNewPixmap);
+		return FALSE;
+	}
+	ValidateGC(&pNewPixmap->drawable, pGC);
+	pGC->ops->CopyArea(&pOldPixmap->drawable, &pNewPixmap->drawable, pGC,
+			0, 0, pOldPixmap->drawable.width,
+			pOldPixmap->drawable.height, 0, 0);
+	FreeScratchGC(pGC);
+
+	ARMSOCRegisterExternalAccess(pNewPixmap);
+	ARMSOCDeregisterExternalAccess(pOldPixmap);
+
+	if (buf->bo == old_bo) {
+		armsoc_bo_reference(new_bo);
+		armsoc_bo_unreference(buf->bo);
+		buf->bo = new_bo;
+	}
+
+	poolRelease(pScreen, pOldPixmap, buf->client);
+	buf->pPixmaps[i] = pNewPixmap;
+
+	return TRUE;
+}
+
 /* Called when DRI2 is handling a GetBuffers request and is going to
  * reuse a buffer that we created earlier.
  * Our interest in this situation is that we might have omitted creating
@@ -392,6 +1311,12 @@ fail:
  * We avoid creating a framebuffer when it is not necessary in order to save
  * on scanout memory which is potentially scarce.
  *
+ * The conversion is done in place where possible: framebuffers are added to
+ * or removed from the existing bos, and a pixmap is only reallocated (with
+ * its contents preserved) when it lives in memory which cannot be scanned
+ * out. Unmapping a fullscreen window and mapping it again therefore does
+ * not cost a new scanout allocation.
+ *
  * Mali r4p0 is generally light on calling GetBuffers (e.g. it doesn't do it
  * in response to an InvalidateBuffers event) but we have determined
  * experimentally that it does always seem to call GetBuffers upon a
@@ -400,10 +1325,13 @@ fail:
 static void
 ARMSOCDRI2ReuseBufferNotify(DrawablePtr pDraw, DRI2BufferPtr buffer)
 {
+	ScreenPtr pScreen = pDraw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	struct ARMSOCDRI2BufferRec *buf = ARMSOCBUF(buffer);
 	struct armsoc_bo *bo;
 	Bool flippable;
 	int fb_id;
+	unsigned i;
 
 	if (buffer->attachment == DRI2BufferFrontLeft)
 		return;
@@ -415,24 +1343,57 @@ ARMSOCDRI2ReuseBufferNotify(DrawablePtr pDraw, DRI2BufferPtr buffer)
 	/* Detect unflippable-to-flippable transition:
 	 * Window is flippable, but we haven't yet tried to allocate a
 	 * framebuffer for it, and it doesn't already have a framebuffer.
-         * Also it was allocated as a pixmap, but now we need it as scanout.
 	 * This can happen when CreateBuffer was called before the window
 	 * was mapped, and we have now been mapped. */
 	if (flippable && !buf->attempted_fb_alloc && fb_id == 0) {
-		DestroyBufferResources(pDraw, buffer);
-		CreateBufferResources(pDraw, buffer);
+		Bool fallback = FALSE;
+
+		buf->attempted_fb_alloc = TRUE;
+
+		for (i = 0; i < buf->numPixmaps && buf->pPixmaps[i]; i++) {
+			bo = ARMSOCPixmapBo(buf->pPixmaps[i]);
+
+			/* It was allocated as a pixmap, but now we need it
+			 * as scanout. */
+			if (armsoc_bo_buf_type(bo) != ARMSOC_BO_SCANOUT) {
+				if (!migrateBufferPixmap(pDraw, buf, i)) {
+					fallback = TRUE;
+					continue;
+				}
+				bo = ARMSOCPixmapBo(buf->pPixmaps[i]);
+			}
+
+			if (armsoc_bo_get_fb(bo) == 0 && armsoc_bo_add_fb(bo))
+				fallback = TRUE;
+		}
+
+		if (fallback) {
+			WARNING_MSG(
+				"Falling back to blitting a flippable window");
+			relieveScanoutPressure(pScreen);
+		}
+
+		/* The current pixmap may have been replaced */
+		bo = ARMSOCPixmapBo(buf->pPixmaps[buf->currentPixmap]);
+		DRIBUF(buf)->pitch = exaGetPixmapPitch(
+				buf->pPixmaps[buf->currentPixmap]);
+		if (armsoc_bo_get_name(bo, &DRIBUF(buf)->name))
+			ERROR_MSG("could not get buffer name");
 	}
 
 	/* Detect flippable-to-unflippable transition:
 	 * Window is now unflippable, but we have a framebuffer allocated for
-	 * it, and it is using scanout memory. We can now free the framebuffer
-	 * and switch it back to a backing pixmap allocation to save on
-	 * scanout memory. */
+	 * it. Drop the framebuffers so that the buffers can be exchanged
+	 * again, but keep the memory, which is likely to be needed for
+	 * flipping again soon. */
 	if (!flippable && fb_id != 0) {
-	        buf->attempted_fb_alloc = FALSE;
-		armsoc_bo_rm_fb(bo);
-		DestroyBufferResources(pDraw, buffer);
-		CreateBufferResources(pDraw, buffer);
+		buf->attempted_fb_alloc = FALSE;
+
+		for (i = 0; i < buf->numPixmaps && buf->pPixmaps[i]; i++) {
+			bo = ARMSOCPixmapBo(buf->pPixmaps[i]);
+			if (armsoc_bo_get_fb(bo))
+				armsoc_bo_rm_fb(bo);
+		}
 	}
 }
 
@@ -454,7 +1415,10 @@ ARMSOCDRI2DestroyBuffer(DrawablePtr pDraw, DRI2BufferPtr buffer)
 
 	DEBUG_MSG("pDraw=%p, buffer=%p", pDraw, buffer);
 
+	xorg_list_del(&buf->adaptiveEntry);
 	DestroyBufferResources(pDraw, buffer);
+	armsoc_bo_unreference(buf->frontFrameBo);
+	free(buf->ages);
 	free(buf->pPixmaps);
 	free(buf);
 }
@@ -482,6 +1446,12 @@ ARMSOCDRI2CopyRegion(DrawablePtr pDraw, RegionPtr pRegion,
 
 	DEBUG_MSG("pDraw=%p, pDstBuffer=%p (%p), pSrcBuffer=%p (%p)",
 			pDraw, pDstBuffer, pSrcDraw, pSrcBuffer, pDstDraw);
+
+	/* The root is stale under a CRTC the window flips on alone */
+	if (pDraw->type == DRAWABLE_WINDOW &&
+	    (pDstBuffer->attachment == DRI2BufferFrontLeft ||
+	     pSrcBuffer->attachment == DRI2BufferFrontLeft))
+		restoreFlipCrtc((WindowPtr)pDraw, FALSE);
 	pGC = GetScratchGC(pDstDraw->depth, pScreen);
 	if (!pGC)
 		return;
@@ -494,14 +1464,6 @@ ARMSOCDRI2CopyRegion(DrawablePtr pDraw, RegionPtr pRegion,
 	(*pGC->funcs->ChangeClip) (pGC, CT_REGION, pCopyClip, 0);
 	ValidateGC(pDstDraw, pGC);
 
-	/* If the dst is the framebuffer, and we had a way to
-	 * schedule a deferred blit synchronized w/ vsync, that
-	 * would be a nice thing to do utilize here to avoid
-	 * tearing..  when we have sync object support for GEM
-	 * buffers, I think we could do something more clever
-	 * here.
-	 */
-
 	pGC->ops->CopyArea(pSrcDraw, pDstDraw, pGC,
 			0, 0, pDraw->width, pDraw->height, 0, 0);
 
@@ -509,8 +1471,8 @@ ARMSOCDRI2CopyRegion(DrawablePtr pDraw, RegionPtr pRegion,
 }
 
 /**
- * Get current frame count and frame count timestamp, based on drawable's
- * crtc.
+ * Get current frame count and frame count timestamp. They keep counting
+ * while the CRTC is turned off by DPMS, see drmmode_get_msc().
  */
 static int
 ARMSOCDRI2GetMSC(DrawablePtr pDraw, CARD64 *ust, CARD64 *msc)
@@ -518,33 +1480,28 @@ ARMSOCDRI2GetMSC(DrawablePtr pDraw, CARD64 *ust, CARD64 *msc)
 	ScreenPtr pScreen = pDraw->pScreen;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	drmVBlank vbl = { .request = {
-		.type = DRM_VBLANK_RELATIVE,
-		.sequence = 0,
-	} };
-	int ret;
+	uint64_t frame_ust, frame_msc;
 
 	if (!pARMSOC->drmmode_interface->vblank_query_supported)
 		return FALSE;
 
-	ret = drmWaitVBlank(pARMSOC->drmFD, &vbl);
-	if (ret) {
-		ERROR_MSG("get vblank counter failed: %s", strerror(errno));
+	if (!drmmode_get_msc(pScrn, &frame_ust, &frame_msc))
 		return FALSE;
-	}
 
 	if (ust)
-		*ust = ((CARD64)vbl.reply.tval_sec * 1000000)
-			+ vbl.reply.tval_usec;
+		*ust = frame_ust;
 
 	if (msc)
-		*msc = vbl.reply.sequence;
+		*msc = frame_msc;
 
 	return TRUE;
 }
 
-#define ARMSOC_SWAP_FAKE_FLIP (1 << 0)
-#define ARMSOC_SWAP_FAIL      (1 << 1)
+#define ARMSOC_SWAP_FAKE_FLIP   (1 << 0)
+/* The flip failed, or was rolled back, and the swap fell back to a copy */
+#define ARMSOC_SWAP_FLIP_FAILED (1 << 1)
+/* A band of the blit had to be copied while the beam was in the way */
+#define ARMSOC_SWAP_BEAM_MISSED (1 << 2)
 
 struct ARMSOCDRISwapCmd {
 	int type;
@@ -557,12 +1514,29 @@ struct ARMSOCDRISwapCmd {
 	DRI2BufferPtr pDstBuffer;
 	DRI2BufferPtr pSrcBuffer;
 	DRI2SwapEventPtr func;
-	int swapCount;
 	int flags;
 	void *data;
 
 	struct armsoc_bo *old_src_bo;
 	struct armsoc_bo *old_dst_bo;
+
+	/* When the swap was scheduled, for the latency statistics */
+	uint64_t scheduledNs;
+
+	/* CRTC flipped alone, NULL for flips of the whole screen */
+	xf86CrtcPtr crtc;
+
+	/* Blits to the scanout waiting for the beam to move out of the way:
+	 * the next line to copy, and when to carry on, see blitSwap() */
+	struct xorg_list blitEntry;
+	int blitY;
+	uint64_t blitResumeNs;
+
+	/* Swaps held while the DRI2 CRTC is off: when they are due and what
+	 * to do with them then, see paceSwap() */
+	struct xorg_list paceEntry;
+	uint64_t paceDueNs;
+	void (*paceDone)(struct ARMSOCDRISwapCmd *cmd);
 };
 
 static const char * const swap_names[] = {
@@ -634,9 +1608,8 @@ static void nextBuffer(DrawablePtr pDraw, struct ARMSOCDRI2BufferRec *backBuf)
 {
 	ScreenPtr pScreen = pDraw->pScreen;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
 
-	if (pARMSOC->driNumBufs <= 2) {
+	if (backBuf->numPixmaps <= 1) {
 		/*Only using double buffering, leave the pixmap as-is */
 		return;
 	}
@@ -660,7 +1633,9 @@ static void nextBuffer(DrawablePtr pDraw, struct ARMSOCDRI2BufferRec *backBuf)
 			&backBuf->pPixmaps[backBuf->currentPixmap];
 		ret = allocNextBuffer(pDraw, curBackPix,
 			&DRIBUF(backBuf)->name);
-		if (!ret) {
+		if (ret) {
+			backBuf->ages[backBuf->currentPixmap] = 0;
+		} else {
 			/* can't have failed on the first buffer */
 			assert(backBuf->currentPixmap > 0);
 			/* Fall back to last buffer */
@@ -671,8 +1646,11 @@ static void nextBuffer(DrawablePtr pDraw, struct ARMSOCDRI2BufferRec *backBuf)
 				backBuf->numPixmaps+1,
 				backBuf->currentPixmap+2);
 			backBuf->numPixmaps = backBuf->currentPixmap+1;
+			relieveScanoutPressure(pScreen);
 		}
 	}
+
+	setBufferFlags(backBuf);
 }
 
 static struct armsoc_bo *boFromBuffer(DRI2BufferPtr buf)
@@ -685,6 +1663,403 @@ static struct armsoc_bo *boFromBuffer(DRI2BufferPtr buf)
 	return priv->bo;
 }
 
+/*
+ * Swap statistics are kept for every DRI2 window and for the screen as a
+ * whole. They are cheap enough to always be on; sending the server SIGUSR2
+ * dumps them to the log.
+ */
+static void
+recordSwap(ScrnInfoPtr pScrn, DrawablePtr pDraw, struct ARMSOCDRISwapCmd *cmd)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCDRI2SwapStats *stats[2];
+	uint64_t latency = armsoc_monotonic_ns() - cmd->scheduledNs;
+	uint64_t us = latency / 1000;
+	Bool missed = latency > drmmode_frame_period_ns(pScrn, NULL) * 3 / 2;
+	int bucket = 0, n = 0, i;
+
+	while ((us >>= 1) && bucket < ARMSOC_SWAP_LATENCY_BUCKETS - 1)
+		bucket++;
+
+	stats[n++] = &pARMSOC->swapStats;
+	if (pDraw && pDraw->type == DRAWABLE_WINDOW)
+		stats[n++] = &ARMSOCDRI2GetWindowPriv((WindowPtr)pDraw)->swapStats;
+
+	for (i = 0; i < n; i++) {
+		if (cmd->flags & ARMSOC_SWAP_FLIP_FAILED)
+			stats[i]->failures++;
+
+		if (cmd->flags & ARMSOC_SWAP_FAKE_FLIP)
+			stats[i]->fakeFlips++;
+		else if (cmd->type == DRI2_FLIP_COMPLETE)
+			stats[i]->flips++;
+		else if (cmd->type == DRI2_EXCHANGE_COMPLETE)
+			stats[i]->exchanges++;
+		else
+			stats[i]->blits++;
+
+		if (missed)
+			stats[i]->missedVblanks++;
+		stats[i]->latency[bucket]++;
+	}
+}
+
+static void
+dumpSwapStats(ScrnInfoPtr pScrn, const char *name,
+		const struct ARMSOCDRI2SwapStats *stats)
+{
+	char hist[ARMSOC_SWAP_LATENCY_BUCKETS * 32] = "";
+	int len = 0, i;
+
+	for (i = 0; i < ARMSOC_SWAP_LATENCY_BUCKETS; i++) {
+		if (!stats->latency[i])
+			continue;
+
+		if (i == ARMSOC_SWAP_LATENCY_BUCKETS - 1)
+			len += snprintf(hist + len, sizeof(hist) - len,
+					" >=%uus:%lu", 1u << i,
+					stats->latency[i]);
+		else
+			len += snprintf(hist + len, sizeof(hist) - len,
+					" <%uus:%lu", 2u << i,
+					stats->latency[i]);
+	}
+
+	INFO_MSG("%s: %lu flips, %lu exchanges, %lu blits, %lu fake flips, %lu failures, %lu missed vblanks; latency%s",
+			name, stats->flips, stats->exchanges, stats->blits,
+			stats->fakeFlips, stats->failures,
+			stats->missedVblanks, hist);
+}
+
+static int
+dumpWindowSwapStats(WindowPtr pWin, void *data)
+{
+	ScrnInfoPtr pScrn = data;
+	struct ARMSOCDRI2SwapStats *stats =
+			&ARMSOCDRI2GetWindowPriv(pWin)->swapStats;
+	char name[32];
+
+	if (stats->flips || stats->exchanges || stats->blits ||
+	    stats->fakeFlips || stats->failures) {
+		snprintf(name, sizeof(name), "window 0x%lx",
+				(unsigned long)pWin->drawable.id);
+		dumpSwapStats(pScrn, name, stats);
+	}
+
+	return WT_WALKCHILDREN;
+}
+
+static void
+dumpScreenStats(ScrnInfoPtr pScrn)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	INFO_MSG("canexchange cache: %lu hits, %lu misses",
+			pARMSOC->exchangeCacheHits,
+			pARMSOC->exchangeCacheMisses);
+	INFO_MSG("tear-free blits: %lu, %lu waits for the beam, %lu missed",
+			pARMSOC->tearfreeBlits, pARMSOC->tearfreeWaits,
+			pARMSOC->tearfreeMisses);
+	if (pARMSOC->adaptiveBufs)
+		INFO_MSG("adaptive buffering: %lu missed vblanks, grew %lu times, shrank %lu times when idle and %lu times for scanout memory",
+				pARMSOC->adaptiveMissedSwaps,
+				pARMSOC->adaptiveGrows,
+				pARMSOC->adaptiveIdleShrinks,
+				pARMSOC->adaptivePressureShrinks);
+	INFO_MSG("resize coalescing: %lu oversized back buffers, %lu shared, %lu settled",
+			pARMSOC->resizeStepped, pARMSOC->resizeShared,
+			pARMSOC->resizeSettled);
+	if (pARMSOC->bufferPoolBudget)
+		INFO_MSG("DRI2 buffer pool: %lu hits, %lu misses, %lu evicted, %lu expired",
+				pARMSOC->bufferPoolHits,
+				pARMSOC->bufferPoolMisses,
+				pARMSOC->bufferPoolEvictions,
+				pARMSOC->bufferPoolExpiries);
+
+	dumpSwapStats(pScrn, "all swaps", &pARMSOC->swapStats);
+	drmmode_cursor_dump_stats(pScrn);
+	drmmode_redisplay_dump_stats(pScrn);
+}
+
+static volatile sig_atomic_t dumpStatsRequests;
+static OsSigHandlerPtr oldSigUsr2Handler;
+/* Screens sharing our SIGUSR2 handler. The saved handler can't tell us,
+ * being NULL (SIG_DFL) for the default disposition. */
+static int sigUsr2Screens;
+
+static void
+dumpStatsSignal(int sig)
+{
+	dumpStatsRequests++;
+}
+
+/* Tear-free blits to the scanout are split into bands of this many lines */
+#define ARMSOC_BLIT_BAND_LINES		64
+/* Lines of slack kept around each band, to absorb jitter in the vblank
+ * timestamps and in scheduling */
+#define ARMSOC_BLIT_BEAM_MARGIN		8
+
+static int
+beamPosition(const struct drmmode_scanline_model *model, uint64_t now)
+{
+	uint64_t frame_ns = model->line_ns * model->vtotal;
+	uint64_t offset;
+
+	if (now >= model->vblank_ns)
+		offset = (now - model->vblank_ns) % frame_ns;
+	else
+		offset = (frame_ns - (model->vblank_ns - now) % frame_ns) %
+				frame_ns;
+
+	return offset / model->line_ns;
+}
+
+/* Number of lines the beam has to travel to get from line 'from' to 'to' */
+static int
+beamDistance(int from, int to, int vtotal)
+{
+	return ((to - from) % vtotal + vtotal) % vtotal;
+}
+
+/**
+ * Copy the back buffer of a swap to the scanned out window in horizontal
+ * bands, from line cmd->blitY on, as long as the beam is not going to reach
+ * each band while it is being copied. The beam position is extrapolated
+ * from the last vblank of the CRTC showing the window, and the cost of the
+ * copy from previous blits. Returns when to carry on if the beam is in the
+ * way of the next band, or 0 once the whole window has been copied. With
+ * 'force' the beam is ignored.
+ */
+static uint64_t
+copyBands(struct ARMSOCDRISwapCmd *cmd, DrawablePtr pDraw, Bool force)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	DrawablePtr pSrcDraw = dri2draw(pDraw, cmd->pSrcBuffer);
+	DrawablePtr pDstDraw = dri2draw(pDraw, cmd->pDstBuffer);
+	struct drmmode_scanline_model model;
+	uint64_t resume = 0;
+	GCPtr pGC;
+	BoxRec box;
+
+	pGC = GetScratchGC(pDstDraw->depth, pScreen);
+	if (!pGC)
+		return 0;
+	ValidateGC(pDstDraw, pGC);
+
+	box.x1 = pDraw->x;
+	box.y1 = pDraw->y;
+	box.x2 = pDraw->x + pDraw->width;
+	box.y2 = pDraw->y + pDraw->height;
+
+	if (force || !drmmode_crtc_scanline_model(pScrn, &box, &model)) {
+		if (cmd->blitY < pDraw->height)
+			pGC->ops->CopyArea(pSrcDraw, pDstDraw, pGC,
+					0, cmd->blitY, pDraw->width,
+					pDraw->height - cmd->blitY,
+					0, cmd->blitY);
+		cmd->blitY = pDraw->height;
+		FreeScratchGC(pGC);
+		return 0;
+	}
+
+	for (; cmd->blitY < pDraw->height;
+			cmd->blitY += ARMSOC_BLIT_BAND_LINES) {
+		int y = cmd->blitY;
+		int h = min(ARMSOC_BLIT_BAND_LINES, pDraw->height - y);
+		int band_start = pDraw->y + y - model.y - ARMSOC_BLIT_BEAM_MARGIN;
+		int band_end = pDraw->y + y + h - model.y + ARMSOC_BLIT_BEAM_MARGIN;
+		uint64_t bytes = (uint64_t)pDraw->width * h *
+				pDstDraw->bitsPerPixel / 8;
+		uint64_t copy_lines = bytes * pARMSOC->blitNsPerKB / 1024 /
+				model.line_ns + 1;
+		uint64_t start, elapsed, sample;
+
+		if (band_end > 0 && band_start < model.vdisplay) {
+			uint64_t now = armsoc_monotonic_ns();
+			int beam = beamPosition(&model, now);
+			Bool inside = beam >= band_start && beam < band_end;
+
+			if (inside || (uint64_t)beamDistance(beam,
+					band_start, model.vtotal) < copy_lines) {
+				/* Carry on once the beam has left the band,
+				 * as long as the copy can then complete
+				 * before it comes round again. */
+				if (copy_lines < (uint64_t)(model.vtotal -
+						(band_end - band_start))) {
+					int wait = beamDistance(beam, band_end,
+							model.vtotal);
+
+					pARMSOC->tearfreeWaits++;
+					resume = now + wait * model.line_ns;
+					break;
+				}
+				cmd->flags |= ARMSOC_SWAP_BEAM_MISSED;
+			}
+		}
+
+		start = armsoc_monotonic_ns();
+		pGC->ops->CopyArea(pSrcDraw, pDstDraw, pGC,
+				0, y, pDraw->width, h, 0, y);
+		elapsed = armsoc_monotonic_ns() - start;
+
+		if (bytes) {
+			sample = elapsed * 1024 / bytes;
+			if (pARMSOC->blitNsPerKB)
+				pARMSOC->blitNsPerKB =
+					(pARMSOC->blitNsPerKB * 7 + sample) / 8;
+			else
+				pARMSOC->blitNsPerKB = sample;
+		}
+	}
+
+	FreeScratchGC(pGC);
+	return resume;
+}
+
+/**
+ * Carry on with the blit of a swap to the scanout. Rather than waiting for
+ * the beam when it is in the way, the blit is queued for
+ * ARMSOCDRI2BlockHandler() to pick up again, and the swap completes once
+ * the last band has been copied.
+ */
+static void
+blitSwap(struct ARMSOCDRISwapCmd *cmd, Bool force)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(cmd->pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	DrawablePtr pDraw = NULL;
+	int status;
+
+	status = dixLookupDrawable(&pDraw, cmd->draw_id, serverClient,
+			M_ANY, DixWriteAccess);
+	if (status == Success) {
+		cmd->blitResumeNs = copyBands(cmd, pDraw, force);
+		if (cmd->blitResumeNs) {
+			xorg_list_append(&cmd->blitEntry,
+					&pARMSOC->pendingBlits);
+			return;
+		}
+		ageBuffers(pDraw, cmd->pSrcBuffer, cmd->pDstBuffer, FALSE);
+	}
+
+	if (cmd->flags & ARMSOC_SWAP_BEAM_MISSED) {
+		pARMSOC->tearfreeMisses++;
+		DEBUG_MSG("blit of drawable %lx could not beat the beam",
+				(unsigned long)cmd->draw_id);
+	}
+
+	cmd->type = DRI2_BLIT_COMPLETE;
+	ARMSOCDRI2SwapComplete(cmd);
+}
+
+/* Complete the blits waiting for the beam without waiting any more */
+static void
+flushBlits(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCDRISwapCmd *cmd, *tmp;
+
+	xorg_list_for_each_entry_safe(cmd, tmp, &pARMSOC->pendingBlits,
+			blitEntry) {
+		xorg_list_del(&cmd->blitEntry);
+		blitSwap(cmd, TRUE);
+	}
+}
+
+/**
+ * Hold a swap until DRI2's frame counter reaches msc while its CRTC is
+ * turned off. With no vblank to wait for, done(cmd) would otherwise run at
+ * once and let clients swap as fast as they can draw.
+ */
+static void
+paceSwap(struct ARMSOCDRISwapCmd *cmd, uint64_t msc,
+		void (*done)(struct ARMSOCDRISwapCmd *cmd))
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(cmd->pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	cmd->paceDueNs = drmmode_msc_ust(pScrn, msc) * 1000;
+	cmd->paceDone = done;
+	xorg_list_append(&cmd->paceEntry, &pARMSOC->pacedSwaps);
+}
+
+/* Run the paced swaps due by now, or all of them with force */
+static void
+flushPacedSwaps(ScreenPtr pScreen, Bool force)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCDRISwapCmd *cmd, *tmp;
+	uint64_t now = armsoc_monotonic_ns();
+
+	xorg_list_for_each_entry_safe(cmd, tmp, &pARMSOC->pacedSwaps,
+			paceEntry) {
+		if (force || cmd->paceDueNs <= now) {
+			xorg_list_del(&cmd->paceEntry);
+			cmd->paceDone(cmd);
+		}
+	}
+}
+
+/**
+ * Called from the screen's BlockHandler, to carry on with the blits which
+ * are waiting for the beam and release the paced swaps which are due, and
+ * to dump the statistics outside of signal context once SIGUSR2 has been
+ * received.
+ */
+void
+ARMSOCDRI2BlockHandler(ScreenPtr pScreen, pointer pTimeout)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCDRISwapCmd *cmd, *tmp;
+	struct xorg_list waiting;
+	uint64_t now, resume = 0;
+
+	/* Blits queued again are put back on the list once all of them
+	 * have been through */
+	xorg_list_init(&waiting);
+	xorg_list_append(&waiting, &pARMSOC->pendingBlits);
+	xorg_list_del(&pARMSOC->pendingBlits);
+	xorg_list_init(&pARMSOC->pendingBlits);
+
+	now = armsoc_monotonic_ns();
+	xorg_list_for_each_entry_safe(cmd, tmp, &waiting, blitEntry) {
+		xorg_list_del(&cmd->blitEntry);
+		if (cmd->blitResumeNs <= now)
+			blitSwap(cmd, FALSE);
+		else
+			xorg_list_append(&cmd->blitEntry,
+					&pARMSOC->pendingBlits);
+	}
+
+	flushPacedSwaps(pScreen, FALSE);
+
+	xorg_list_for_each_entry(cmd, &pARMSOC->pendingBlits, blitEntry) {
+		if (!resume || cmd->blitResumeNs < resume)
+			resume = cmd->blitResumeNs;
+	}
+	xorg_list_for_each_entry(cmd, &pARMSOC->pacedSwaps, paceEntry) {
+		if (!resume || cmd->paceDueNs < resume)
+			resume = cmd->paceDueNs;
+	}
+	if (resume) {
+		now = armsoc_monotonic_ns();
+		AdjustWaitForDelay(pTimeout, resume > now ?
+				(resume - now + 999999) / 1000000 : 0);
+	}
+
+	if (pARMSOC->dumpStatsRequest == dumpStatsRequests)
+		return;
+	pARMSOC->dumpStatsRequest = dumpStatsRequests;
+
+	dumpScreenStats(pScrn);
+	WalkTree(pScreen, dumpWindowSwapStats, pScrn);
+}
+
 void
 ARMSOCDRI2SwapComplete(struct ARMSOCDRISwapCmd *cmd)
 {
@@ -694,41 +2069,66 @@ ARMSOCDRI2SwapComplete(struct ARMSOCDRISwapCmd *cmd)
 	DrawablePtr pDraw = NULL;
 	int status;
 
-	if (--cmd->swapCount > 0)
-		return;
+	if (cmd->pSrcBuffer->attachment == DRI2BufferBackLeft &&
+	    (cmd->flags & ARMSOC_SWAP_FAKE_FLIP))
+		resetBufferAges(ARMSOCBUF(cmd->pSrcBuffer));
 
-	if ((cmd->flags & ARMSOC_SWAP_FAIL) == 0) {
-		DEBUG_MSG("%s complete: %d -> %d", swap_names[cmd->type],
-			cmd->pSrcBuffer->attachment,
-			cmd->pDstBuffer->attachment);
-
-		status = dixLookupDrawable(&pDraw, cmd->draw_id, serverClient,
-				M_ANY, DixWriteAccess);
-
-		if (status == Success) {
-			if (cmd->type != DRI2_BLIT_COMPLETE &&
-			    cmd->type != DRI2_EXCHANGE_COMPLETE &&
-			   (cmd->flags & ARMSOC_SWAP_FAKE_FLIP) == 0) {
-				assert(cmd->type == DRI2_FLIP_COMPLETE);
-				exchangebufs(pDraw, cmd->pSrcBuffer,
-							cmd->pDstBuffer);
-
-				if (cmd->pSrcBuffer->attachment ==
-						DRI2BufferBackLeft)
-					nextBuffer(pDraw,
-						ARMSOCBUF(cmd->pSrcBuffer));
+	status = dixLookupDrawable(&pDraw, cmd->draw_id, serverClient,
+			M_ANY, DixWriteAccess);
+	if (status != Success)
+		pDraw = NULL;
+
+	recordSwap(pScrn, pDraw, cmd);
+
+	DEBUG_MSG("%s complete: %d -> %d", swap_names[cmd->type],
+		cmd->pSrcBuffer->attachment,
+		cmd->pDstBuffer->attachment);
+
+	/* The CRTC scans out the bo even if the window has gone */
+	if (cmd->crtc)
+		set_scanout_bo(pScrn, cmd->crtc, cmd->old_src_bo);
+
+	if (status == Success) {
+		if (cmd->crtc) {
+			/* The root remains the front buffer, the
+			 * client moves on to the other back pixmap */
+			ageBuffers(pDraw, cmd->pSrcBuffer,
+					cmd->pDstBuffer, FALSE);
+			adaptBufferCount(pScreen,
+					ARMSOCBUF(cmd->pSrcBuffer));
+			nextBuffer(pDraw, ARMSOCBUF(cmd->pSrcBuffer));
+		} else if (cmd->type != DRI2_BLIT_COMPLETE &&
+		    cmd->type != DRI2_EXCHANGE_COMPLETE &&
+		   (cmd->flags & ARMSOC_SWAP_FAKE_FLIP) == 0) {
+			assert(cmd->type == DRI2_FLIP_COMPLETE);
+			ageBuffers(pDraw, cmd->pSrcBuffer,
+					cmd->pDstBuffer, TRUE);
+			exchangebufs(pDraw, cmd->pSrcBuffer,
+						cmd->pDstBuffer);
+
+			if (cmd->pSrcBuffer->attachment ==
+					DRI2BufferBackLeft) {
+				adaptBufferCount(pScreen,
+					ARMSOCBUF(cmd->pSrcBuffer));
+				nextBuffer(pDraw,
+					ARMSOCBUF(cmd->pSrcBuffer));
 			}
+		}
 
-			DRI2SwapComplete(cmd->client, pDraw, 0, 0, 0, cmd->type,
-					cmd->func, cmd->data);
-
-			if (cmd->type != DRI2_BLIT_COMPLETE &&
-			    cmd->type != DRI2_EXCHANGE_COMPLETE &&
-			   (cmd->flags & ARMSOC_SWAP_FAKE_FLIP) == 0) {
-				assert(cmd->type == DRI2_FLIP_COMPLETE);
-				set_scanout_bo(pScrn,
-					boFromBuffer(cmd->pDstBuffer));
-			}
+		if (cmd->pSrcBuffer->attachment == DRI2BufferBackLeft)
+			settleBackBuffer(pDraw,
+					ARMSOCBUF(cmd->pSrcBuffer));
+
+		DRI2SwapComplete(cmd->client, pDraw, 0, 0, 0, cmd->type,
+				cmd->func, cmd->data);
+
+		if (cmd->type != DRI2_BLIT_COMPLETE &&
+		    cmd->type != DRI2_EXCHANGE_COMPLETE &&
+		   (cmd->flags & ARMSOC_SWAP_FAKE_FLIP) == 0 &&
+		    !cmd->crtc) {
+			assert(cmd->type == DRI2_FLIP_COMPLETE);
+			set_scanout_bo(pScrn, NULL,
+				boFromBuffer(cmd->pDstBuffer));
 		}
 	}
 
@@ -759,6 +2159,7 @@ static void ARMSOCDRI2ExecuteSwap(struct ARMSOCDRISwapCmd *cmd)
 		PixmapPtr pDstPixmap = draw2pix(dri2draw(pDraw, cmd->pDstBuffer));
 		RegionRec region;
 
+		ageBuffers(pDraw, cmd->pSrcBuffer, cmd->pDstBuffer, TRUE);
 		exchangebufs(pDraw, cmd->pSrcBuffer, cmd->pDstBuffer);
 		if (cmd->pSrcBuffer->attachment == DRI2BufferBackLeft)
 			nextBuffer(pDraw, ARMSOCBUF(cmd->pSrcBuffer));
@@ -772,6 +2173,16 @@ static void ARMSOCDRI2ExecuteSwap(struct ARMSOCDRISwapCmd *cmd)
 
 		cmd->type = DRI2_EXCHANGE_COMPLETE;
 		ARMSOCDRI2SwapComplete(cmd);
+	} else if (pDraw->type == DRAWABLE_WINDOW &&
+		   cmd->pDstBuffer->attachment == DRI2BufferFrontLeft &&
+		   draw2pix(dri2draw(pDraw, cmd->pDstBuffer)) ==
+		   pDraw->pScreen->GetScreenPixmap(pDraw->pScreen)) {
+		/* fallback to blit, to the scanout: this has to keep out of
+		 * the way of the beam or it will tear */
+		restoreFlipCrtc((WindowPtr)pDraw, FALSE);
+		ARMSOCPTR(xf86ScreenToScrn(pDraw->pScreen))->tearfreeBlits++;
+		cmd->blitY = 0;
+		blitSwap(cmd, FALSE);
 	} else {
 		/* fallback to blit: */
 		BoxRec box = {
@@ -783,11 +2194,24 @@ static void ARMSOCDRI2ExecuteSwap(struct ARMSOCDRISwapCmd *cmd)
 		RegionRec region;
 		RegionInit(&region, &box, 0);
 		ARMSOCDRI2CopyRegion(pDraw, &region, cmd->pDstBuffer, cmd->pSrcBuffer);
+		ageBuffers(pDraw, cmd->pSrcBuffer, cmd->pDstBuffer, FALSE);
 		cmd->type = DRI2_BLIT_COMPLETE;
 		ARMSOCDRI2SwapComplete(cmd);
 	}
 }
 
+/**
+ * Called when a flip of several CRTCs had to be rolled back after some of
+ * them had flipped. They all show the root again, so the swap completes
+ * with a copy instead.
+ */
+void
+ARMSOCDRI2FlipAborted(struct ARMSOCDRISwapCmd *cmd)
+{
+	cmd->flags |= ARMSOC_SWAP_FLIP_FAILED;
+	ARMSOCDRI2ExecuteSwap(cmd);
+}
+
 void ARMSOCDRI2VBlankHandler(unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data)
 {
 	struct ARMSOCDRISwapCmd *cmd = user_data;
@@ -819,20 +2243,34 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	struct armsoc_bo *src_bo, *dst_bo;
 	int src_fb_id, dst_fb_id;
 	int ret, do_flip;
+	xf86CrtcPtr flipCrtc = NULL;
 
 	if (!cmd)
 		return FALSE;
 
+	/* Buffers released to the pool before this swap are now safe to
+	 * hand out again */
+	pARMSOC->bufferPoolEpoch++;
+
 	cmd->client = client;
 	cmd->pScreen = pScreen;
 	cmd->draw_id = pDraw->id;
 	cmd->pSrcBuffer = pSrcBuffer;
 	cmd->pDstBuffer = pDstBuffer;
-	cmd->swapCount = 0;
 	cmd->flags = 0;
 	cmd->func = func;
 	cmd->data = data;
+	cmd->scheduledNs = armsoc_monotonic_ns();
 
+	/* For adaptive buffering: a client asking for a swap soon after the
+	 * previous one completed had its frame ready, and any wait for the
+	 * flip is spent waiting for a free buffer */
+	if (pSrcBuffer->attachment == DRI2BufferBackLeft) {
+		struct ARMSOCDRI2BufferRec *backBuf = ARMSOCBUF(pSrcBuffer);
+
+		backBuf->renderNs = backBuf->lastSwapNs ?
+				cmd->scheduledNs - backBuf->lastSwapNs : 0;
+	}
 
 	DEBUG_MSG("%d -> %d", pSrcBuffer->attachment, pDstBuffer->attachment);
 
@@ -859,29 +2297,59 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 
 	do_flip = src_fb_id && dst_fb_id && canflip(pDraw);
 
-	/* After a resolution change the back buffer (src) will still be
-	 * of the original size. We can't sensibly flip to a framebuffer of
-	 * a different size to the current resolution (it will look corrupted)
-	 * so we must do a copy for this frame (which will clip the contents
-	 * as expected).
-	 *
-	 * Once the client calls DRI2GetBuffers again, it will receive a new
-	 * back buffer of the same size as the new resolution, and subsequent
-	 * DRI2SwapBuffers will result in a flip.
-	 */
-	do_flip = do_flip &&
+	if (do_flip && !DRI2CanFlip(pDraw)) {
+		/* The window covers a single CRTC: flip that one alone, if
+		 * the back buffer matches its mode. */
+		flipCrtc = flipcrtc(pDraw);
+		do_flip = flipCrtc &&
+				pSrcBuffer->attachment == DRI2BufferBackLeft &&
+				armsoc_bo_width(src_bo) ==
+					flipCrtc->mode.HDisplay &&
+				armsoc_bo_height(src_bo) ==
+					flipCrtc->mode.VDisplay &&
+				growForCrtcFlip(pScreen, ARMSOCBUF(pSrcBuffer));
+	} else {
+		/* After a resolution change the back buffer (src) will
+		 * still be of the original size. We can't sensibly flip to
+		 * a framebuffer of a different size to the current
+		 * resolution (it will look corrupted) so we must do a copy
+		 * for this frame (which will clip the contents as expected).
+		 *
+		 * Once the client calls DRI2GetBuffers again, it will
+		 * receive a new back buffer of the same size as the new
+		 * resolution, and subsequent DRI2SwapBuffers will result in
+		 * a flip.
+		 */
+		do_flip = do_flip &&
 			(armsoc_bo_width(src_bo) == armsoc_bo_width(dst_bo));
-	do_flip = do_flip &&
+		do_flip = do_flip &&
 			(armsoc_bo_height(src_bo) == armsoc_bo_height(dst_bo));
+	}
+
+	if (do_flip && flipCrtc) {
+		ARMSOCDRI2GetWindowPriv((WindowPtr)pDraw)->flipCrtc = flipCrtc;
+		ret = drmmode_page_flip_crtc(flipCrtc, src_bo, cmd);
+
+		/* Blit rather than drop the frame */
+		do_flip = ret >= 0;
+	}
+
+	/* Anything but a flip of its own CRTC goes through the root, which
+	 * all CRTCs waiting to go back on it have to show first */
+	if (!do_flip || !flipCrtc) {
+		if (pDraw->type == DRAWABLE_WINDOW)
+			restoreFlipCrtc((WindowPtr)pDraw, FALSE);
+		drmmode_flush_restores(pScrn);
+		flipCrtc = NULL;
+	}
 
 	if (do_flip) {
 		DEBUG_MSG("can flip:  %d -> %d", src_fb_id, dst_fb_id);
 		cmd->type = DRI2_FLIP_COMPLETE;
+		cmd->crtc = flipCrtc;
 
-		/* TODO: MIDEGL-1461: Handle rollback if multiple CRTC flip is
-		 * only partially successful
-		 */
-		ret = drmmode_page_flip(pDraw, src_fb_id, cmd);
+		if (!flipCrtc)
+			ret = drmmode_page_flip(pDraw, src_fb_id, cmd);
 
 		/* Mali sometimes asks us to destroy DRI2 buffers for windows before
 		 * it has finished reading from them, so we don't free unused BOs
@@ -890,52 +2358,40 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 		 * and process all pending BO deletions. */
 		armsoc_bo_do_pending_deletions();
 
-		/* If using page flip events, we'll trigger an immediate
-		 * completion in the case that no CRTCs were enabled to be
-		 * flipped. If not using page flip events, trigger immediate
-		 * completion unconditionally.
+		/* If using page flip events, the flip completes once the
+		 * events of all flipped CRTCs have arrived; we trigger an
+		 * immediate completion in the case that no CRTCs were enabled
+		 * to be flipped. If not using page flip events, trigger
+		 * immediate completion unconditionally.
 		 */
 		if (ret < 0) {
-			/*
-			 * Error while flipping; bail.
-			 */
-			cmd->flags |= ARMSOC_SWAP_FAIL;
-
-			if (pARMSOC->drmmode_interface->use_page_flip_events)
-				cmd->swapCount = -(ret + 1);
-			else
-				cmd->swapCount = 0;
-
-			if (cmd->swapCount == 0)
-				ARMSOCDRI2SwapComplete(cmd);
-
-			return FALSE;
+			/* Nothing flipped: copy instead */
+			cmd->flags |= ARMSOC_SWAP_FLIP_FAILED;
+			ARMSOCDRI2ExecuteSwap(cmd);
 		} else {
-			if (ret == 0)
+			/* A CRTC flipped alone may be flipped by the mode
+			 * set that takes it off the root */
+			if (ret == 0 && !flipCrtc)
 				cmd->flags |= ARMSOC_SWAP_FAKE_FLIP;
 
-			if (pARMSOC->drmmode_interface->use_page_flip_events)
-				cmd->swapCount = ret;
-			else
-				cmd->swapCount = 0;
-
-			if (cmd->swapCount == 0)
+			/* Nothing to flip when the CRTCs are off: complete
+			 * on the next frame counted meanwhile */
+			if (ret == 0)
+				paceSwap(cmd, *target_msc,
+						ARMSOCDRI2SwapComplete);
+			else if (!pARMSOC->drmmode_interface->
+					use_page_flip_events)
 				ARMSOCDRI2SwapComplete(cmd);
 		}
 	} else {
-		drmVBlank vbl = { };
-
 		/* If we're not page flipping, delay the swap until
 		 * vblank time ourselves. */
-		vbl.request.type = (DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT);
-		vbl.request.sequence = *target_msc;
-		vbl.request.signal = (unsigned long) cmd;
-
-		ret = drmWaitVBlank(pARMSOC->drmFD, &vbl);
+		ret = drmmode_queue_vblank(pScrn, *target_msc, cmd);
 		if (ret) {
-			/* Oops, we couldn't schedule the swap for vblank.
-			 * Just do it immediately. */
-			ARMSOCDRI2ExecuteSwap(cmd);
+			/* Oops, we couldn't schedule the swap for vblank,
+			 * or the screen is off. Do it on the frame counted
+			 * meanwhile. */
+			paceSwap(cmd, *target_msc, ARMSOCDRI2ExecuteSwap);
 		}
 	}
 
@@ -998,13 +2454,66 @@ ARMSOCDRI2ScreenInit(ScreenPtr pScreen)
 		return FALSE;
 	}
 
+	if (!dixRegisterPrivateKey(&ARMSOCDRI2WindowPrivateKeyRec,
+			PRIVATE_WINDOW, sizeof(struct ARMSOCDRI2WindowPrivRec))) {
+		ERROR_MSG("Failed to register DRI2 window private");
+		return FALSE;
+	}
+
 	ret = drmWaitVBlank(pARMSOC->drmFD, &vbl);
 	if (ret)
 		pARMSOC->drmmode_interface->vblank_query_supported = 0;
 	else
 		pARMSOC->drmmode_interface->vblank_query_supported = 1;
 
-	return DRI2ScreenInit(pScreen, &info);
+	if (!DRI2ScreenInit(pScreen, &info))
+		return FALSE;
+
+	/* Window privates start out with generation 0, so make sure the
+	 * first canexchange() for each window misses the cache. */
+	pARMSOC->exchangeGeneration = 1;
+	pARMSOC->exchangeCacheHits = 0;
+	pARMSOC->exchangeCacheMisses = 0;
+	xorg_list_init(&pARMSOC->pendingBlits);
+	xorg_list_init(&pARMSOC->pacedSwaps);
+	xorg_list_init(&pARMSOC->adaptiveList);
+	pARMSOC->adaptiveTimer = NULL;
+	xorg_list_init(&pARMSOC->bufferPool);
+	pARMSOC->bufferPoolBytes = 0;
+	pARMSOC->bufferPoolTimer = NULL;
+	pARMSOC->bufferPoolActive = pARMSOC->bufferPoolBudget > 0 &&
+			AddCallback(&ClientStateCallback, poolClientState,
+				pScreen);
+	wrap(pARMSOC, pScreen, ClipNotify, ARMSOCDRI2ClipNotify);
+	wrap(pARMSOC, pScreen, ConfigNotify, ARMSOCDRI2ConfigNotify);
+	wrap(pARMSOC, pScreen, ReparentWindow, ARMSOCDRI2ReparentWindow);
+	wrap(pARMSOC, pScreen, SetWindowPixmap, ARMSOCDRI2SetWindowPixmap);
+	wrap(pARMSOC, pScreen, DestroyWindow, ARMSOCDRI2DestroyWindow);
+
+	memset(&pARMSOC->swapStats, 0, sizeof(pARMSOC->swapStats));
+	pARMSOC->dumpStatsRequest = dumpStatsRequests;
+	if (sigUsr2Screens++ == 0)
+		oldSigUsr2Handler = OsSignal(SIGUSR2, dumpStatsSignal);
+
+	return TRUE;
+}
+
+/**
+ * Free the pooled DRI2 back buffers, and stop pooling released ones. Must
+ * be called before the screen's CloseScreen chain tears down EXA.
+ */
+void
+ARMSOCDRI2FreeBufferPool(ScreenPtr pScreen)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR_FROM_SCREEN(pScreen);
+
+	poolFlush(pScreen, FALSE);
+	if (pARMSOC->bufferPoolActive)
+		DeleteCallback(&ClientStateCallback, poolClientState,
+				pScreen);
+	pARMSOC->bufferPoolActive = FALSE;
+	TimerFree(pARMSOC->bufferPoolTimer);
+	pARMSOC->bufferPoolTimer = NULL;
 }
 
 /**
@@ -1015,9 +2524,36 @@ ARMSOCDRI2CloseScreen(ScreenPtr pScreen)
 {
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	flushBlits(pScreen);
+	flushPacedSwaps(pScreen, TRUE);
+
 	while (pARMSOC->pending_flips > 0) {
 		DEBUG_MSG("waiting..");
 		drmmode_wait_for_event(pScrn);
 	}
+
+	/* Put CRTCs that were flipping a window alone back on the root */
+	for (i = 0; i < config->num_crtc; i++)
+		drmmode_crtc_restore_scanout(config->crtc[i]);
+
+	unwrap(pARMSOC, pScreen, ClipNotify);
+	unwrap(pARMSOC, pScreen, ConfigNotify);
+	unwrap(pARMSOC, pScreen, ReparentWindow);
+	unwrap(pARMSOC, pScreen, SetWindowPixmap);
+	unwrap(pARMSOC, pScreen, DestroyWindow);
+
+	dumpScreenStats(pScrn);
+
+	if (--sigUsr2Screens == 0) {
+		OsSignal(SIGUSR2, oldSigUsr2Handler);
+		oldSigUsr2Handler = NULL;
+	}
+
+	TimerFree(pARMSOC->adaptiveTimer);
+	pARMSOC->adaptiveTimer = NULL;
+
 	DRI2CloseScreen(pScreen);
 }
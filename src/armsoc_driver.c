@@ -108,6 +108,11 @@ enum {
 	OPTION_BUSID,
 	OPTION_DRIVERNAME,
 	OPTION_DRI_NUM_BUF,
+	OPTION_DRI_ADAPTIVE_BUF,
+	OPTION_DRI_POOL_SIZE,
+	OPTION_ROTATE_THREADS,
+	OPTION_PER_CRTC_SCANOUT,
+	OPTION_FAST_STARTUP,
 };
 
 /** Supported options. */
@@ -118,6 +123,11 @@ static const OptionInfoRec ARMSOCOptions[] = {
 	{ OPTION_BUSID,      "BusID",      OPTV_STRING,  {0}, FALSE },
 	{ OPTION_DRIVERNAME, "DriverName", OPTV_STRING,  {0}, FALSE },
 	{ OPTION_DRI_NUM_BUF, "DRI2MaxBuffers", OPTV_INTEGER, {-1}, FALSE },
+	{ OPTION_DRI_ADAPTIVE_BUF, "DRI2AdaptiveBuffers", OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_DRI_POOL_SIZE, "DRI2BufferPoolSize", OPTV_INTEGER, {-1}, FALSE },
+	{ OPTION_ROTATE_THREADS, "RotateThreads", OPTV_INTEGER, {-1}, FALSE },
+	{ OPTION_PER_CRTC_SCANOUT, "PerCrtcScanout", OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_FAST_STARTUP, "FastStartup", OPTV_BOOLEAN, {0}, FALSE },
 	{ -1,                NULL,         OPTV_NONE,    {0}, FALSE }
 };
 
@@ -733,6 +743,7 @@ ARMSOCPreInit(ScrnInfoPtr pScrn, int flags)
 	rgb defaultMask = { 0, 0, 0 };
 	Gamma defaultGamma = { 0.0, 0.0, 0.0 };
 	int driNumBufs;
+	int driPoolSize;
 
 	TRACE_ENTER();
 
@@ -852,6 +863,62 @@ ARMSOCPreInit(ScrnInfoPtr pScrn, int flags)
 		return FALSE;
 	}
 	pARMSOC->driNumBufs = driNumBufs;
+	/* Determine if flipping drawables may grow to triple buffering: */
+	pARMSOC->adaptiveBufs = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_DRI_ADAPTIVE_BUF, FALSE);
+	INFO_MSG("Adaptive DRI2 buffering is %s",
+				pARMSOC->adaptiveBufs ? "Enabled" : "Disabled");
+
+	if (!xf86GetOptValInteger(pARMSOC->pOptionInfo, OPTION_DRI_POOL_SIZE,
+			&driPoolSize)) {
+		/* Default to a pool of 16MB */
+		driPoolSize = 16384;
+	}
+
+	if (driPoolSize < 0) {
+		ERROR_MSG(
+			"Invalid option for %s: %d. Must be greater than or equal to 0",
+			xf86TokenToOptName(pARMSOC->pOptionInfo,
+				OPTION_DRI_POOL_SIZE),
+			driPoolSize);
+		return FALSE;
+	}
+	/* Option is in KB, the pool can't hold 4GB or more */
+	if ((uint64_t)driPoolSize * 1024 > UINT32_MAX) {
+		WARNING_MSG("%s of %d KB is too large, using %u KB",
+			xf86TokenToOptName(pARMSOC->pOptionInfo,
+				OPTION_DRI_POOL_SIZE),
+			driPoolSize, UINT32_MAX / 1024);
+		driPoolSize = UINT32_MAX / 1024;
+	}
+	pARMSOC->bufferPoolBudget = (uint32_t)driPoolSize * 1024;
+	if (!xf86GetOptValInteger(pARMSOC->pOptionInfo, OPTION_ROTATE_THREADS,
+			&pARMSOC->rotateThreads)) {
+		/* Rotate the screen on the X server's thread alone */
+		pARMSOC->rotateThreads = 1;
+	}
+
+	if (pARMSOC->rotateThreads < 1) {
+		ERROR_MSG(
+			"Invalid option for %s: %d. Must be greater than or equal to 1",
+			xf86TokenToOptName(pARMSOC->pOptionInfo,
+				OPTION_ROTATE_THREADS),
+			pARMSOC->rotateThreads);
+		return FALSE;
+	}
+
+	/* Determine if each CRTC scans out a copy of the root of its own: */
+	pARMSOC->perCrtcScanout = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_PER_CRTC_SCANOUT, FALSE);
+	if (pARMSOC->perCrtcScanout)
+		INFO_MSG("Each CRTC scans out a buffer of its own");
+
+	/* Determine if disconnected outputs are set up after startup: */
+	pARMSOC->fastStartup = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_FAST_STARTUP, FALSE);
+	if (pARMSOC->fastStartup)
+		INFO_MSG("Disconnected outputs are probed after startup");
+
 	/* Determine if user wants to disable buffer flipping: */
 	pARMSOC->NoFlip = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
 			OPTION_NO_FLIP, FALSE);
@@ -977,6 +1044,7 @@ ARMSOCScreenInit(SCREEN_INIT_ARGS_DECL)
 		height = pScrn->virtualY;
 	pARMSOC->scanout = armsoc_bo_new_with_dim(pARMSOC->dev, width,
 			height, pScrn->bitsPerPixel, pScrn->bitsPerPixel,
+			pARMSOC->perCrtcScanout ? ARMSOC_BO_NON_SCANOUT :
 			ARMSOC_BO_SCANOUT);
 	if (!pARMSOC->scanout) {
 		ERROR_MSG("Cannot allocate scanout buffer\n");
@@ -1208,6 +1276,9 @@ ARMSOCCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 	drmmode_screen_fini(pScrn);
 	drmmode_cursor_fini(pScreen);
 
+	if (pARMSOC->dri)
+		ARMSOCDRI2FreeBufferPool(pScreen);
+
 	/* pScreen->devPrivate holds the root pixmap created around our bo by miCreateResources which is installed
 	 * by fbScreenInit() when called from ARMSOCScreenInit().
 	 * This pixmap should be destroyed in miScreenClose() but this isn't wrapped by fbScreenInit() so to prevent a leak
@@ -1290,6 +1361,14 @@ ARMSOCBlockHandler(BLOCKHANDLER_ARGS_DECL)
 	swap(pARMSOC, pScreen, BlockHandler);
 	(*pScreen->BlockHandler) (BLOCKHANDLER_ARGS);
 	swap(pARMSOC, pScreen, BlockHandler);
+
+	if (pARMSOC->dri)
+		ARMSOCDRI2BlockHandler(pScreen, pTimeout);
+	drmmode_hotplug_handler(pScrn);
+	drmmode_flush_restores(pScrn);
+	drmmode_redisplay(pScrn);
+	/* Send out any plane updates no page flip has carried */
+	drmmode_atomic_flush(pScrn);
 }
 
 
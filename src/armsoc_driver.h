@@ -36,7 +36,9 @@
 #include "xf86RAC.h"
 #endif
 #include "xf86drm.h"
+#include "xf86Crtc.h"
 #include <errno.h>
+#include <time.h>
 #include "armsoc_exa.h"
 
 /* Apparently not used by X server */
@@ -54,6 +56,16 @@
  */
 extern _X_EXPORT Bool armsocDebug;
 
+/** CLOCK_MONOTONIC time in ns, the clock of DRM vblank timestamps */
+static inline uint64_t
+armsoc_monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 
 /* Various logging/debug macros for use in the X driver and the external
  * sub-modules:
@@ -105,6 +117,29 @@ extern _X_EXPORT Bool armsocDebug;
 				##__VA_ARGS__); \
 		} while (0)
 
+/*
+ * Largest root with PerCrtcScanout, where the display controller never reads
+ * the root and its framebuffer size limits don't apply.
+ */
+#define ARMSOC_PER_CRTC_MAX_SIZE 8192
+
+/*
+ * Swap counters kept per DRI2 window and per screen. latency[i] counts the
+ * swaps that took [2^i, 2^(i+1)) microseconds from ScheduleSwap to
+ * completion; the last bucket counts everything slower.
+ */
+#define ARMSOC_SWAP_LATENCY_BUCKETS 20
+
+struct ARMSOCDRI2SwapStats {
+	unsigned long flips;
+	unsigned long exchanges;
+	unsigned long blits;
+	unsigned long fakeFlips;
+	unsigned long failures;
+	unsigned long missedVblanks;
+	unsigned long latency[ARMSOC_SWAP_LATENCY_BUCKETS];
+};
+
 /** The driver's Screen-specific, "private" data structure. */
 struct ARMSOCRec {
 	/**
@@ -119,6 +154,10 @@ struct ARMSOCRec {
 	/** user-configurable option: */
 	Bool				NoFlip;
 	unsigned			driNumBufs;
+	Bool				adaptiveBufs;
+	int				rotateThreads;
+	Bool				perCrtcScanout;
+	Bool				fastStartup;
 
 	/** File descriptor of the connection with the DRM. */
 	int					drmFD;
@@ -142,6 +181,11 @@ struct ARMSOCRec {
 	CloseScreenProcPtr				SavedCloseScreen;
 	CreateScreenResourcesProcPtr	SavedCreateScreenResources;
 	ScreenBlockHandlerProcPtr		SavedBlockHandler;
+	ClipNotifyProcPtr				SavedClipNotify;
+	ConfigNotifyProcPtr				SavedConfigNotify;
+	ReparentWindowProcPtr			SavedReparentWindow;
+	SetWindowPixmapProcPtr			SavedSetWindowPixmap;
+	DestroyWindowProcPtr			SavedDestroyWindow;
 
 	/** Pointer to the entity structure for this screen. */
 	EntityInfoPtr		pEntityInfo;
@@ -156,6 +200,59 @@ struct ARMSOCRec {
 	 * scanout, but we don't get any usage hint indicating that it should
 	 * be accelerated. Use a flag to detect this and act accordingly. */
 	Bool				created_scanout_pixmap;
+
+	/* Bumped whenever the window tree changes in a way that may affect
+	 * whether DRI2 swaps can exchange buffers, invalidating the cached
+	 * per-window decisions. */
+	unsigned long		exchangeGeneration;
+	unsigned long		exchangeCacheHits;
+	unsigned long		exchangeCacheMisses;
+
+	/* Blits to the scanout which are scheduled to stay out of the way of
+	 * the beam, waiting for it to move on, and their statistics, see
+	 * blitSwap(). */
+	struct xorg_list	pendingBlits;
+	/* Swaps held until a frame of the DRI2 CRTC while it is turned off,
+	 * see paceSwap(). */
+	struct xorg_list	pacedSwaps;
+	unsigned long		tearfreeBlits;
+	unsigned long		tearfreeWaits;
+	unsigned long		tearfreeMisses;
+
+	/* Running estimate of the cost of blitting to the scanout */
+	uint64_t			blitNsPerKB;
+
+	/* DRI2 back buffers grown by adaptive buffering, the timer which
+	 * shrinks them again once idle, and the last time scanout memory
+	 * ran short. */
+	struct xorg_list	adaptiveList;
+	OsTimerPtr			adaptiveTimer;
+	uint64_t			scanoutPressureNs;
+	unsigned long		adaptiveMissedSwaps;
+	unsigned long		adaptiveGrows;
+	unsigned long		adaptiveIdleShrinks;
+	unsigned long		adaptivePressureShrinks;
+
+	/* Pool of released DRI2 back pixmaps, see poolRelease() */
+	struct xorg_list	bufferPool;
+	uint32_t			bufferPoolBytes;
+	uint32_t			bufferPoolBudget;
+	Bool				bufferPoolActive;
+	unsigned long		bufferPoolEpoch;
+	OsTimerPtr			bufferPoolTimer;
+	unsigned long		bufferPoolHits;
+	unsigned long		bufferPoolMisses;
+	unsigned long		bufferPoolEvictions;
+	unsigned long		bufferPoolExpiries;
+
+	/* DRI2 back buffer allocations saved during window resizes */
+	unsigned long		resizeStepped;
+	unsigned long		resizeShared;
+	unsigned long		resizeSettled;
+
+	/* DRI2 swaps of the whole screen, dumped on SIGUSR2 */
+	struct ARMSOCDRI2SwapStats	swapStats;
+	int			dumpStatsRequest;
 };
 
 /*
@@ -199,11 +296,40 @@ Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp);
 void drmmode_screen_init(ScrnInfoPtr pScrn);
 void drmmode_screen_fini(ScrnInfoPtr pScrn);
 void drmmode_adjust_frame(ScrnInfoPtr pScrn, int x, int y);
-Bool drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv);
+int drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv);
+void drmmode_atomic_flush(ScrnInfoPtr pScrn);
+void drmmode_redisplay(ScrnInfoPtr pScrn);
 void drmmode_wait_for_event(ScrnInfoPtr pScrn);
+void drmmode_hotplug_handler(ScrnInfoPtr pScrn);
 Bool drmmode_cursor_init(ScreenPtr pScreen);
 void drmmode_cursor_fini(ScreenPtr pScreen);
+void drmmode_cursor_dump_stats(ScrnInfoPtr pScrn);
+void drmmode_redisplay_dump_stats(ScrnInfoPtr pScrn);
 uint32_t drmmode_get_crtc_id(ScrnInfoPtr pScrn);
+uint64_t drmmode_frame_period_ns(ScrnInfoPtr pScrn, xf86CrtcPtr crtc);
+Bool drmmode_get_msc(ScrnInfoPtr pScrn, uint64_t *ust, uint64_t *msc);
+uint64_t drmmode_msc_ust(ScrnInfoPtr pScrn, uint64_t msc);
+int drmmode_queue_vblank(ScrnInfoPtr pScrn, uint64_t msc, void *priv);
+
+/** Model of a CRTC's beam position, see drmmode_crtc_scanline_model(). */
+struct drmmode_scanline_model {
+	/* framebuffer line scanned out at the top of the CRTC */
+	int y;
+	int vdisplay;
+	int vtotal;
+	/* duration of a line, and start of a frame, in CLOCK_MONOTONIC ns */
+	uint64_t line_ns;
+	uint64_t vblank_ns;
+};
+Bool drmmode_crtc_scanline_model(ScrnInfoPtr pScrn, const BoxRec *box,
+		struct drmmode_scanline_model *model);
+xf86CrtcPtr drmmode_crtc_covering(ScrnInfoPtr pScrn, const BoxRec *box);
+int drmmode_page_flip_crtc(xf86CrtcPtr crtc, struct armsoc_bo *bo,
+		void *priv);
+void drmmode_crtc_restore_scanout(xf86CrtcPtr crtc);
+void drmmode_crtc_defer_restore(xf86CrtcPtr crtc);
+void drmmode_flush_restores(ScrnInfoPtr pScrn);
+Bool drmmode_scanout_busy(ScrnInfoPtr pScrn, struct armsoc_bo *bo);
 
 /**
  * DRI2 functions..
@@ -211,12 +337,16 @@ uint32_t drmmode_get_crtc_id(ScrnInfoPtr pScrn);
 struct ARMSOCDRISwapCmd;
 Bool ARMSOCDRI2ScreenInit(ScreenPtr pScreen);
 void ARMSOCDRI2CloseScreen(ScreenPtr pScreen);
+void ARMSOCDRI2FreeBufferPool(ScreenPtr pScreen);
+void ARMSOCDRI2BlockHandler(ScreenPtr pScreen, pointer pTimeout);
 void ARMSOCDRI2SwapComplete(struct ARMSOCDRISwapCmd *cmd);
+void ARMSOCDRI2FlipAborted(struct ARMSOCDRISwapCmd *cmd);
 void ARMSOCDRI2VBlankHandler(unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data);
 
 /**
  * DRI2 util functions..
  */
-void set_scanout_bo(ScrnInfoPtr pScrn, struct armsoc_bo *bo);
+void set_scanout_bo(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+		struct armsoc_bo *bo);
 
 #endif /* __ARMSOC_DRV_H__ */
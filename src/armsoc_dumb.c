@@ -27,6 +27,7 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <assert.h>
 #include <errno.h>
@@ -59,12 +60,14 @@ struct armsoc_bo {
 	uint8_t depth;
 	uint8_t bpp;
 	uint32_t pitch;
+	enum armsoc_buf_type buf_type;
 	int refcnt;
 	int dmabuf;
-	/* initial size of backing memory. Used on resize to
+	/* initial size and pitch of backing memory. Used on resize to
 	 * check if the new size will fit
 	 */
 	uint32_t original_size;
+	uint32_t original_pitch;
 	uint32_t name;
 
 	/* pending deletions list */
@@ -173,8 +176,10 @@ struct armsoc_bo *armsoc_bo_new_with_dim(struct armsoc_device *dev,
 	new_buf->width = create_gem.width;
 	new_buf->height = create_gem.height;
 	new_buf->original_size = create_gem.size;
+	new_buf->original_pitch = create_gem.pitch;
 	new_buf->depth = depth;
 	new_buf->bpp = create_gem.bpp;
+	new_buf->buf_type = buf_type;
 	new_buf->refcnt = 1;
 	new_buf->dmabuf = -1;
 	new_buf->name = 0;
@@ -302,6 +307,12 @@ uint32_t armsoc_bo_pitch(struct armsoc_bo *bo)
 	return bo->pitch;
 }
 
+enum armsoc_buf_type armsoc_bo_buf_type(struct armsoc_bo *bo)
+{
+	assert(bo->refcnt > 0);
+	return bo->buf_type;
+}
+
 void *armsoc_bo_map(struct armsoc_bo *bo)
 {
 	assert(bo->refcnt > 0);
@@ -402,10 +413,19 @@ uint32_t armsoc_bo_get_fb(struct armsoc_bo *bo)
 }
 
 int armsoc_bo_clear(struct armsoc_bo *bo)
+{
+	return armsoc_bo_clear_area(bo, 0, 0, bo->width, bo->height);
+}
+
+int armsoc_bo_clear_area(struct armsoc_bo *bo, uint32_t x, uint32_t y,
+		uint32_t w, uint32_t h)
 {
 	unsigned char *dst;
+	uint32_t cpp = bo->bpp / 8;
+	uint32_t row;
 
 	assert(bo->refcnt > 0);
+	assert(x + w <= bo->width && y + h <= bo->height);
 	dst = armsoc_bo_map(bo);
 	if (!dst) {
 		xf86DrvMsg(-1, X_ERROR,
@@ -413,54 +433,58 @@ int armsoc_bo_clear(struct armsoc_bo *bo)
 		return -1;
 	}
 
-	{
-		uint32_t *p, *e;
-		/* XXX: Pixman using NEON might be faster here,
-		 * but hopefully we won't hit this very often. */
-		p = (uint32_t *) (dst);
-		e = (uint32_t *) (dst + bo->size);
-		for (; p < e; p++)
-			*p = 0xFF000000;
+	/* XXX: Pixman using NEON might be faster here,
+	 * but hopefully we won't hit this very often. */
+	for (row = y; row < y + h; row++) {
+		unsigned char *line = dst + row * bo->pitch + x * cpp;
+
+		/* opaque black, the alpha only exists at 32bpp */
+		if (bo->bpp == 32) {
+			uint32_t *p = (uint32_t *)line, *e = p + w;
+
+			for (; p < e; p++)
+				*p = 0xFF000000;
+		} else {
+			memset(line, 0, w * cpp);
+		}
 	}
 
 	return 0;
 }
 
-int armsoc_bo_resize(struct armsoc_bo *bo, uint32_t new_width,
-						uint32_t new_height)
+int armsoc_bo_reshape(struct armsoc_bo *bo, uint32_t new_width,
+		uint32_t new_height, uint32_t *old_fb_id)
 {
-	uint32_t new_size;
-	uint32_t new_pitch;
+	uint32_t cpp, pitch, new_size;
+	uint32_t fb_id = 0;
+	int ret;
 
 	assert(bo != NULL);
 	assert(new_width > 0);
 	assert(new_height > 0);
-	/* The caller must remove the fb object before
-	 * attempting to resize.
-	 */
-	assert(bo->fb_id == 0);
 	assert(bo->refcnt > 0);
 
-	xf86DrvMsg(-1, X_INFO, "Resizing bo from %dx%d to %dx%d\n",
-			bo->width, bo->height, new_width, new_height);
+	cpp = (armsoc_bo_bpp(bo) + 7) / 8;
+	pitch = bo->original_pitch;
+	new_size = (new_height - 1) * pitch + new_width * cpp;
+	if (new_width * cpp > pitch || new_size > bo->original_size)
+		return -1;
 
-	/* TODO: MIDEGL-1563: Get pitch from DRM as
-	 * only DRM knows the ideal pitch and alignment
-	 * requirements
-	 * */
-	new_pitch  = new_width * ((armsoc_bo_bpp(bo)+7)/8);
-	/* Align pitch to 64 byte */
-	new_pitch  = ALIGN(new_pitch, 64);
-	new_size   = (((new_height-1) * new_pitch) +
-			(new_width * ((armsoc_bo_bpp(bo)+7)/8)));
-
-	if (new_size <= bo->original_size) {
-		bo->width  = new_width;
-		bo->height = new_height;
-		bo->pitch  = new_pitch;
-		bo->size   = new_size;
-		return 0;
+	if (bo->fb_id) {
+		ret = drmModeAddFB(bo->dev->fd, new_width, new_height, bo->bpp,
+				bo->bpp, pitch, bo->handle, &fb_id);
+		if (ret < 0)
+			return ret;
 	}
-	xf86DrvMsg(-1, X_ERROR, "Failed to resize buffer\n");
-	return -1;
+
+	xf86DrvMsg(-1, X_INFO, "Reshaping bo from %dx%d to %dx%d\n",
+			bo->width, bo->height, new_width, new_height);
+
+	*old_fb_id = bo->fb_id;
+	bo->fb_id = fb_id;
+	bo->width  = new_width;
+	bo->height = new_height;
+	bo->pitch  = pitch;
+	bo->size   = new_size;
+	return 0;
 }
@@ -76,6 +76,7 @@ uint32_t armsoc_bo_width(struct armsoc_bo *bo);
 uint32_t armsoc_bo_height(struct armsoc_bo *bo);
 uint32_t armsoc_bo_bpp(struct armsoc_bo *bo);
 uint32_t armsoc_bo_pitch(struct armsoc_bo *bo);
+enum armsoc_buf_type armsoc_bo_buf_type(struct armsoc_bo *bo);
 
 void armsoc_bo_reference(struct armsoc_bo *bo);
 void armsoc_bo_unreference(struct armsoc_bo *bo);
@@ -87,9 +88,18 @@ int armsoc_bo_set_dmabuf(struct armsoc_bo *bo);
 void armsoc_bo_clear_dmabuf(struct armsoc_bo *bo);
 int armsoc_bo_has_dmabuf(struct armsoc_bo *bo);
 int armsoc_bo_clear(struct armsoc_bo *bo);
+/* Fill the w x h area at (x, y) of bo with black, as armsoc_bo_clear() */
+int armsoc_bo_clear_area(struct armsoc_bo *bo, uint32_t x, uint32_t y,
+		uint32_t w, uint32_t h);
 int armsoc_bo_rm_fb(struct armsoc_bo *bo);
-int armsoc_bo_resize(struct armsoc_bo *bo, uint32_t new_width,
-						uint32_t new_height);
+/* Make bo a new_width x new_height buffer in the memory it was allocated
+ * with, at the pitch it was allocated with so that its pixels stay in
+ * place. A framebuffer of the new size replaces the one bo had, which is
+ * returned in old_fb_id for the caller to remove once no CRTC scans it
+ * out. Returns non-zero, leaving bo as it was, if it doesn't fit.
+ */
+int armsoc_bo_reshape(struct armsoc_bo *bo, uint32_t new_width,
+		uint32_t new_height, uint32_t *old_fb_id);
 
 void armsoc_bo_do_pending_deletions(void);
 
@@ -450,12 +450,6 @@ _X_EXPORT Bool
 ARMSOCPrepareAccess(PixmapPtr pPixmap, int index)
 {
 	struct ARMSOCPixmapPrivRec *priv = exaGetPixmapDriverPrivate(pPixmap);
-	ScrnInfoPtr pScrn = pix2scrn(pPixmap);
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	struct drmmode_interface *di = pARMSOC->drmmode_interface;
-	_lock_item_s item;
-	struct armsoc_gem_set_domain gsd;
-	int ret;
 
 	if (!is_accel_pixmap(priv, pPixmap->drawable.width * pPixmap->drawable.height * (pPixmap->drawable.bitsPerPixel/8))) {
 		pPixmap->devPrivate.ptr = priv->unaccel;
@@ -471,7 +465,24 @@ ARMSOCPrepareAccess(PixmapPtr pPixmap, int index)
 	if (!priv->ext_access_cnt || priv->usage_hint == ARMSOC_CREATE_PIXMAP_SCANOUT)
 		return TRUE;
 
-	ret = armsoc_bo_get_name(priv->bo, &item.secure_id);
+	return ARMSOCPrepareBoAccess(pix2scrn(pPixmap), priv->bo);
+}
+
+/**
+ * Synchronise CPU access to a bo which clients render to, for
+ * PrepareAccess() and for the driver's own copies out of such bos. Must be
+ * paired with ARMSOCFinishBoAccess() if it succeeds.
+ */
+Bool
+ARMSOCPrepareBoAccess(ScrnInfoPtr pScrn, struct armsoc_bo *bo)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_interface *di = pARMSOC->drmmode_interface;
+	_lock_item_s item;
+	struct armsoc_gem_set_domain gsd;
+	int ret;
+
+	ret = armsoc_bo_get_name(bo, &item.secure_id);
 	if (ret) {
 		ERROR_MSG("could not get buffer name: %d", ret);
 		return FALSE;
@@ -502,7 +513,7 @@ ARMSOCPrepareAccess(PixmapPtr pPixmap, int index)
 	/* Inform UMP that the CPU will be using the buffer now. This invalidates
 	 * the L2 cache for this buffer. */
 	if (di->gem_set_domain) {
-		gsd.handle = armsoc_bo_handle(priv->bo);
+		gsd.handle = armsoc_bo_handle(bo);
 		gsd.write_domain |= ARMSOC_GEM_DOMAIN_CPU;
 		ret = di->gem_set_domain(pARMSOC->drmFD, gsd);
 		if (ret < 0)
@@ -527,15 +538,24 @@ _X_EXPORT void
 ARMSOCFinishAccess(PixmapPtr pPixmap, int index)
 {
 	struct ARMSOCPixmapPrivRec *priv = exaGetPixmapDriverPrivate(pPixmap);
-	ScrnInfoPtr pScrn = pix2scrn(pPixmap);
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	struct drmmode_interface *di = pARMSOC->drmmode_interface;
-	int ret;
 
 	pPixmap->devPrivate.ptr = NULL;
 	if (!priv->ext_access_cnt || priv->usage_hint == ARMSOC_CREATE_PIXMAP_SCANOUT)
 		return;
 
+	ARMSOCFinishBoAccess(pix2scrn(pPixmap), priv->bo);
+}
+
+/**
+ * End CPU access to a bo started with ARMSOCPrepareBoAccess().
+ */
+void
+ARMSOCFinishBoAccess(ScrnInfoPtr pScrn, struct armsoc_bo *bo)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_interface *di = pARMSOC->drmmode_interface;
+	int ret;
+
 	/* Flush the CPU L1 cache. */
 	if (di->cache_ops_control) {
 		ret = di->cache_ops_control(pARMSOC->drmFD,
@@ -549,7 +569,7 @@ ARMSOCFinishAccess(PixmapPtr pPixmap, int index)
 	if (pARMSOC->umplock_fd >= 0) {
 		int ret;
 		_lock_item_s item;
-		ret = armsoc_bo_get_name(priv->bo, &item.secure_id);
+		ret = armsoc_bo_get_name(bo, &item.secure_id);
 		if (ret) {
 			ERROR_MSG("could not get buffer name: %d", ret);
 			return;
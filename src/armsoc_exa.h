@@ -122,6 +122,8 @@ Bool ARMSOCModifyPixmapHeader(PixmapPtr pPixmap, int width, int height,
 void ARMSOCWaitMarker(ScreenPtr pScreen, int marker);
 Bool ARMSOCPrepareAccess(PixmapPtr pPixmap, int index);
 void ARMSOCFinishAccess(PixmapPtr pPixmap, int index);
+Bool ARMSOCPrepareBoAccess(ScrnInfoPtr pScrn, struct armsoc_bo *bo);
+void ARMSOCFinishBoAccess(ScrnInfoPtr pScrn, struct armsoc_bo *bo);
 Bool ARMSOCPixmapIsOffscreen(PixmapPtr pPixmap);
 
 static inline struct armsoc_bo *
@@ -135,6 +135,10 @@ InitNullEXA(ScreenPtr pScreen, ScrnInfoPtr pScrn, int fd)
 			EXA_HANDLES_PIXMAPS | EXA_SUPPORTS_PREPARE_AUX;
 	exa->maxX = 4096;
 	exa->maxY = 4096;
+	if (ARMSOCPTR(pScrn)->perCrtcScanout) {
+		exa->maxX = ARMSOC_PER_CRTC_MAX_SIZE;
+		exa->maxY = ARMSOC_PER_CRTC_MAX_SIZE;
+	}
 
 	/* Required EXA functions: */
 	exa->WaitMarker = ARMSOCWaitMarker;
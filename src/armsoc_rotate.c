@@ -0,0 +1,494 @@
+/*
+ * Copyright (C) 2026 The xf86-video-armsoc authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define ROTATE_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define ROTATE_SSE2 1
+#endif
+
+#include "armsoc_rotate.h"
+
+/* Writes go out a cache line of pixels at a time, which write-combined
+ * scanout buffers take best.
+ */
+#define ROTATE_LINE_PIXELS 16
+
+/* Below this many pixels, waking the workers costs more than it saves */
+#define ROTATE_THREAD_MIN_PIXELS (256 * 256)
+
+struct rotate_job {
+	int degrees;
+	uint8_t *dst;
+	int dst_pitch;
+	int dst_w;
+	int dst_h;
+	const uint8_t *src;
+	int src_pitch;
+	/* the boxes to write, in dst coordinates */
+	const pixman_box16_t *boxes;
+	int nbox;
+};
+
+struct armsoc_rotate_pool {
+	int threads;		/* workers, the caller being one more */
+	pthread_t *tids;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned int generation;
+	int busy;		/* workers still on the current job */
+	int quit;
+	const struct rotate_job *job;
+};
+
+/* d[j][i] = s[i][j], for i and j in 0..3 */
+static inline void
+rotate_transpose4(const uint32_t *s0, const uint32_t *s1,
+		const uint32_t *s2, const uint32_t *s3,
+		uint32_t *d0, uint32_t *d1, uint32_t *d2, uint32_t *d3)
+{
+#if defined(ROTATE_NEON)
+	uint32x4x2_t t01 = vtrnq_u32(vld1q_u32(s0), vld1q_u32(s1));
+	uint32x4x2_t t23 = vtrnq_u32(vld1q_u32(s2), vld1q_u32(s3));
+
+	vst1q_u32(d0, vcombine_u32(vget_low_u32(t01.val[0]),
+			vget_low_u32(t23.val[0])));
+	vst1q_u32(d1, vcombine_u32(vget_low_u32(t01.val[1]),
+			vget_low_u32(t23.val[1])));
+	vst1q_u32(d2, vcombine_u32(vget_high_u32(t01.val[0]),
+			vget_high_u32(t23.val[0])));
+	vst1q_u32(d3, vcombine_u32(vget_high_u32(t01.val[1]),
+			vget_high_u32(t23.val[1])));
+#elif defined(ROTATE_SSE2)
+	__m128i r0 = _mm_loadu_si128((const __m128i *)s0);
+	__m128i r1 = _mm_loadu_si128((const __m128i *)s1);
+	__m128i r2 = _mm_loadu_si128((const __m128i *)s2);
+	__m128i r3 = _mm_loadu_si128((const __m128i *)s3);
+	__m128i t0 = _mm_unpacklo_epi32(r0, r1);
+	__m128i t1 = _mm_unpacklo_epi32(r2, r3);
+	__m128i t2 = _mm_unpackhi_epi32(r0, r1);
+	__m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+	_mm_storeu_si128((__m128i *)d0, _mm_unpacklo_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)d1, _mm_unpackhi_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)d2, _mm_unpacklo_epi64(t2, t3));
+	_mm_storeu_si128((__m128i *)d3, _mm_unpackhi_epi64(t2, t3));
+#else
+	const uint32_t *s[4] = { s0, s1, s2, s3 };
+	uint32_t *d[4] = { d0, d1, d2, d3 };
+	int i, j;
+
+	for (j = 0; j < 4; j++)
+		for (i = 0; i < 4; i++)
+			d[j][i] = s[i][j];
+#endif
+}
+
+/* d[i] = s[3 - i], for i in 0..3 */
+static inline void
+rotate_reverse4(const uint32_t *s, uint32_t *d)
+{
+#if defined(ROTATE_NEON)
+	uint32x4_t v = vrev64q_u32(vld1q_u32(s));
+
+	vst1q_u32(d, vcombine_u32(vget_high_u32(v), vget_low_u32(v)));
+#elif defined(ROTATE_SSE2)
+	__m128i v = _mm_loadu_si128((const __m128i *)s);
+
+	_mm_storeu_si128((__m128i *)d,
+			_mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+#else
+	d[0] = s[3];
+	d[1] = s[2];
+	d[2] = s[1];
+	d[3] = s[0];
+#endif
+}
+
+/* The source pixel shown at (x, y) of the destination */
+static inline const uint32_t *
+rotate_src_pixel(const struct rotate_job *job, int x, int y)
+{
+	int sx, sy;
+
+	switch (job->degrees) {
+	case 90:
+		sx = job->dst_h - 1 - y;
+		sy = x;
+		break;
+	case 180:
+		sx = job->dst_w - 1 - x;
+		sy = job->dst_h - 1 - y;
+		break;
+	default: /* 270 */
+		sx = y;
+		sy = job->dst_w - 1 - x;
+		break;
+	}
+
+	return (const uint32_t *)(job->src + sy * job->src_pitch) + sx;
+}
+
+static inline uint32_t *
+rotate_dst_row(const struct rotate_job *job, int y)
+{
+	return (uint32_t *)(job->dst + y * job->dst_pitch);
+}
+
+static void
+rotate_span(const struct rotate_job *job, int x1, int x2, int y)
+{
+	uint32_t *d = rotate_dst_row(job, y);
+	int x;
+
+	for (x = x1; x < x2; x++)
+		d[x] = *rotate_src_pixel(job, x, y);
+}
+
+/*
+ * Rows y1 to y2 of [x1, x2) for 90 and 270 degrees: 4 x 4 blocks are
+ * transposed a row of them at a time, so that each of the 4 destination
+ * rows is written from left to right.
+ */
+static void
+rotate_rows_transpose(const struct rotate_job *job, int x1, int x2,
+		int y1, int y2)
+{
+	int sp = job->src_pitch / 4;
+	int x, y;
+
+	for (y = y1; y + 4 <= y2; y += 4) {
+		uint32_t *d0 = rotate_dst_row(job, y);
+		uint32_t *d1 = rotate_dst_row(job, y + 1);
+		uint32_t *d2 = rotate_dst_row(job, y + 2);
+		uint32_t *d3 = rotate_dst_row(job, y + 3);
+
+		for (x = x1; x + 4 <= x2; x += 4) {
+			const uint32_t *s;
+
+			if (job->degrees == 90) {
+				/* rows x.., columns h - 4 - y.. of src go
+				 * to the destination rows bottom up
+				 */
+				s = rotate_src_pixel(job, x, y + 3);
+				rotate_transpose4(s, s + sp, s + 2 * sp,
+						s + 3 * sp, d3 + x, d2 + x,
+						d1 + x, d0 + x);
+			} else {
+				/* rows w - 1 - x.. upwards of src */
+				s = rotate_src_pixel(job, x, y);
+				rotate_transpose4(s, s - sp, s - 2 * sp,
+						s - 3 * sp, d0 + x, d1 + x,
+						d2 + x, d3 + x);
+			}
+		}
+
+		if (x < x2) {
+			rotate_span(job, x, x2, y);
+			rotate_span(job, x, x2, y + 1);
+			rotate_span(job, x, x2, y + 2);
+			rotate_span(job, x, x2, y + 3);
+		}
+	}
+
+	for (; y < y2; y++)
+		rotate_span(job, x1, x2, y);
+}
+
+/* Rows y1 to y2 of [x1, x2) for 180 degrees: rows of src reversed */
+static void
+rotate_rows_reverse(const struct rotate_job *job, int x1, int x2,
+		int y1, int y2)
+{
+	int x, y;
+
+	for (y = y1; y < y2; y++) {
+		uint32_t *d = rotate_dst_row(job, y);
+
+		for (x = x1; x + 4 <= x2; x += 4)
+			rotate_reverse4(rotate_src_pixel(job, x + 3, y), d + x);
+
+		for (; x < x2; x++)
+			d[x] = *rotate_src_pixel(job, x, y);
+	}
+}
+
+/* Band index of count of every box of job, split along its rows */
+static void
+rotate_run(const struct rotate_job *job, int index, int count)
+{
+	int i;
+
+	for (i = 0; i < job->nbox; i++) {
+		const pixman_box16_t *box = &job->boxes[i];
+		int h = box->y2 - box->y1;
+		/* bands start on whole blocks of rows */
+		int y1 = box->y1 + ((h * index / count) & ~3);
+		int y2 = index + 1 == count ? box->y2 :
+				box->y1 + ((h * (index + 1) / count) & ~3);
+
+		if (y1 >= y2)
+			continue;
+
+		if (job->degrees == 180)
+			rotate_rows_reverse(job, box->x1, box->x2, y1, y2);
+		else
+			rotate_rows_transpose(job, box->x1, box->x2, y1, y2);
+	}
+}
+
+static void *
+rotate_worker(void *arg)
+{
+	struct armsoc_rotate_pool *pool = arg;
+	unsigned int seen = 0;
+	int index;
+
+	pthread_mutex_lock(&pool->lock);
+	/* the workers are numbered from 1, the caller taking band 0 */
+	index = pool->busy;
+	pool->busy = 0;
+	pthread_cond_signal(&pool->done);
+	for (;;) {
+		const struct rotate_job *job;
+
+		while (pool->generation == seen && !pool->quit)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->quit)
+			break;
+		seen = pool->generation;
+		job = pool->job;
+		pthread_mutex_unlock(&pool->lock);
+
+		rotate_run(job, index, pool->threads + 1);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct armsoc_rotate_pool *
+armsoc_rotate_pool_new(int threads)
+{
+	struct armsoc_rotate_pool *pool;
+	sigset_t all, saved;
+	int i;
+
+	if (threads <= 1)
+		return NULL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->tids = calloc(threads - 1, sizeof(*pool->tids));
+	if (!pool->tids) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	/* Signals are for the thread which created the pool, the workers
+	 * inherit a mask blocking them all.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < threads - 1; i++) {
+		pool->busy = pool->threads + 1;
+		if (pthread_create(&pool->tids[i], NULL, rotate_worker, pool))
+			break;
+		pool->threads++;
+		/* wait for the worker to take its index */
+		while (pool->busy)
+			pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	if (!pool->threads) {
+		armsoc_rotate_pool_free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void
+armsoc_rotate_pool_free(struct armsoc_rotate_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->threads; i++)
+		pthread_join(pool->tids[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->tids);
+	free(pool);
+}
+
+/*
+ * The box of the destination showing box of the source, widened to whole
+ * cache lines. Returns FALSE if it is empty.
+ */
+static int
+rotate_dst_box(int degrees, int dst_w, int dst_h,
+		const pixman_box16_t *box, pixman_box16_t *out)
+{
+	int x1, y1, x2, y2;
+
+	switch (degrees) {
+	case 90:
+		x1 = box->y1;
+		x2 = box->y2;
+		y1 = dst_h - box->x2;
+		y2 = dst_h - box->x1;
+		break;
+	case 180:
+		x1 = dst_w - box->x2;
+		x2 = dst_w - box->x1;
+		y1 = dst_h - box->y2;
+		y2 = dst_h - box->y1;
+		break;
+	default: /* 270 */
+		x1 = dst_w - box->y2;
+		x2 = dst_w - box->y1;
+		y1 = box->x1;
+		y2 = box->x2;
+		break;
+	}
+
+	x1 &= ~(ROTATE_LINE_PIXELS - 1);
+	x2 = (x2 + ROTATE_LINE_PIXELS - 1) & ~(ROTATE_LINE_PIXELS - 1);
+
+	if (x1 < 0)
+		x1 = 0;
+	if (y1 < 0)
+		y1 = 0;
+	if (x2 > dst_w)
+		x2 = dst_w;
+	if (y2 > dst_h)
+		y2 = dst_h;
+
+	if (x1 >= x2 || y1 >= y2)
+		return 0;
+
+	out->x1 = x1;
+	out->y1 = y1;
+	out->x2 = x2;
+	out->y2 = y2;
+	return 1;
+}
+
+void
+armsoc_rotate_boxes(struct armsoc_rotate_pool *pool, int degrees,
+		void *dst, int dst_pitch, int dst_w, int dst_h,
+		const void *src, int src_pitch,
+		const pixman_box16_t *boxes, int nbox)
+{
+	pixman_box16_t stack_boxes[16];
+	pixman_box16_t *dst_boxes = stack_boxes;
+	struct rotate_job job;
+	long pixels = 0;
+	int i, n = 0;
+
+	if (degrees != 90 && degrees != 180 && degrees != 270)
+		return;
+
+	if (nbox > 16) {
+		dst_boxes = malloc(nbox * sizeof(*dst_boxes));
+		if (!dst_boxes)
+			return;
+	}
+
+	for (i = 0; i < nbox; i++) {
+		if (!rotate_dst_box(degrees, dst_w, dst_h, &boxes[i],
+				&dst_boxes[n]))
+			continue;
+		pixels += (long)(dst_boxes[n].x2 - dst_boxes[n].x1) *
+				(dst_boxes[n].y2 - dst_boxes[n].y1);
+		n++;
+	}
+
+	job.degrees = degrees;
+	job.dst = dst;
+	job.dst_pitch = dst_pitch;
+	job.dst_w = dst_w;
+	job.dst_h = dst_h;
+	job.src = src;
+	job.src_pitch = src_pitch;
+	job.boxes = dst_boxes;
+	job.nbox = n;
+
+	if (!pool || pixels < ROTATE_THREAD_MIN_PIXELS) {
+		rotate_run(&job, 0, 1);
+	} else {
+		pthread_mutex_lock(&pool->lock);
+		pool->job = &job;
+		pool->busy = pool->threads;
+		pool->generation++;
+		pthread_cond_broadcast(&pool->start);
+		pthread_mutex_unlock(&pool->lock);
+
+		rotate_run(&job, 0, pool->threads + 1);
+
+		pthread_mutex_lock(&pool->lock);
+		while (pool->busy)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (dst_boxes != stack_boxes)
+		free(dst_boxes);
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2026 The xf86-video-armsoc authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ARMSOC_ROTATE_H_
+#define ARMSOC_ROTATE_H_
+
+#include <stdint.h>
+#include <pixman.h>
+
+/*
+ * Software rotation of 32bpp scanout areas, for CRTCs the display
+ * controller can't rotate. This doesn't depend on the X server, so that
+ * armsoc_rotate_bench can compare it with pixman.
+ */
+
+struct armsoc_rotate_pool;
+
+/* Worker threads sharing the rotation of large areas with the caller, or
+ * NULL if threads is 1 or less.
+ */
+struct armsoc_rotate_pool *armsoc_rotate_pool_new(int threads);
+void armsoc_rotate_pool_free(struct armsoc_rotate_pool *pool);
+
+/*
+ * Rotate the boxes of src counter-clockwise by degrees (90, 180 or 270)
+ * into dst, which is dst_w x dst_h pixels. src points at the top left of
+ * the area dst shows, which is dst_h x dst_w pixels for 90 and 270
+ * degrees, and the boxes are relative to it. The output matches that of
+ * the X server's RandR rotation. The areas written to dst are widened to
+ * whole cache lines. pool may be NULL.
+ */
+void armsoc_rotate_boxes(struct armsoc_rotate_pool *pool, int degrees,
+		void *dst, int dst_pitch, int dst_w, int dst_h,
+		const void *src, int src_pitch,
+		const pixman_box16_t *boxes, int nbox);
+
+#endif /* ARMSOC_ROTATE_H_ */
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2026 The xf86-video-armsoc authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Compares the rotation of armsoc_rotate.c with the generic path of the X
+ * server, which composites the screen through a pixman transform into the
+ * shadow of a rotated CRTC. Built on request:
+ *
+ *	make -C src armsoc_rotate_bench
+ *	src/armsoc_rotate_bench [width height [frames [threads]]]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "armsoc_rotate.h"
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The transform xf86CrtcRotate() sets up, see RRTransformCompute() */
+static void
+bench_transform(pixman_image_t *src, int degrees, int w, int h)
+{
+	struct pixman_f_transform f;
+	struct pixman_transform t;
+
+	pixman_f_transform_init_identity(&f);
+	switch (degrees) {
+	case 90:
+		pixman_f_transform_rotate(&f, NULL, 0, 1);
+		pixman_f_transform_translate(&f, NULL, h, 0);
+		break;
+	case 180:
+		pixman_f_transform_rotate(&f, NULL, -1, 0);
+		pixman_f_transform_translate(&f, NULL, w, h);
+		break;
+	default:
+		pixman_f_transform_rotate(&f, NULL, 0, -1);
+		pixman_f_transform_translate(&f, NULL, 0, w);
+		break;
+	}
+
+	pixman_transform_from_pixman_f_transform(&t, &f);
+	pixman_image_set_transform(src, &t);
+	pixman_image_set_filter(src, PIXMAN_FILTER_NEAREST, NULL, 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int degrees[] = { 90, 180, 270 };
+	int w = argc > 2 ? atoi(argv[1]) : 1920;
+	int h = argc > 2 ? atoi(argv[2]) : 1080;
+	int frames = argc > 3 ? atoi(argv[3]) : 50;
+	int threads = argc > 4 ? atoi(argv[4]) : 4;
+	struct armsoc_rotate_pool *pool;
+	uint32_t *src_bits, *ref_bits, *dst_bits;
+	int pitch = ((w > h ? w : h) * 4 + 63) & ~63;
+	int i, d, ret = 0;
+
+	if (w <= 0 || h <= 0 || frames <= 0) {
+		fprintf(stderr, "usage: %s [width height [frames [threads]]]\n",
+				argv[0]);
+		return 2;
+	}
+
+	src_bits = malloc((size_t)pitch * (w > h ? w : h));
+	ref_bits = malloc((size_t)pitch * h);
+	dst_bits = malloc((size_t)pitch * h);
+	if (!src_bits || !ref_bits || !dst_bits) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < pitch / 4 * (w > h ? w : h); i++)
+		src_bits[i] = rand();
+
+	pool = armsoc_rotate_pool_new(threads);
+
+	printf("%dx%d, %d frames, %d threads\n", w, h, frames,
+			pool ? threads : 1);
+
+	for (d = 0; d < 3; d++) {
+		int sw = degrees[d] == 180 ? w : h;
+		int sh = degrees[d] == 180 ? h : w;
+		pixman_box16_t box = { 0, 0, sw, sh };
+		pixman_image_t *src, *dst;
+		double t, generic, single, pooled;
+
+		src = pixman_image_create_bits(PIXMAN_x8r8g8b8, sw, sh,
+				src_bits, pitch);
+		dst = pixman_image_create_bits(PIXMAN_x8r8g8b8, w, h,
+				ref_bits, pitch);
+		bench_transform(src, degrees[d], w, h);
+
+		t = bench_now();
+		for (i = 0; i < frames; i++)
+			pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, dst,
+					0, 0, 0, 0, 0, 0, w, h);
+		generic = bench_now() - t;
+
+		t = bench_now();
+		for (i = 0; i < frames; i++)
+			armsoc_rotate_boxes(NULL, degrees[d], dst_bits, pitch,
+					w, h, src_bits, pitch, &box, 1);
+		single = bench_now() - t;
+
+		t = bench_now();
+		for (i = 0; i < frames; i++)
+			armsoc_rotate_boxes(pool, degrees[d], dst_bits, pitch,
+					w, h, src_bits, pitch, &box, 1);
+		pooled = bench_now() - t;
+
+		for (i = 0; i < h; i++) {
+			if (memcmp((char *)ref_bits + i * pitch,
+					(char *)dst_bits + i * pitch, w * 4))
+				break;
+		}
+
+		printf("%3d degrees: pixman %7.2f ms, armsoc %7.2f ms, "
+				"threaded %7.2f ms per frame%s\n",
+				degrees[d], generic * 1000 / frames,
+				single * 1000 / frames,
+				pooled * 1000 / frames,
+				i < h ? " (MISMATCH)" : "");
+		if (i < h)
+			ret = 1;
+
+		pixman_image_unref(dst);
+		pixman_image_unref(src);
+	}
+
+	armsoc_rotate_pool_free(pool);
+	free(dst_bits);
+	free(ref_bits);
+	free(src_bits);
+
+	return ret;
+}
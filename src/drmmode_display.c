@@ -33,6 +33,8 @@
 #endif
 
 #include <sys/stat.h>
+#include <pixman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "xf86DDC.h"
@@ -46,7 +48,9 @@
 #endif
 
 #include "armsoc_driver.h"
+#include "armsoc_rotate.h"
 
+#include "damage.h"
 #include "xf86drmMode.h"
 #include "drm_fourcc.h"
 #include "X11/Xatom.h"
@@ -54,15 +58,72 @@
 #include <libudev.h>
 #include "drmmode_driver.h"
 
-struct drmmode_cursor_rec {
-	/* hardware cursor: */
-	struct armsoc_bo *bo;
-	int x, y;
-	 /* These are used for HWCURSOR_API_PLANE */
-	drmModePlane *ovr;
+/* Plane types, for libdrm older than universal planes */
+#ifndef DRM_PLANE_TYPE_OVERLAY
+#define DRM_PLANE_TYPE_OVERLAY 0
+#define DRM_PLANE_TYPE_PRIMARY 1
+#define DRM_PLANE_TYPE_CURSOR 2
+#endif
+
+#ifdef HAVE_DRM_ATOMIC
+/* Ids of the properties an atomic commit sets to show a fb on a plane */
+struct drmmode_plane_props {
 	uint32_t fb_id;
+	uint32_t crtc_id;
+	uint32_t src_x, src_y, src_w, src_h;
+	uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+};
+#endif
+
+/*
+ * Cursor images are loaded into a buffer the kernel isn't scanning out,
+ * then flipped to. Up to two buffers of a CRTC may be scanned out, see
+ * drmmode_cursor_shown(), so there is always a third one free.
+ */
+#define DRMMODE_CURSOR_BUFS 3
+/* what a hidden cursor shows */
+#define DRMMODE_CURSOR_NONE 0xff
+
+/* Hardware cursor of one CRTC */
+struct drmmode_crtc_cursor {
+	struct armsoc_bo *bo[DRMMODE_CURSOR_BUFS];
+	 /* These are used for HWCURSOR_API_PLANE, ovr is NULL if the CRTC
+	  * has no plane to show the cursor on
+	  */
+	drmModePlane *ovr;
+	uint32_t fb_id[DRMMODE_CURSOR_BUFS];
 	/* This is used for HWCURSOR_API_STANDARD */
-	uint32_t handle;
+	uint32_t handle[DRMMODE_CURSOR_BUFS];
+	/* buffer holding the last image loaded, and a hash of that image */
+	int front;
+	Bool image_valid;
+	uint64_t image_hash;
+	/* buffers the kernel may be scanning out, see drmmode_cursor_shown() */
+	uint32_t scanout;
+	struct drmmode_prop_table *kms_props; /* ovr's properties */
+#ifdef HAVE_DRM_ATOMIC
+	/* properties of ovr, if it is updated through atomic commits,
+	 * whether the cursor state has yet to be committed, and the buffer
+	 * staged by the main thread for its next commit
+	 */
+	struct drmmode_plane_props props;
+	Bool dirty;
+	int staged;
+#endif
+};
+
+struct drmmode_cursor_rec {
+	/* fires when the moves latched since the last update are due */
+	OsTimerPtr timer;
+	Bool timer_pending;
+	/* pointer moves received, and cursor updates sent to the kernel,
+	 * counted from both the input and the main thread
+	 */
+	unsigned long moves;
+	unsigned long updates;
+	/* last image loaded and its hash, shared by the CRTCs it goes to */
+	const CARD32 *image;
+	uint64_t image_hash;
 };
 
 struct drmmode_rec {
@@ -71,13 +132,58 @@ struct drmmode_rec {
 	int cpp;
 	struct udev_monitor *uevent_monitor;
 	InputHandlerProc uevent_handler;
+	/* fires once a burst of hotplug events has settled, or once the
+	 * screen is up with FastStartup, then the outputs are to be probed
+	 * from the block handler, and is set while only the connectors which
+	 * changed are to be probed, see drmmode_hotplug_probe()
+	 */
+	OsTimerPtr hotplug_timer;
+	Bool hotplug_pending;
+	Bool probe_changed_only;
 	struct drmmode_cursor_rec *cursor;
+	/* mode sets and page flips go through atomic commits, see
+	 * drmmode_atomic_init()
+	 */
+	Bool atomic;
+	/* page flips of the root whose events are still to arrive */
+	int root_flips;
+#ifdef HAVE_DRM_ATOMIC
+	/* plane updates staged for the next commit, and the number of atomic
+	 * page flips in flight, see drmmode_atomic_flush()
+	 */
+	drmModeAtomicReqPtr pending;
+	int flips_pending;
+#endif
+	/* damage to the root since the CRTCs scanning out copies of it
+	 * were last redrawn, and the threads rotating large areas, see
+	 * drmmode_redisplay()
+	 */
+	DamagePtr redisplay_damage;
+	/* redraws of the copies, the pixels they read from the root and the
+	 * time they took, see drmmode_redisplay_dump_stats()
+	 */
+	unsigned long redisplays;
+	uint64_t redisplay_pixels;
+	uint64_t redisplay_ns;
+	struct armsoc_rotate_pool *rotate_pool;
 };
 
 struct drmmode_crtc_private_rec {
 	struct drmmode_rec *drmmode;
 	uint32_t crtc_id;
+	/* index of the CRTC in the kernel's list, used for vblank requests */
+	int pipe;
+	struct drmmode_crtc_cursor cursor;
 	int cursor_visible;
+	/* cursor buffer last shown on this CRTC */
+	int cursor_buf;
+	/* cursor position (x in the upper half, y in the lower one, see
+	 * drmmode_cursor_get_pos()), whether it moved since the cursor was
+	 * last updated on this CRTC, and when that was
+	 */
+	uint64_t cursor_pos;
+	Bool cursor_moved;
+	uint64_t cursor_update_ns;
 	/* settings retained on last good modeset */
 	int last_good_x;
 	int last_good_y;
@@ -86,6 +192,63 @@ struct drmmode_crtc_private_rec {
 	Rotation last_good_rotation;
 	DisplayModePtr last_good_mode;
 	struct armsoc_bo *rotate_bo;
+	/* the KMS object and "rotation" property rotating the scanout, the
+	 * rotations it supports and the one it is set to, see
+	 * drmmode_crtc_init_rotation()
+	 */
+	uint32_t rotation_obj;
+	uint32_t rotation_obj_type;
+	uint32_t rotation_prop;
+	Rotation hw_rotations;
+	Rotation hw_rotation;
+	/* the rotation drmmode_redisplay() draws on the CPU, the copy of
+	 * the viewport it draws into, which the CRTC scans out when rotated
+	 * that way or with PerCrtcScanout, and the root buffer it last read
+	 */
+	Rotation sw_rotation;
+	struct armsoc_bo *copy_bo;
+	struct armsoc_bo *copy_src;
+	/* size of the root area the primary plane scales up (or down) to
+	 * the mode, 0 if the scanout isn't scaled
+	 */
+	int scale_w;
+	int scale_h;
+	/* bo scanned out in place of the root scanout buffer while a DRI2
+	 * window covering this CRTC flips on it alone, the position of the
+	 * CRTC's viewport in the root when that started, and the bo of a
+	 * flip which is still pending. The root's contents under the
+	 * viewport are stale while scanout_bo is set, unless restore_pending
+	 * says they have been brought up to date and the CRTC is waiting to
+	 * go back on the root, see drmmode_crtc_defer_restore().
+	 */
+	struct armsoc_bo *scanout_bo;
+	int scanout_x;
+	int scanout_y;
+	struct armsoc_bo *flip_bo;
+	Bool restore_pending;
+	struct drmmode_prop_table *kms_props;
+	/* DPMS mode of the pipe, and the frame counter kept while it is off:
+	 * the count and time in microseconds of the last frame it showed,
+	 * and what makes the kernel's counter carry on from there once it
+	 * is back on, see drmmode_crtc_msc()
+	 */
+	int dpms_mode;
+	uint64_t blank_msc;
+	uint64_t blank_ust;
+	uint64_t msc_offset;
+	/* primary plane, for atomic commits */
+	uint32_t primary_plane_id;
+#ifdef HAVE_DRM_ATOMIC
+	struct drmmode_plane_props primary;
+	/* the CRTC's MODE_ID and ACTIVE properties, and the blob holding
+	 * the mode it was last set to
+	 */
+	uint32_t mode_id_prop;
+	uint32_t active_prop;
+	uint32_t mode_blob;
+	/* a pan is staged in drmmode->pending, see drmmode_crtc_pan() */
+	Bool pan_pending;
+#endif
 };
 
 struct drmmode_prop_rec {
@@ -111,770 +274,2999 @@ struct drmmode_output_priv {
 	struct drmmode_prop_rec *props;
 	int enc_mask;   /* encoders present (mask of encoder indices) */
 	int enc_clones; /* encoder clones possible (mask of encoder indices) */
+	struct drmmode_prop_table *kms_props; /* the connector's properties */
+	/* the connector changed since it was last probed, and with
+	 * FastStartup, whether its probe and RandR properties are put off
+	 * until after startup, see drmmode_hotplug_probe()
+	 */
+	Bool changed;
+	Bool deferred;
+	/* modes last built for the connector, and the kernel modes and
+	 * underscan they were built from, reused while those stay the same
+	 */
+	DisplayModePtr modes;
+	drmModeModeInfo *kmodes;
+	int count_kmodes;
+	int modes_xu;
+	int modes_yu;
+#ifdef HAVE_DRM_ATOMIC
+	uint32_t crtc_id_prop; /* the connector's CRTC_ID property */
+#endif
 };
 
 static void drmmode_output_dpms(xf86OutputPtr output, int mode);
-static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height);
+static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height,
+		uint32_t *old_fb_id);
+static void drmmode_crtc_release_scanout(xf86CrtcPtr crtc);
+static void drmmode_show_cursor_image(xf86CrtcPtr crtc, Bool update_image);
+
+/*
+ * Property tables
+ *
+ * The properties of a KMS object (connector, CRTC or plane) are fetched
+ * once into a table hashed by name and by id, rather than walking them
+ * all with drmModeGetProperty whenever one is needed. Property metadata
+ * doesn't change; values do, and are still read from the kernel, see
+ * drmmode_prop_value(). A table only grows, so the properties it hands
+ * out stay valid until it is freed.
+ */
+struct drmmode_prop_table {
+	int fd;
+	uint32_t obj_id;
+	int count;
+	drmModePropertyPtr *props;
+	/* open addressed, with hash_size a power of two and at least twice
+	 * count; slots hold an index + 1 into props, or 0 if free
+	 */
+	int hash_size;
+	int *by_name;
+	int *by_id;
+	struct drmmode_prop_table *next;
+};
 
-static void drmmode_get_underscan(int fd, uint32_t crtc_id, int *outx, int *outy)
+/* All tables, for drmmode_object_prop_id() */
+static struct drmmode_prop_table *drmmode_prop_tables;
+
+static uint32_t
+drmmode_prop_hash_name(const char *name)
 {
-	int crop = 0, i;
-	int x = 0, y = 0;
+	uint32_t hash = 2166136261u; /* FNV-1a */
 
-	drmModePropertyPtr prop;
-	drmModeObjectPropertiesPtr crtcprops;
-	crtcprops = drmModeObjectGetProperties(fd, crtc_id,
-	                                       DRM_MODE_OBJECT_CRTC);
-
-	for (i = 0; i < crtcprops->count_props; i++) {
-		prop = drmModeGetProperty(fd, crtcprops->props[i]);
-		if (!strcmp(prop->name, "underscan")) {
-			int e;
-			for (e = 0; e < prop->count_enums; e++) {
-				if (prop->enums[e].value == crtcprops->prop_values[i] &&
-				    !strcmp(prop->enums[e].name, "crop"))
-					crop = 1;
-			}
-		}
-		if (!strcmp(prop->name, "underscan vborder"))
-			y = crtcprops->prop_values[i];
-		if (!strcmp(prop->name, "underscan hborder"))
-			x = crtcprops->prop_values[i];
-		drmModeFreeProperty(prop);
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
 	}
 
-	if (!crop) {
-		*outx = 0;
-		*outy = 0;
-	} else {
-		*outx = x;
-		*outy = y;
-	}
+	return hash;
 }
 
-static struct drmmode_rec *
-drmmode_from_scrn(ScrnInfoPtr pScrn)
+static uint32_t
+drmmode_prop_hash_id(uint32_t prop_id)
 {
-	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
-	struct drmmode_crtc_private_rec *drmmode_crtc;
-
-	drmmode_crtc = xf86_config->crtc[0]->driver_private;
-	return drmmode_crtc->drmmode;
+	return prop_id * 2654435761u;
 }
 
 static void
-drmmode_ConvertFromKMode(ScrnInfoPtr pScrn, drmModeModeInfo *kmode,
-		DisplayModePtr	mode, int xu, int yu)
+drmmode_prop_table_hash(struct drmmode_prop_table *t, int index)
 {
-	memset(mode, 0, sizeof(DisplayModeRec));
-	mode->status = MODE_OK;
+	drmModePropertyPtr prop = t->props[index];
+	uint32_t mask = t->hash_size - 1;
+	uint32_t slot;
+
+	slot = drmmode_prop_hash_name(prop->name) & mask;
+	while (t->by_name[slot])
+		slot = (slot + 1) & mask;
+	t->by_name[slot] = index + 1;
+
+	slot = drmmode_prop_hash_id(prop->prop_id) & mask;
+	while (t->by_id[slot])
+		slot = (slot + 1) & mask;
+	t->by_id[slot] = index + 1;
+}
 
-	mode->Clock = kmode->clock;
+/* Make room for count more properties in t */
+static Bool
+drmmode_prop_table_reserve(struct drmmode_prop_table *t, int count)
+{
+	drmModePropertyPtr *props;
+	int *by_name, *by_id;
+	int size = t->hash_size ? t->hash_size : 16;
+	int i;
 
-	mode->HDisplay = kmode->hdisplay - 2*xu;
-	mode->HSyncStart = kmode->hsync_start;
-	mode->HSyncEnd = kmode->hsync_end;
-	mode->HTotal = kmode->htotal;
-	mode->HSkew = kmode->hskew;
+	if (2 * (t->count + count) <= t->hash_size)
+		return TRUE;
 
-	mode->VDisplay = kmode->vdisplay - 2*yu;
-	mode->VSyncStart = kmode->vsync_start;
-	mode->VSyncEnd = kmode->vsync_end;
-	mode->VTotal = kmode->vtotal;
-	mode->VScan = kmode->vscan;
+	while (size < 2 * (t->count + count))
+		size *= 2;
 
-	mode->Flags = kmode->flags;
-	mode->name = strdup(kmode->name);
+	props = realloc(t->props, size / 2 * sizeof(*props));
+	if (!props)
+		return FALSE;
+	t->props = props;
 
-	DEBUG_MSG("copy mode %s (%p %p)", kmode->name, mode->name, mode);
+	by_name = calloc(size, sizeof(*by_name));
+	by_id = calloc(size, sizeof(*by_id));
+	if (!by_name || !by_id) {
+		free(by_name);
+		free(by_id);
+		return FALSE;
+	}
 
-	if (kmode->type & DRM_MODE_TYPE_DRIVER)
-		mode->type = M_T_DRIVER;
+	free(t->by_name);
+	free(t->by_id);
+	t->by_name = by_name;
+	t->by_id = by_id;
+	t->hash_size = size;
 
-	if (kmode->type & DRM_MODE_TYPE_PREFERRED)
-		mode->type |= M_T_PREFERRED;
+	for (i = 0; i < t->count; i++)
+		drmmode_prop_table_hash(t, i);
 
-	xf86SetModeCrtc(mode, pScrn->adjustFlags);
-	/* We need to store the underscan values...
-	 * the exynose drm module doesn't touch HSkew
-	 * so we steal it for this. */
-	mode->HSkew = (xu << 8) + yu;
+	return TRUE;
 }
 
-static void
-drmmode_ConvertToKMode(ScrnInfoPtr pScrn, drmModeModeInfo *kmode,
-		DisplayModePtr mode)
+/* Return the property of t with id prop_id, or NULL */
+static drmModePropertyPtr
+drmmode_prop_find_id(const struct drmmode_prop_table *t, uint32_t prop_id)
 {
-	int xu, yu;
-
-	xu = mode->HSkew >> 8;
-	yu = mode->HSkew & 0xFF;
+	uint32_t mask, slot;
 
-	memset(kmode, 0, sizeof(*kmode));
-	kmode->clock = mode->Clock;
-	kmode->hdisplay = mode->HDisplay + 2*xu;
-	kmode->hsync_start = mode->HSyncStart;
-	kmode->hsync_end = mode->HSyncEnd;
-	kmode->htotal = mode->HTotal;
-	kmode->hskew = mode->HSkew;
+	if (!t || !t->hash_size)
+		return NULL;
 
-	kmode->vdisplay = mode->VDisplay + 2*yu;
-	kmode->vsync_start = mode->VSyncStart;
-	kmode->vsync_end = mode->VSyncEnd;
-	kmode->vtotal = mode->VTotal;
-	kmode->vscan = mode->VScan;
+	mask = t->hash_size - 1;
+	for (slot = drmmode_prop_hash_id(prop_id) & mask; t->by_id[slot];
+			slot = (slot + 1) & mask) {
+		drmModePropertyPtr prop = t->props[t->by_id[slot] - 1];
 
-	kmode->flags = mode->Flags;
-	if (mode->name)
-		strncpy(kmode->name, mode->name, DRM_DISPLAY_MODE_LEN);
-	kmode->name[DRM_DISPLAY_MODE_LEN-1] = 0;
-}
+		if (prop->prop_id == prop_id)
+			return prop;
+	}
 
-static void
-drmmode_crtc_dpms(xf86CrtcPtr drmmode_crtc, int mode)
-{
-	/* TODO: MIDEGL-1431: Implement this function */
+	return NULL;
 }
 
-/* Revert mode is odd with underscan properties present.
- * We must use the current properties instead of the one
- * saved with the mode.  We also need to change the mode
- * so it saves the current property values, so it's not
- * quite a real revert.
- *
- * this is all rather  untested because I don't know how to
- * cause a revert to occur on demand.
- * if this proves problematic, the next best solution might
- * be to set the properties based on the underscan values
- * encoded in the mode, but this could confusing to the UI.
- */
-static int
-drmmode_revert_mode(xf86CrtcPtr crtc, uint32_t *output_ids, int output_count)
+/* Return the property of t called name, or NULL */
+static drmModePropertyPtr
+drmmode_prop_find(const struct drmmode_prop_table *t, const char *name)
 {
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	uint32_t fb_id;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	drmModeModeInfo kmode;
-	int xu, yu;
+	uint32_t mask, slot;
 
-	drmmode_get_underscan(drmmode_crtc->drmmode->fd,
-	                      drmmode_crtc->crtc_id, &xu, &yu);
+	if (!t || !t->hash_size)
+		return NULL;
 
-	if (!drmmode_crtc->last_good_mode) {
-		DEBUG_MSG("No last good values to use");
-		return FALSE;
-	}
+	mask = t->hash_size - 1;
+	for (slot = drmmode_prop_hash_name(name) & mask; t->by_name[slot];
+			slot = (slot + 1) & mask) {
+		drmModePropertyPtr prop = t->props[t->by_name[slot] - 1];
 
-	/* revert to last good settings */
-	DEBUG_MSG("Reverting to last_good values");
-	if (!resize_scanout_bo(pScrn,
-			drmmode_crtc->last_good_mode->HDisplay,
-			drmmode_crtc->last_good_mode->VDisplay)) {
-		ERROR_MSG("Could not revert to last good mode");
-		return FALSE;
+		if (!strcmp(prop->name, name))
+			return prop;
 	}
 
-	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
-	drmmode_ConvertToKMode(crtc->scrn, &kmode,
-			drmmode_crtc->last_good_mode);
-	drmModeSetCrtc(drmmode_crtc->drmmode->fd,
-			drmmode_crtc->crtc_id,
-			fb_id,
-			drmmode_crtc->last_good_x,
-			drmmode_crtc->last_good_y,
-			output_ids, output_count, &kmode);
-	drmmode_crtc->underscan_x = xu;
-	drmmode_crtc->underscan_y = yu;
+	return NULL;
+}
 
-	/* update the underscan params so the mouse doesn't
-	 * get confused. */
-	drmmode_crtc->last_good_mode->HSkew = (xu << 8) + yu;
-	/* let RandR know we changed things */
-	xf86RandR12TellChanged(pScrn->pScreen);
+/* Return the id of the property of t called name, or 0 */
+static uint32_t
+drmmode_prop_table_id(const struct drmmode_prop_table *t, const char *name)
+{
+	drmModePropertyPtr prop = drmmode_prop_find(t, name);
 
-	return TRUE;
+	return prop ? prop->prop_id : 0;
 }
 
-static Bool
-drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
-		Rotation rotation, int x, int y)
+/*
+ * Add the properties among the count ids which t doesn't know yet, at the
+ * cost of an ioctl each.
+ */
+static void
+drmmode_prop_table_add(struct drmmode_prop_table *t, const uint32_t *ids,
+		int count)
 {
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	uint32_t *output_ids = NULL;
-	int output_count = 0;
-	int ret = TRUE;
-	int err;
 	int i;
-	uint32_t fb_id;
-	drmModeModeInfo kmode;
-	drmModeCrtcPtr newcrtc = NULL;
-	int xu, yu;
 
-	TRACE_ENTER();
+	if (!t || !drmmode_prop_table_reserve(t, count))
+		return;
 
-	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+	for (i = 0; i < count; i++) {
+		drmModePropertyPtr prop;
 
-	if (fb_id == 0) {
-		DEBUG_MSG("create framebuffer: %dx%d",
-				pScrn->virtualX, pScrn->virtualY);
+		if (drmmode_prop_find_id(t, ids[i]))
+			continue;
 
-		err = armsoc_bo_add_fb(pARMSOC->scanout);
-		if (err) {
-			ERROR_MSG(
-					"Failed to add framebuffer to the scanout buffer");
-			return FALSE;
-		}
+		prop = drmModeGetProperty(t->fd, ids[i]);
+		if (!prop)
+			continue;
 
-		fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
-		if (0 == fb_id)
-			return FALSE;
+		t->props[t->count] = prop;
+		drmmode_prop_table_hash(t, t->count);
+		t->count++;
 	}
+}
 
-	/* Set the new mode: */
-	crtc->mode = *mode;
-	crtc->x = x;
-	crtc->y = y;
-	crtc->rotation = rotation;
+/**
+ * Build the property table of the KMS object obj_id. If values isn't NULL,
+ * the current values of its properties are returned there as well, to be
+ * freed with drmModeFreeObjectProperties().
+ */
+static struct drmmode_prop_table *
+drmmode_prop_table_new(int fd, uint32_t obj_id, uint32_t obj_type,
+		drmModeObjectPropertiesPtr *values)
+{
+	struct drmmode_prop_table *t;
+	drmModeObjectPropertiesPtr props;
 
-	output_ids = calloc(xf86_config->num_output, sizeof(uint32_t));
-	if (!output_ids) {
-		ERROR_MSG(
-				"memory allocation failed in drmmode_set_mode_major()");
-		ret = FALSE;
-		goto cleanup;
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return NULL;
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		drmModeFreeObjectProperties(props);
+		return NULL;
 	}
 
-	for (i = 0; i < xf86_config->num_output; i++) {
-		xf86OutputPtr output = xf86_config->output[i];
-		struct drmmode_output_priv *drmmode_output;
+	t->fd = fd;
+	t->obj_id = obj_id;
+	drmmode_prop_table_add(t, props->props, props->count_props);
 
-		if (output->crtc != crtc)
-			continue;
+	t->next = drmmode_prop_tables;
+	drmmode_prop_tables = t;
 
-		drmmode_output = output->driver_private;
-		output_ids[output_count] =
-				drmmode_output->connector->connector_id;
-		output_count++;
-	}
+	if (values)
+		*values = props;
+	else
+		drmModeFreeObjectProperties(props);
 
-	if (!xf86CrtcRotate(crtc)) {
-		ERROR_MSG(
-				"failed to assign rotation in drmmode_set_mode_major()");
-		ret = FALSE;
-		goto cleanup;
+	return t;
+}
+
+static void
+drmmode_prop_table_free(struct drmmode_prop_table *t)
+{
+	struct drmmode_prop_table **link;
+	int i;
+
+	if (!t)
+		return;
+
+	for (link = &drmmode_prop_tables; *link; link = &(*link)->next) {
+		if (*link == t) {
+			*link = t->next;
+			break;
+		}
 	}
 
-	if (crtc->funcs->gamma_set)
-		crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
-				       crtc->gamma_blue, crtc->gamma_size);
+	for (i = 0; i < t->count; i++)
+		drmModeFreeProperty(t->props[i]);
 
-	drmmode_ConvertToKMode(crtc->scrn, &kmode, mode);
+	free(t->props);
+	free(t->by_name);
+	free(t->by_id);
+	free(t);
+}
 
-	err = drmModeSetCrtc(drmmode->fd, drmmode_crtc->crtc_id,
-			fb_id, x, y, output_ids, output_count, &kmode);
+/*
+ * Find the value of prop among the count property ids and values of an
+ * object, as drmModeGetConnector() or drmModeObjectGetProperties() return
+ * them.
+ */
+static Bool
+drmmode_prop_value(const uint32_t *ids, const uint64_t *values, int count,
+		drmModePropertyPtr prop, uint64_t *value)
+{
+	int i;
+
+	if (!prop)
+		return FALSE;
+
+	for (i = 0; i < count; i++) {
+		if (ids[i] == prop->prop_id) {
+			*value = values[i];
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/**
+ * Return the id of the property called name of the KMS object obj_id, or 0.
+ * Only the objects the driver keeps a property table for are known, which
+ * includes the HW cursor plane by the time init_plane_for_cursor is called.
+ */
+uint32_t
+drmmode_object_prop_id(int fd, uint32_t obj_id, const char *name)
+{
+	struct drmmode_prop_table *t;
+
+	for (t = drmmode_prop_tables; t; t = t->next) {
+		if (t->fd == fd && t->obj_id == obj_id)
+			return drmmode_prop_table_id(t, name);
+	}
+
+	return 0;
+}
+
+static void
+drmmode_get_underscan(struct drmmode_crtc_private_rec *drmmode_crtc,
+		int *outx, int *outy)
+{
+	struct drmmode_prop_table *t = drmmode_crtc->kms_props;
+	drmModePropertyPtr underscan = drmmode_prop_find(t, "underscan");
+	drmModeObjectPropertiesPtr crtcprops;
+	uint64_t value, x = 0, y = 0;
+	int crop = 0, e;
+
+	*outx = 0;
+	*outy = 0;
+
+	/* Most kernels have no underscan: then this costs no ioctl at all */
+	if (!underscan)
+		return;
+
+	crtcprops = drmModeObjectGetProperties(drmmode_crtc->drmmode->fd,
+			drmmode_crtc->crtc_id, DRM_MODE_OBJECT_CRTC);
+	if (!crtcprops)
+		return;
+
+	if (drmmode_prop_value(crtcprops->props, crtcprops->prop_values,
+			crtcprops->count_props, underscan, &value)) {
+		for (e = 0; e < underscan->count_enums; e++) {
+			if (underscan->enums[e].value == value &&
+			    !strcmp(underscan->enums[e].name, "crop"))
+				crop = 1;
+		}
+	}
+
+	if (crop) {
+		drmmode_prop_value(crtcprops->props, crtcprops->prop_values,
+				crtcprops->count_props,
+				drmmode_prop_find(t, "underscan hborder"), &x);
+		drmmode_prop_value(crtcprops->props, crtcprops->prop_values,
+				crtcprops->count_props,
+				drmmode_prop_find(t, "underscan vborder"), &y);
+		*outx = x;
+		*outy = y;
+	}
+
+	drmModeFreeObjectProperties(crtcprops);
+}
+
+static struct drmmode_rec *
+drmmode_from_scrn(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc;
+
+	drmmode_crtc = xf86_config->crtc[0]->driver_private;
+	return drmmode_crtc->drmmode;
+}
+
+static unsigned int
+drmmode_crtc_vblank_pipe(int pipe)
+{
+	if (pipe > 1)
+		return (pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+				DRM_VBLANK_HIGH_CRTC_MASK;
+	else if (pipe > 0)
+		return DRM_VBLANK_SECONDARY;
+	else
+		return 0;
+}
+
+/* Whether crtc is enabled and its pipe wasn't turned off by DPMS */
+static Bool
+drmmode_crtc_on(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+
+	return crtc->enabled && drmmode_crtc->dpms_mode == DPMSModeOn;
+}
+
+/* Read the kernel's frame counter of crtc, and the time of its last frame */
+static Bool
+drmmode_crtc_vblank(xf86CrtcPtr crtc, uint64_t *ust, uint64_t *seq)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	drmVBlank vbl;
+
+	vbl.request.type = DRM_VBLANK_RELATIVE |
+			drmmode_crtc_vblank_pipe(drmmode_crtc->pipe);
+	vbl.request.sequence = 0;
+	vbl.request.signal = 0;
+	if (drmWaitVBlank(drmmode_crtc->drmmode->fd, &vbl))
+		return FALSE;
+
+	*ust = (uint64_t)vbl.reply.tval_sec * 1000000 + vbl.reply.tval_usec;
+	*seq = vbl.reply.sequence;
+	return TRUE;
+}
+
+/*
+ * Frame counter of crtc, and the time of its last frame in microseconds.
+ * While the CRTC is off the kernel's counter stands still, so frames of
+ * its mode are counted from the last one it showed instead; once it is
+ * back on, the kernel's counter is offset to carry on from there.
+ */
+static Bool
+drmmode_crtc_msc(xf86CrtcPtr crtc, uint64_t *ust, uint64_t *msc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	uint64_t period, now, frames;
+
+	if (drmmode_crtc_on(crtc)) {
+		if (!drmmode_crtc_vblank(crtc, ust, msc))
+			return FALSE;
+
+		*msc += drmmode_crtc->msc_offset;
+		return TRUE;
+	}
+
+	period = drmmode_frame_period_ns(crtc->scrn, crtc) / 1000;
+
+	now = armsoc_monotonic_ns() / 1000;
+	frames = now > drmmode_crtc->blank_ust ?
+			(now - drmmode_crtc->blank_ust) / period : 0;
+
+	*ust = drmmode_crtc->blank_ust + frames * period;
+	*msc = drmmode_crtc->blank_msc + frames;
+	return TRUE;
+}
+
+/* Whether plane is the primary plane of one of our CRTCs */
+static Bool
+drmmode_plane_is_primary(ScrnInfoPtr pScrn, uint32_t plane_id)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
+
+		if (drmmode_crtc->primary_plane_id == plane_id)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Return our CRTC with the kernel id crtc_id, or NULL */
+static struct drmmode_crtc_private_rec *
+drmmode_crtc_from_id(ScrnInfoPtr pScrn, uint32_t crtc_id)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
+
+		if (drmmode_crtc->crtc_id == crtc_id)
+			return drmmode_crtc;
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_DRM_ATOMIC
+/*
+ * Atomic commits
+ */
+
+static Bool
+drmmode_plane_props_init(const struct drmmode_prop_table *t,
+		struct drmmode_plane_props *props)
+{
+	props->fb_id = drmmode_prop_table_id(t, "FB_ID");
+	props->crtc_id = drmmode_prop_table_id(t, "CRTC_ID");
+	props->src_x = drmmode_prop_table_id(t, "SRC_X");
+	props->src_y = drmmode_prop_table_id(t, "SRC_Y");
+	props->src_w = drmmode_prop_table_id(t, "SRC_W");
+	props->src_h = drmmode_prop_table_id(t, "SRC_H");
+	props->crtc_x = drmmode_prop_table_id(t, "CRTC_X");
+	props->crtc_y = drmmode_prop_table_id(t, "CRTC_Y");
+	props->crtc_w = drmmode_prop_table_id(t, "CRTC_W");
+	props->crtc_h = drmmode_prop_table_id(t, "CRTC_H");
+
+	if (props->fb_id && props->crtc_id &&
+	    props->src_x && props->src_y && props->src_w && props->src_h &&
+	    props->crtc_x && props->crtc_y && props->crtc_w && props->crtc_h)
+		return TRUE;
+
+	memset(props, 0, sizeof(*props));
+	return FALSE;
+}
+
+/**
+ * Add showing the src_w x src_h area of fb_id at (src_x, src_y) on the
+ * w x h area of plane at (crtc_x, crtc_y) of crtc_id to req. A fb_id of 0
+ * turns the plane off. Returns 0, or -1 with req left as it was.
+ */
+static int
+drmmode_atomic_add_plane(drmModeAtomicReqPtr req, uint32_t plane,
+		const struct drmmode_plane_props *props, uint32_t crtc_id,
+		uint32_t fb_id, int crtc_x, int crtc_y, int w, int h,
+		int src_x, int src_y, int src_w, int src_h)
+{
+	int cursor = drmModeAtomicGetCursor(req);
+
+	if (!fb_id) {
+		crtc_id = crtc_x = crtc_y = w = h = 0;
+		src_x = src_y = src_w = src_h = 0;
+	}
+
+	/* note src coords are in Q16 format */
+	if (drmModeAtomicAddProperty(req, plane, props->fb_id, fb_id) < 0 ||
+	    drmModeAtomicAddProperty(req, plane, props->crtc_id, crtc_id) < 0 ||
+	    drmModeAtomicAddProperty(req, plane, props->src_x,
+			(uint64_t)src_x << 16) < 0 ||
+	    drmModeAtomicAddProperty(req, plane, props->src_y,
+			(uint64_t)src_y << 16) < 0 ||
+	    drmModeAtomicAddProperty(req, plane, props->src_w,
+			(uint64_t)src_w << 16) < 0 ||
+	    drmModeAtomicAddProperty(req, plane, props->src_h,
+			(uint64_t)src_h << 16) < 0 ||
+	    drmModeAtomicAddProperty(req, plane, props->crtc_x,
+			(int64_t)crtc_x) < 0 ||
+	    drmModeAtomicAddProperty(req, plane, props->crtc_y,
+			(int64_t)crtc_y) < 0 ||
+	    drmModeAtomicAddProperty(req, plane, props->crtc_w, w) < 0 ||
+	    drmModeAtomicAddProperty(req, plane, props->crtc_h, h) < 0) {
+		drmModeAtomicSetCursor(req, cursor);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Return the request collecting plane updates until the next commit */
+static drmModeAtomicReqPtr
+drmmode_atomic_pending(struct drmmode_rec *drmmode)
+{
+	if (!drmmode->pending)
+		drmmode->pending = drmModeAtomicAlloc();
+
+	return drmmode->pending;
+}
+
+/* The CRTC the kernel routes the connector to, or 0 */
+static uint32_t
+drmmode_connector_crtc(struct drmmode_rec *drmmode,
+		struct drmmode_output_priv *drmmode_output)
+{
+	drmModeObjectPropertiesPtr props;
+	uint32_t crtc_id = 0;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(drmmode->fd,
+			drmmode_output->connector->connector_id,
+			DRM_MODE_OBJECT_CONNECTOR);
+	if (!props)
+		return 0;
+
+	for (i = 0; i < props->count_props; i++) {
+		if (props->props[i] == drmmode_output->crtc_id_prop)
+			crtc_id = props->prop_values[i];
+	}
+
+	drmModeFreeObjectProperties(props);
+	return crtc_id;
+}
+
+/*
+ * Set crtc to kmode, scanning out fb_id from (x, y), in one commit. The
+ * configuration is checked with a TEST_ONLY commit first, so a mode the
+ * kernel refuses never reaches the hardware. With sync, the commit only
+ * returns once the new fb is on the screen. Returns 0 or -errno.
+ */
+static int
+drmmode_atomic_set_mode(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y,
+		drmModeModeInfo *kmode, Bool sync)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	const uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	drmModeAtomicReqPtr req;
+	uint32_t blob_id;
+	int src_w = kmode->hdisplay, src_h = kmode->vdisplay;
+	int ret = 0;
+	int i;
+
+	/* a plane rotated by 90 or 270 degrees reads the fb the other way,
+	 * and a scaling one reads an area of another size
+	 */
+	if (drmmode_crtc->hw_rotation & (RR_Rotate_90 | RR_Rotate_270)) {
+		src_w = kmode->vdisplay;
+		src_h = kmode->hdisplay;
+	} else if (drmmode_crtc->scale_w) {
+		src_w = drmmode_crtc->scale_w;
+		src_h = drmmode_crtc->scale_h;
+	}
+
+	if (drmModeCreatePropertyBlob(drmmode->fd, kmode, sizeof(*kmode),
+			&blob_id))
+		return -errno;
+
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		drmModeDestroyPropertyBlob(drmmode->fd, blob_id);
+		return -ENOMEM;
+	}
+
+	if (drmModeAtomicAddProperty(req, drmmode_crtc->crtc_id,
+			drmmode_crtc->mode_id_prop, blob_id) < 0 ||
+	    drmModeAtomicAddProperty(req, drmmode_crtc->crtc_id,
+			drmmode_crtc->active_prop, 1) < 0 ||
+	    drmmode_atomic_add_plane(req, drmmode_crtc->primary_plane_id,
+			&drmmode_crtc->primary, drmmode_crtc->crtc_id, fb_id,
+			0, 0, kmode->hdisplay, kmode->vdisplay,
+			x, y, src_w, src_h) ||
+	    (drmmode_crtc->rotation_prop &&
+	     drmModeAtomicAddProperty(req, drmmode_crtc->rotation_obj,
+			drmmode_crtc->rotation_prop,
+			drmmode_crtc->hw_rotation) < 0))
+		ret = -ENOMEM;
+
+	/* Connectors taken off the CRTC have to be detached from it, which
+	 * drmModeSetCrtc() does implicitly
+	 */
+	for (i = 0; i < xf86_config->num_output && !ret; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		struct drmmode_output_priv *drmmode_output =
+				output->driver_private;
+		uint32_t crtc_id = drmmode_crtc->crtc_id;
+
+		if (output->crtc != crtc) {
+			if (drmmode_connector_crtc(drmmode, drmmode_output) !=
+					crtc_id)
+				continue;
+			crtc_id = 0;
+		}
+
+		if (drmModeAtomicAddProperty(req,
+				drmmode_output->connector->connector_id,
+				drmmode_output->crtc_id_prop, crtc_id) < 0)
+			ret = -ENOMEM;
+	}
+
+	if (!ret && drmModeAtomicCommit(drmmode->fd, req,
+			flags | DRM_MODE_ATOMIC_TEST_ONLY, NULL))
+		ret = -errno;
+
+	/* Unless asked to, don't wait for the new mode to reach the screen,
+	 * but do if a commit still in flight makes the kernel refuse to
+	 * queue this one.
+	 */
+	if (!ret && (sync || drmModeAtomicCommit(drmmode->fd, req,
+			flags | DRM_MODE_ATOMIC_NONBLOCK, NULL)) &&
+	    ((!sync && errno != EBUSY) ||
+	     drmModeAtomicCommit(drmmode->fd, req, flags, NULL)))
+		ret = -errno;
+
+	drmModeAtomicFree(req);
+
+	if (ret) {
+		drmModeDestroyPropertyBlob(drmmode->fd, blob_id);
+		return ret;
+	}
+
+	if (drmmode_crtc->mode_blob)
+		drmModeDestroyPropertyBlob(drmmode->fd, drmmode_crtc->mode_blob);
+	drmmode_crtc->mode_blob = blob_id;
+
+	return 0;
+}
+#endif
+
+static void
+drmmode_ConvertFromKMode(ScrnInfoPtr pScrn, drmModeModeInfo *kmode,
+		DisplayModePtr	mode, int xu, int yu)
+{
+	memset(mode, 0, sizeof(DisplayModeRec));
+	mode->status = MODE_OK;
+
+	mode->Clock = kmode->clock;
+
+	mode->HDisplay = kmode->hdisplay - 2*xu;
+	mode->HSyncStart = kmode->hsync_start;
+	mode->HSyncEnd = kmode->hsync_end;
+	mode->HTotal = kmode->htotal;
+	mode->HSkew = kmode->hskew;
+
+	mode->VDisplay = kmode->vdisplay - 2*yu;
+	mode->VSyncStart = kmode->vsync_start;
+	mode->VSyncEnd = kmode->vsync_end;
+	mode->VTotal = kmode->vtotal;
+	mode->VScan = kmode->vscan;
+
+	mode->Flags = kmode->flags;
+	mode->name = strdup(kmode->name);
+
+	DEBUG_MSG("copy mode %s (%p %p)", kmode->name, mode->name, mode);
+
+	if (kmode->type & DRM_MODE_TYPE_DRIVER)
+		mode->type = M_T_DRIVER;
+
+	if (kmode->type & DRM_MODE_TYPE_PREFERRED)
+		mode->type |= M_T_PREFERRED;
+
+	xf86SetModeCrtc(mode, pScrn->adjustFlags);
+	/* We need to store the underscan values...
+	 * the exynose drm module doesn't touch HSkew
+	 * so we steal it for this. */
+	mode->HSkew = (xu << 8) + yu;
+}
+
+static void
+drmmode_ConvertToKMode(ScrnInfoPtr pScrn, drmModeModeInfo *kmode,
+		DisplayModePtr mode)
+{
+	int xu, yu;
+
+	xu = mode->HSkew >> 8;
+	yu = mode->HSkew & 0xFF;
+
+	memset(kmode, 0, sizeof(*kmode));
+	kmode->clock = mode->Clock;
+	kmode->hdisplay = mode->HDisplay + 2*xu;
+	kmode->hsync_start = mode->HSyncStart;
+	kmode->hsync_end = mode->HSyncEnd;
+	kmode->htotal = mode->HTotal;
+	kmode->hskew = mode->HSkew;
+
+	kmode->vdisplay = mode->VDisplay + 2*yu;
+	kmode->vsync_start = mode->VSyncStart;
+	kmode->vsync_end = mode->VSyncEnd;
+	kmode->vtotal = mode->VTotal;
+	kmode->vscan = mode->VScan;
+
+	kmode->flags = mode->Flags;
+	if (mode->name)
+		strncpy(kmode->name, mode->name, DRM_DISPLAY_MODE_LEN);
+	kmode->name[DRM_DISPLAY_MODE_LEN-1] = 0;
+}
+
+/* Revert mode is odd with underscan properties present.
+ * We must use the current properties instead of the one
+ * saved with the mode.  We also need to change the mode
+ * so it saves the current property values, so it's not
+ * quite a real revert.
+ *
+ * this is all rather  untested because I don't know how to
+ * cause a revert to occur on demand.
+ * if this proves problematic, the next best solution might
+ * be to set the properties based on the underscan values
+ * encoded in the mode, but this could confusing to the UI.
+ */
+static int
+drmmode_revert_mode(xf86CrtcPtr crtc, uint32_t *output_ids, int output_count)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	uint32_t fb_id;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	drmModeModeInfo kmode;
+	uint32_t old_fb_id;
+	int xu, yu;
+
+	drmmode_get_underscan(drmmode_crtc, &xu, &yu);
+
+	if (!drmmode_crtc->last_good_mode) {
+		DEBUG_MSG("No last good values to use");
+		return FALSE;
+	}
+
+	/* The root can't be scanned out to fall back on */
+	if (pARMSOC->perCrtcScanout) {
+		DEBUG_MSG("No root framebuffer to revert to");
+		return FALSE;
+	}
+
+	/* revert to last good settings */
+	DEBUG_MSG("Reverting to last_good values");
+	if (!resize_scanout_bo(pScrn,
+			drmmode_crtc->last_good_mode->HDisplay,
+			drmmode_crtc->last_good_mode->VDisplay, &old_fb_id)) {
+		ERROR_MSG("Could not revert to last good mode");
+		return FALSE;
+	}
+
+	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+	drmmode_ConvertToKMode(crtc->scrn, &kmode,
+			drmmode_crtc->last_good_mode);
+	drmModeSetCrtc(drmmode_crtc->drmmode->fd,
+			drmmode_crtc->crtc_id,
+			fb_id,
+			drmmode_crtc->last_good_x,
+			drmmode_crtc->last_good_y,
+			output_ids, output_count, &kmode);
+	if (old_fb_id)
+		drmModeRmFB(drmmode_crtc->drmmode->fd, old_fb_id);
+	drmmode_crtc->underscan_x = xu;
+	drmmode_crtc->underscan_y = yu;
+
+	/* update the underscan params so the mouse doesn't
+	 * get confused. */
+	drmmode_crtc->last_good_mode->HSkew = (xu << 8) + yu;
+	/* let RandR know we changed things */
+	xf86RandR12TellChanged(pScrn->pScreen);
+
+	return TRUE;
+}
+
+/* Fill output_ids with the connectors driven by crtc, returning how many */
+static int
+drmmode_crtc_output_ids(xf86CrtcPtr crtc, uint32_t *output_ids)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	int output_count = 0;
+	int i;
+
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		struct drmmode_output_priv *drmmode_output;
+
+		if (output->crtc != crtc)
+			continue;
+
+		drmmode_output = output->driver_private;
+		output_ids[output_count] =
+				drmmode_output->connector->connector_id;
+		output_count++;
+	}
+
+	return output_count;
+}
+
+/*
+ * Rotate the scanout of crtc through the "rotation" property of the KMS
+ * object obj_id, if it has one. The kernel's rotate-0 ... reflect-y bits
+ * are those of RandR's RR_Rotate_0 ... RR_Reflect_Y.
+ */
+static void
+drmmode_crtc_init_rotation(struct drmmode_crtc_private_rec *drmmode_crtc,
+		const struct drmmode_prop_table *t, uint32_t obj_id,
+		uint32_t obj_type)
+{
+	drmModePropertyPtr prop = drmmode_prop_find(t, "rotation");
+	Rotation rotations = 0;
+	int i;
+
+	if (!prop || !(prop->flags & DRM_MODE_PROP_BITMASK))
+		return;
+
+	for (i = 0; i < prop->count_enums; i++) {
+		if (prop->enums[i].value < 6)
+			rotations |= 1 << prop->enums[i].value;
+	}
+
+	if (!(rotations & RR_Rotate_0))
+		return;
+
+	drmmode_crtc->rotation_obj = obj_id;
+	drmmode_crtc->rotation_obj_type = obj_type;
+	drmmode_crtc->rotation_prop = prop->prop_id;
+	drmmode_crtc->hw_rotations = rotations;
+	drmmode_crtc->hw_rotation = RR_Rotate_0;
+}
+
+#if XF86_CRTC_VERSION >= 7
+/*
+ * If the RandR transform of crtc only scales, as set by xrandr's
+ * --scale-from, get the size of the root area it shows in w and h.
+ */
+static Bool
+drmmode_crtc_scale_size(xf86CrtcPtr crtc, int *w, int *h)
+{
+	const struct pict_f_transform *t = &crtc->transform.f_transform;
+
+	if (t->m[0][1] != 0 || t->m[0][2] != 0 ||
+	    t->m[1][0] != 0 || t->m[1][2] != 0 ||
+	    t->m[2][0] != 0 || t->m[2][1] != 0 || t->m[2][2] != 1 ||
+	    t->m[0][0] <= 0 || t->m[1][1] <= 0)
+		return FALSE;
+
+	*w = (int)(crtc->mode.HDisplay * t->m[0][0] + 0.5);
+	*h = (int)(crtc->mode.VDisplay * t->m[1][1] + 0.5);
+
+	return *w > 0 && *h > 0;
+}
+#endif
+
+/*
+ * Have KMS rotate the scanout of crtc when it supports crtc->rotation, so
+ * that xf86CrtcRotate() needs neither a shadow buffer nor rotating every
+ * frame into it on the CPU. Otherwise plain 90, 180 and 270 degree
+ * rotations of a 32bpp screen are drawn into a shadow of the driver's own
+ * by drmmode_redisplay(). A transform that only scales is done by
+ * the primary plane, which an atomic mode set gives source and destination
+ * rectangles of different sizes. The X server's generic shadow is left for
+ * reflections and other transforms.
+ */
+static void
+drmmode_crtc_select_transform(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	Bool hw = FALSE, sw = FALSE, scale = FALSE;
+	int scale_w = 0, scale_h = 0;
+
+#if XF86_CRTC_VERSION >= 7
+	hw = crtc->rotation != RR_Rotate_0 && !crtc->transformPresent &&
+	     !(crtc->rotation & ~drmmode_crtc->hw_rotations);
+	sw = !hw && !crtc->transformPresent &&
+	     crtc->scrn->bitsPerPixel == 32 &&
+	     (crtc->rotation == RR_Rotate_90 ||
+	      crtc->rotation == RR_Rotate_180 ||
+	      crtc->rotation == RR_Rotate_270);
+	scale = crtc->transformPresent && crtc->rotation == RR_Rotate_0 &&
+		drmmode_crtc->drmmode->atomic &&
+		drmmode_crtc_scale_size(crtc, &scale_w, &scale_h);
+
+	/* the X server still transforms the cursor, which has a plane of
+	 * its own
+	 */
+	crtc->driverIsPerformingTransform = hw || sw || scale ?
+			XF86DriverTransformOutput : XF86DriverTransformNone;
+#endif
+
+	drmmode_crtc->hw_rotation = hw ? crtc->rotation : RR_Rotate_0;
+	drmmode_crtc->sw_rotation = sw ? crtc->rotation : RR_Rotate_0;
+	drmmode_crtc->scale_w = scale ? scale_w : 0;
+	drmmode_crtc->scale_h = scale ? scale_h : 0;
+}
+
+static void
+drmmode_crtc_copy_free(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+
+	if (!drmmode_crtc->copy_bo)
+		return;
+
+	armsoc_bo_rm_fb(drmmode_crtc->copy_bo);
+	armsoc_bo_unreference(drmmode_crtc->copy_bo);
+	armsoc_bo_unreference(drmmode_crtc->copy_src);
+	drmmode_crtc->copy_bo = NULL;
+	drmmode_crtc->copy_src = NULL;
+}
+
+/*
+ * Give a CRTC which scans out a copy of its viewport, rotated or not, a
+ * buffer the size its scanout reads, and free that of one which no longer
+ * does.
+ */
+static Bool
+drmmode_crtc_copy_alloc(xf86CrtcPtr crtc)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct armsoc_bo *bo = drmmode_crtc->copy_bo;
+	int width = crtc->mode.HDisplay, height = crtc->mode.VDisplay;
+
+	if (!drmmode_crtc->sw_rotation && !pARMSOC->perCrtcScanout) {
+		drmmode_crtc_copy_free(crtc);
+		return TRUE;
+	}
+
+	/* The plane reads the copy as it would read the root: sideways if
+	 * it rotates by 90 or 270 degrees, at another size if it scales.
+	 */
+	if (drmmode_crtc->scale_w) {
+		width = drmmode_crtc->scale_w;
+		height = drmmode_crtc->scale_h;
+	} else if (drmmode_crtc->hw_rotation & (RR_Rotate_90 | RR_Rotate_270)) {
+		width = crtc->mode.VDisplay;
+		height = crtc->mode.HDisplay;
+	}
+
+	if (bo && armsoc_bo_width(bo) == width &&
+	    armsoc_bo_height(bo) == height)
+		return TRUE;
+
+	/* The old copy stays on screen until the mode set */
+	bo = armsoc_bo_new_with_dim(pARMSOC->dev, width, height,
+			pScrn->bitsPerPixel, pScrn->bitsPerPixel,
+			ARMSOC_BO_SCANOUT);
+	if (!bo) {
+		ERROR_MSG("Couldn't allocate scanout memory for CRTC %d",
+				drmmode_crtc->pipe);
+		return FALSE;
+	}
+
+	if (armsoc_bo_add_fb(bo)) {
+		ERROR_MSG("Error adding FB for the scanout of CRTC %d",
+				drmmode_crtc->pipe);
+		armsoc_bo_unreference(bo);
+		return FALSE;
+	}
+
+	drmmode_crtc_copy_free(crtc);
+	drmmode_crtc->copy_bo = bo;
+	return TRUE;
+}
+
+/*
+ * Copy, or rotate, the part of the root under the viewport of crtc that
+ * damage covers into the buffer it scans out, or all of it if damage is
+ * NULL or the root buffer changed since the last time.
+ */
+static void
+drmmode_crtc_redisplay(xf86CrtcPtr crtc, RegionPtr damage)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct armsoc_bo *src = pARMSOC->scanout;
+	struct armsoc_bo *dst = drmmode_crtc->copy_bo;
+	int dst_w = armsoc_bo_width(dst), dst_h = armsoc_bo_height(dst);
+	int bpp = armsoc_bo_bpp(dst);
+	int degrees, i;
+	uint8_t *src_map, *dst_map;
+	RegionRec region;
+	BoxRec viewport;
+	BoxPtr box;
+
+	switch (drmmode_crtc->sw_rotation) {
+	case RR_Rotate_90:
+		degrees = 90;
+		break;
+	case RR_Rotate_180:
+		degrees = 180;
+		break;
+	case RR_Rotate_270:
+		degrees = 270;
+		break;
+	default:
+		degrees = 0;
+		break;
+	}
+
+	/* The viewport lies sideways in the root at 90 and 270 degrees, and
+	 * may stick out of it while the root is being resized.
+	 */
+	viewport.x1 = crtc->x;
+	viewport.y1 = crtc->y;
+	viewport.x2 = crtc->x + (degrees % 180 ? dst_h : dst_w);
+	viewport.y2 = crtc->y + (degrees % 180 ? dst_w : dst_h);
+	if (viewport.x2 > (int)armsoc_bo_width(src) ||
+	    viewport.y2 > (int)armsoc_bo_height(src))
+		return;
+
+	src_map = armsoc_bo_map(src);
+	dst_map = armsoc_bo_map(dst);
+	if (!src_map || !dst_map) {
+		ERROR_MSG("Couldn't map buffers to redraw CRTC %d",
+				drmmode_crtc->pipe);
+		return;
+	}
+
+	RegionInit(&region, &viewport, 1);
+	if (damage && src == drmmode_crtc->copy_src)
+		RegionIntersect(&region, &region, damage);
+
+	if (RegionNotEmpty(&region)) {
+		box = RegionRects(&region);
+		for (i = 0; i < RegionNumRects(&region); i++, box++)
+			drmmode_crtc->drmmode->redisplay_pixels +=
+					(uint64_t)(box->x2 - box->x1) *
+					(box->y2 - box->y1);
+
+		RegionTranslate(&region, -crtc->x, -crtc->y);
+		if (degrees) {
+			armsoc_rotate_boxes(drmmode_crtc->drmmode->rotate_pool,
+					degrees, dst_map, armsoc_bo_pitch(dst),
+					dst_w, dst_h,
+					src_map + crtc->y * armsoc_bo_pitch(src) +
+					crtc->x * 4, armsoc_bo_pitch(src),
+					RegionRects(&region),
+					RegionNumRects(&region));
+		} else {
+			box = RegionRects(&region);
+			for (i = 0; i < RegionNumRects(&region); i++, box++)
+				pixman_blt((uint32_t *)src_map,
+					(uint32_t *)dst_map,
+					armsoc_bo_pitch(src) / sizeof(uint32_t),
+					armsoc_bo_pitch(dst) / sizeof(uint32_t),
+					bpp, bpp,
+					crtc->x + box->x1, crtc->y + box->y1,
+					box->x1, box->y1,
+					box->x2 - box->x1, box->y2 - box->y1);
+		}
+	}
+	RegionUninit(&region);
+
+	if (src != drmmode_crtc->copy_src) {
+		armsoc_bo_reference(src);
+		armsoc_bo_unreference(drmmode_crtc->copy_src);
+		drmmode_crtc->copy_src = src;
+	}
+}
+
+/*
+ * Set crtc to kmode on output_ids, scanning out fb_id from (x, y). With
+ * sync, fb_id is on the screen on return; drmModeSetCrtc() always waits.
+ */
+static int
+drmmode_crtc_commit_mode(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y,
+		uint32_t *output_ids, int output_count, drmModeModeInfo *kmode,
+		Bool sync)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+
+#ifdef HAVE_DRM_ATOMIC
+	if (drmmode->atomic)
+		return drmmode_atomic_set_mode(crtc, fb_id, x, y, kmode, sync);
+#endif
+
+	if (drmmode_crtc->hw_rotations &&
+	    drmModeObjectSetProperty(drmmode->fd, drmmode_crtc->rotation_obj,
+			drmmode_crtc->rotation_obj_type,
+			drmmode_crtc->rotation_prop,
+			drmmode_crtc->hw_rotation))
+		return -errno;
+
+	return drmModeSetCrtc(drmmode->fd, drmmode_crtc->crtc_id,
+			fb_id, x, y, output_ids, output_count, kmode);
+}
+
+static Bool
+drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
+		Rotation rotation, int x, int y)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	uint32_t *output_ids = NULL;
+	int output_count = 0;
+	int ret = TRUE;
+	int err;
+	int i;
+	uint32_t fb_id;
+	drmModeModeInfo kmode;
+	drmModeCrtcPtr newcrtc = NULL;
+	int xu, yu;
+	int scan_x = x, scan_y = y;
+
+	TRACE_ENTER();
+
+	/* The mode set puts the CRTC back on the root scanout buffer */
+	drmmode_crtc_release_scanout(crtc);
+
+	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+
+	/* With PerCrtcScanout, the root is never scanned out */
+	if (fb_id == 0 && !pARMSOC->perCrtcScanout) {
+		DEBUG_MSG("create framebuffer: %dx%d",
+				pScrn->virtualX, pScrn->virtualY);
+
+		err = armsoc_bo_add_fb(pARMSOC->scanout);
+		if (err) {
+			ERROR_MSG(
+					"Failed to add framebuffer to the scanout buffer");
+			return FALSE;
+		}
+
+		fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+		if (0 == fb_id)
+			return FALSE;
+	}
+
+	/* Set the new mode: */
+	crtc->mode = *mode;
+	crtc->x = x;
+	crtc->y = y;
+	crtc->rotation = rotation;
+
+	output_ids = calloc(xf86_config->num_output, sizeof(uint32_t));
+	if (!output_ids) {
+		ERROR_MSG(
+				"memory allocation failed in drmmode_set_mode_major()");
+		ret = FALSE;
+		goto cleanup;
+	}
+
+	output_count = drmmode_crtc_output_ids(crtc, output_ids);
+
+	drmmode_crtc_select_transform(crtc);
+	if (!xf86CrtcRotate(crtc)) {
+		ERROR_MSG(
+				"failed to assign rotation in drmmode_set_mode_major()");
+		ret = FALSE;
+		goto cleanup;
+	}
+
+	/* The X server's shadow can't be copied to a CRTC's own scanout */
+	if (pARMSOC->perCrtcScanout && drmmode_crtc->rotate_bo) {
+		ERROR_MSG("CRTC %d can't scan out this transform with PerCrtcScanout",
+				drmmode_crtc->pipe);
+		ret = FALSE;
+		goto cleanup;
+	}
+
+	if (!drmmode_crtc_copy_alloc(crtc)) {
+		ret = FALSE;
+		goto cleanup;
+	}
+
+	/* A CRTC scanning out a copy of its viewport gets it drawn whole */
+	if (drmmode_crtc->copy_bo) {
+		drmmode_crtc_redisplay(crtc, NULL);
+		fb_id = armsoc_bo_get_fb(drmmode_crtc->copy_bo);
+		scan_x = scan_y = 0;
+	}
+
+	if (crtc->funcs->gamma_set)
+		crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
+				       crtc->gamma_blue, crtc->gamma_size);
+
+	drmmode_ConvertToKMode(crtc->scrn, &kmode, mode);
+
+	err = drmmode_crtc_commit_mode(crtc, fb_id, scan_x, scan_y,
+			output_ids, output_count, &kmode, FALSE);
 	if (err) {
 		ERROR_MSG(
 				"drm failed to set mode: %s", strerror(-err));
+		if (drmmode_crtc->scale_w)
+			ERROR_MSG("CRTC %d may not scale %dx%d to %dx%d",
+					drmmode_crtc->pipe,
+					drmmode_crtc->scale_w,
+					drmmode_crtc->scale_h,
+					mode->HDisplay, mode->VDisplay);
+
+		ret = FALSE;
+		/* An atomic mode set the kernel refused was only tested, and
+		 * left the hardware alone: there is nothing to revert.
+		 */
+		if (drmmode->atomic ||
+		    !drmmode_revert_mode(crtc, output_ids, output_count))
+			goto cleanup;
+		else
+			goto done_setting;
+	}
+
+	/* get the actual crtc info */
+	newcrtc = drmModeGetCrtc(drmmode->fd, drmmode_crtc->crtc_id);
+	if (!newcrtc) {
+		ERROR_MSG("couldn't get actual mode back");
+
+		ret = FALSE;
+		if (!drmmode_revert_mode(crtc, output_ids, output_count))
+			goto cleanup;
+		else
+			goto done_setting;
+	}
+
+	if (kmode.hdisplay != newcrtc->mode.hdisplay ||
+		kmode.vdisplay != newcrtc->mode.vdisplay) {
+
+		ERROR_MSG(
+			"drm did not set requested mode! (requested %dx%d, actual %dx%d)",
+			kmode.hdisplay, kmode.vdisplay,
+			newcrtc->mode.hdisplay,
+			newcrtc->mode.vdisplay);
+
+		ret = FALSE;
+		if (!drmmode_revert_mode(crtc, output_ids, output_count))
+			goto cleanup;
+		else
+			goto done_setting;
+	}
+
+	drmmode_get_underscan(drmmode_crtc, &xu, &yu);
+	drmmode_crtc->underscan_x = xu;
+	drmmode_crtc->underscan_y = yu;
+
+	/* When called on a resize, crtc->mode already contains the
+	 * resized values so we can't use this for recovery.
+	 * We can't read it out of the crtc either as mode_valid is 0.
+	 * Instead we save the last good mode set here & fallback to
+	 * that on failure.
+	 */
+	DEBUG_MSG("Saving last good values");
+	drmmode_crtc->last_good_x = crtc->x;
+	drmmode_crtc->last_good_y = crtc->y;
+	drmmode_crtc->last_good_rotation = crtc->rotation;
+	if (drmmode_crtc->last_good_mode) {
+		if (drmmode_crtc->last_good_mode->name)
+			free((void *) drmmode_crtc->last_good_mode->name);
+		free(drmmode_crtc->last_good_mode);
+	}
+	drmmode_crtc->last_good_mode = xf86DuplicateMode(&crtc->mode);
+
+	ret = TRUE;
+
+done_setting:
+	/* The pipe is on again: its frame counter carries on from the
+	 * frames counted while it was off.
+	 */
+	if (drmmode_crtc->dpms_mode != DPMSModeOn) {
+		uint64_t ust, msc, seq;
+
+		drmmode_crtc_msc(crtc, &ust, &msc);
+		drmmode_crtc->dpms_mode = DPMSModeOn;
+		if (drmmode_crtc_vblank(crtc, &ust, &seq))
+			drmmode_crtc->msc_offset = msc - seq;
+	}
+
+	/* Turn on any outputs on this crtc that may have been disabled: */
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+
+		if (output->crtc != crtc)
+			continue;
+
+		drmmode_output_dpms(output, DPMSModeOn);
+	}
+
+#if !RELOAD_CURSORS_DEPRECATED
+	/* if hw cursor is initialized, reload it */
+	if (drmmode->cursor)
+		xf86_reload_cursors(pScrn->pScreen);
+#endif
+
+cleanup:
+	if (newcrtc)
+		drmModeFreeCrtc(newcrtc);
+
+	if (output_ids)
+		free(output_ids);
+
+	if (!ret && drmmode_crtc->last_good_mode) {
+		/* If there was a problem, restore the last good mode: */
+		crtc->x = drmmode_crtc->last_good_x;
+		crtc->y = drmmode_crtc->last_good_y;
+		crtc->rotation = drmmode_crtc->last_good_rotation;
+		crtc->mode = *drmmode_crtc->last_good_mode;
+		drmmode_crtc_select_transform(crtc);
+	}
+
+	TRACE_EXIT();
+	return ret;
+}
+
+/*
+ * Move the viewport of crtc to (x, y) in the root without a mode set: the
+ * primary plane of an atomic CRTC gets the new source position in the next
+ * commit, which a page flip may carry, once a TEST_ONLY commit says the
+ * kernel takes it; a legacy CRTC is set to the same mode and fb again,
+ * which the kernel does without a full mode set; and the copy of the root
+ * a CRTC scans out is just redrawn. Returns FALSE if crtc needs a mode
+ * set to move. Should the commit carrying the pan fail all the same,
+ * drmmode_atomic_flush() falls back to one.
+ */
+static Bool
+drmmode_crtc_pan(xf86CrtcPtr crtc, int x, int y)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+
+	if (!crtc->enabled || !pScrn->vtSema || !drmmode_crtc->last_good_mode ||
+	    drmmode_crtc->scanout_bo || drmmode_crtc->rotate_bo)
+		return FALSE;
+
+	/* A CRTC turned off by DPMS shows the viewport once it is set again */
+	if (drmmode_crtc->dpms_mode != DPMSModeOn) {
+		crtc->x = x;
+		crtc->y = y;
+	} else if (drmmode_crtc->copy_bo) {
+		crtc->x = x;
+		crtc->y = y;
+		drmmode_crtc_redisplay(crtc, NULL);
+	} else {
+#ifdef HAVE_DRM_ATOMIC
+		drmModeAtomicReqPtr req = drmmode->atomic ?
+				drmmode_atomic_pending(drmmode) : NULL;
+
+		if (req) {
+			int mark = drmModeAtomicGetCursor(req);
+
+			if (drmModeAtomicAddProperty(req,
+					drmmode_crtc->primary_plane_id,
+					drmmode_crtc->primary.src_x,
+					(uint64_t)x << 16) < 0 ||
+			    drmModeAtomicAddProperty(req,
+					drmmode_crtc->primary_plane_id,
+					drmmode_crtc->primary.src_y,
+					(uint64_t)y << 16) < 0 ||
+			    drmModeAtomicCommit(drmmode->fd, req,
+					DRM_MODE_ATOMIC_TEST_ONLY, NULL)) {
+				drmModeAtomicSetCursor(req, mark);
+				return FALSE;
+			}
+			drmmode_crtc->pan_pending = TRUE;
+		} else
+#endif
+		if (drmmode->atomic || drmmode_crtc_set_fb(crtc,
+				armsoc_bo_get_fb(pARMSOC->scanout), x, y, FALSE))
+			return FALSE;
+
+		crtc->x = x;
+		crtc->y = y;
+	}
+
+	drmmode_crtc->last_good_x = x;
+	drmmode_crtc->last_good_y = y;
+	return TRUE;
+}
+
+/* Pan crtc, as RandR does with xrandr's --panning */
+static void
+drmmode_set_origin(xf86CrtcPtr crtc, int x, int y)
+{
+	if (!drmmode_crtc_pan(crtc, x, y))
+		drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation, x, y);
+}
+
+/* Stop crtc scanning out, once the pending flip of the root has landed */
+static void
+drmmode_crtc_turn_off(xf86CrtcPtr crtc)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	int ret;
+
+	/* Let the pending flip of the root land on the CRTC first */
+	while (drmmode->root_flips > 0)
+		drmmode_wait_for_event(pScrn);
+
+#ifdef HAVE_DRM_ATOMIC
+	if (drmmode->atomic) {
+		drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+
+		ret = -ENOMEM;
+		if (req && drmModeAtomicAddProperty(req,
+				drmmode_crtc->crtc_id,
+				drmmode_crtc->active_prop, 0) >= 0)
+			ret = drmModeAtomicCommit(drmmode->fd, req,
+					DRM_MODE_ATOMIC_ALLOW_MODESET, NULL) ?
+					-errno : 0;
+		drmModeAtomicFree(req);
+	} else
+#endif
+	ret = drmModeSetCrtc(drmmode->fd, drmmode_crtc->crtc_id, 0, 0, 0,
+			NULL, 0, NULL);
+
+	if (ret)
+		ERROR_MSG("failed to turn CRTC %d off: %s",
+				drmmode_crtc->pipe, strerror(-ret));
+}
+
+/*
+ * Any DPMS mode but On turns the pipe of crtc off, with ACTIVE=0 or a
+ * legacy mode set without a framebuffer, so that it stops reading memory.
+ * Its frames are counted on from its mode's timings meanwhile, flips skip
+ * it, swaps waiting for its vblanks are paced on those frames and cursor
+ * updates wait. On sets the mode again, which also redraws any copy it
+ * scans out.
+ */
+static void
+drmmode_crtc_dpms(xf86CrtcPtr crtc, int mode)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+
+	if (mode == DPMSModeOn) {
+		if (drmmode_crtc->dpms_mode == DPMSModeOn || !crtc->enabled ||
+		    !pScrn->vtSema)
+			return;
+
+		drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation,
+				crtc->x, crtc->y);
+		if (drmmode_crtc->cursor_moved)
+			drmmode_show_cursor_image(crtc, FALSE);
+		return;
+	}
+
+	/* Unused CRTCs are turned off again on every configuration change */
+	if (!drmmode_crtc_msc(crtc, &drmmode_crtc->blank_ust,
+			&drmmode_crtc->blank_msc))
+		drmmode_crtc->blank_ust = armsoc_monotonic_ns() / 1000;
+	drmmode_crtc->dpms_mode = DPMSModeOff;
+
+	if (pScrn->vtSema)
+		drmmode_crtc_turn_off(crtc);
+
+	/* A disabled CRTC no longer needs the copy of its viewport */
+	if (!crtc->enabled)
+		drmmode_crtc_copy_free(crtc);
+}
+
+/*
+ * Note that the kernel took an update of a CRTC's cursor showing buffer
+ * buf, or DRMMODE_CURSOR_NONE. The buffer shown before stays on screen
+ * until that update lands, which it has once the kernel takes the next
+ * one, so the last two buffers taken are those which may be scanned out.
+ * Both threads update the cursor, hence a single word for the pair.
+ */
+static void
+drmmode_cursor_shown(struct drmmode_crtc_cursor *cursor, int buf)
+{
+	uint32_t old = __atomic_load_n(&cursor->scanout, __ATOMIC_ACQUIRE);
+	uint32_t new;
+
+	do {
+		if ((old & 0xff) == (uint32_t)buf)
+			return;
+		new = (old & 0xff) << 8 | buf;
+	} while (!__atomic_compare_exchange_n(&cursor->scanout, &old, new,
+			FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+/* Whether buffer buf of a CRTC's cursor may be scanned out */
+static Bool
+drmmode_cursor_on_screen(struct drmmode_crtc_cursor *cursor, int buf)
+{
+	uint32_t scanout = __atomic_load_n(&cursor->scanout, __ATOMIC_ACQUIRE);
+
+	return (scanout & 0xff) == (uint32_t)buf ||
+			(scanout >> 8 & 0xff) == (uint32_t)buf;
+}
+
+/* Publish the cursor position on a CRTC, see drmmode_cursor_get_pos() */
+static void
+drmmode_cursor_set_pos(struct drmmode_crtc_private_rec *drmmode_crtc,
+		int x, int y)
+{
+	__atomic_store_n(&drmmode_crtc->cursor_pos,
+			((uint64_t)(uint32_t)x << 32) | (uint32_t)y,
+			__ATOMIC_RELEASE);
+}
+
+/*
+ * Read the cursor position on a CRTC. Moves come from the X input thread
+ * when the server has one, while page flips and timers run on the main
+ * thread; both coordinates travel in a single word, so that either side
+ * sees a consistent position without taking a lock.
+ */
+static void
+drmmode_cursor_get_pos(struct drmmode_crtc_private_rec *drmmode_crtc,
+		int *x, int *y)
+{
+	uint64_t pos = __atomic_load_n(&drmmode_crtc->cursor_pos,
+			__ATOMIC_ACQUIRE);
+
+	*x = (int32_t)(uint32_t)(pos >> 32);
+	*y = (int32_t)(uint32_t)pos;
+}
+
+/*
+ * Where the cursor plane shows the padded cursor image on crtc: the w x h
+ * area at (src_x, src_y) of the image goes to (crtc_x, crtc_y), clipped to
+ * the mode.
+ */
+static void
+drmmode_cursor_plane_geometry(xf86CrtcPtr crtc, int *crtc_x, int *crtc_y,
+		int *w, int *h, int *src_x, int *src_y)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(crtc->scrn);
+	int pad = pARMSOC->drmmode_interface->cursor_padding;
+	int x, y;
+
+	drmmode_cursor_get_pos(drmmode_crtc, &x, &y);
+
+	/* get padded width */
+	*w = pARMSOC->drmmode_interface->cursor_width + 2 * pad;
+	*h = pARMSOC->drmmode_interface->cursor_height;
+	/* get x of padded cursor */
+	*crtc_x = x - pad;
+	*crtc_y = y;
+	*src_x = 0;
+	*src_y = 0;
+
+	/* calculate clipped x, y, w & h if cursor is off edges */
+	if (*crtc_x < 0) {
+		*src_x += -*crtc_x;
+		*w -= -*crtc_x;
+		*crtc_x = 0;
+	}
+
+	if (*crtc_y < 0) {
+		*src_y += -*crtc_y;
+		*h -= -*crtc_y;
+		*crtc_y = 0;
+	}
+
+	if ((*crtc_x + *w) > crtc->mode.HDisplay)
+		*w = crtc->mode.HDisplay - *crtc_x;
+
+	if ((*crtc_y + *h) > crtc->mode.VDisplay)
+		*h = crtc->mode.VDisplay - *crtc_y;
+
+	*crtc_x += drmmode_crtc->underscan_x;
+	*crtc_y += drmmode_crtc->underscan_y;
+}
+
+#ifdef HAVE_DRM_ATOMIC
+/* Put back a cursor update of crtc which couldn't be committed */
+static void
+drmmode_cursor_restage(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+
+	__atomic_store_n(&drmmode_crtc->cursor.dirty, TRUE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Add the cursor plane of crtc to req if it changed since it was last
+ * committed, returning whether it did and in buf the buffer it shows, for
+ * drmmode_cursor_shown() once the kernel takes req. Whichever thread
+ * commits it, the latest position is the one used.
+ */
+static Bool
+drmmode_cursor_stage(xf86CrtcPtr crtc, drmModeAtomicReqPtr req, int *buf)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_crtc_cursor *cursor = &drmmode_crtc->cursor;
+	int crtc_x = 0, crtc_y = 0, w = 0, h = 0, src_x = 0, src_y = 0;
+	int shown = DRMMODE_CURSOR_NONE;
+	uint32_t fb_id = 0;
+
+	if (!drmmode_crtc->drmmode->cursor || !cursor->props.fb_id)
+		return FALSE;
+
+	/* The kernel may refuse to update the planes of an inactive CRTC:
+	 * the update waits until DPMS turns it back on */
+	if (!drmmode_crtc_on(crtc))
+		return FALSE;
+
+	if (!__atomic_exchange_n(&cursor->dirty, FALSE, __ATOMIC_ACQ_REL))
+		return FALSE;
+
+	if (drmmode_crtc->cursor_visible) {
+		shown = drmmode_crtc->cursor_buf;
+		fb_id = cursor->fb_id[shown];
+		drmmode_cursor_plane_geometry(crtc, &crtc_x, &crtc_y, &w, &h,
+				&src_x, &src_y);
+	}
+
+	if (drmmode_atomic_add_plane(req, cursor->ovr->plane_id,
+			&cursor->props, drmmode_crtc->crtc_id, fb_id,
+			crtc_x, crtc_y, w, h, src_x, src_y, w, h)) {
+		drmmode_cursor_restage(crtc);
+		return FALSE;
+	}
+
+	*buf = shown;
+	return TRUE;
+}
+
+/* Note that the kernel took the cursor updates staged on the CRTCs in mask */
+static void
+drmmode_cursor_staged_shown(xf86CrtcConfigPtr config, uint32_t mask)
+{
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (mask & (1u << i))
+			drmmode_cursor_shown(&drmmode_crtc->cursor,
+					drmmode_crtc->cursor.staged);
+	}
+}
+
+/*
+ * Commit the cursor plane of crtc on its own, from whichever thread
+ * updated it, so that the pointer doesn't wait for the main thread. If the
+ * kernel refuses, typically because an earlier commit is still in flight,
+ * the next page flip or drmmode_atomic_flush() carries the update; the
+ * latter reports it if it fails again.
+ */
+static void
+drmmode_cursor_commit(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	int buf;
+
+	if (!req)
+		return;
+
+	if (drmmode_cursor_stage(crtc, req, &buf)) {
+		if (drmModeAtomicCommit(drmmode_crtc->drmmode->fd, req,
+				DRM_MODE_ATOMIC_NONBLOCK, NULL))
+			drmmode_cursor_restage(crtc);
+		else
+			drmmode_cursor_shown(&drmmode_crtc->cursor, buf);
+	}
+
+	drmModeAtomicFree(req);
+}
+#endif
+
+/*
+ * Have the cursor plane follow the cursor state of crtc through an atomic
+ * commit. Returns FALSE if it doesn't go through atomic commits.
+ */
+static Bool
+drmmode_cursor_atomic_update(xf86CrtcPtr crtc)
+{
+#ifdef HAVE_DRM_ATOMIC
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+
+	if (drmmode_crtc->cursor.props.fb_id) {
+		__atomic_store_n(&drmmode_crtc->cursor.dirty, TRUE,
+				__ATOMIC_RELEASE);
+		drmmode_cursor_commit(crtc);
+		return TRUE;
+	}
+#endif
+	return FALSE;
+}
+
+static void
+drmmode_hide_cursor(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_crtc_cursor *cursor = &drmmode_crtc->cursor;
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	/* no buffers if the CRTC has no plane for the cursor */
+	if (!drmmode->cursor || !cursor->bo[0])
+		return;
+
+	drmmode_crtc->cursor_visible = FALSE;
+	drmmode_crtc->cursor_moved = FALSE;
+	__atomic_fetch_add(&drmmode->cursor->updates, 1, __ATOMIC_RELAXED);
+
+	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE) {
+		/* set plane's fb_id to 0 to disable it */
+		if (!drmmode_cursor_atomic_update(crtc) &&
+		    !drmModeSetPlane(drmmode->fd, cursor->ovr->plane_id,
+					drmmode_crtc->crtc_id, 0, 0,
+					0, 0, 0, 0, 0, 0, 0, 0))
+			drmmode_cursor_shown(cursor, DRMMODE_CURSOR_NONE);
+	} else { /* HWCURSOR_API_STANDARD */
+		/* set handle to 0 to disable the cursor */
+		if (!drmModeSetCursor(drmmode->fd, drmmode_crtc->crtc_id,
+				 0, 0, 0))
+			drmmode_cursor_shown(cursor, DRMMODE_CURSOR_NONE);
+	}
+}
+
+/*
+ * The argument "update_image" controls whether the cursor image needs
+ * to be updated by the HW or not. This is ignored by HWCURSOR_API_PLANE
+ * which doesn't allow changing the cursor possition without updating
+ * the image too.
+ */
+static void
+drmmode_show_cursor_image(xf86CrtcPtr crtc, Bool update_image)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_crtc_cursor *cursor = &drmmode_crtc->cursor;
+	int crtc_x, crtc_y, src_x, src_y;
+	int w, h, pad;
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	if (!drmmode->cursor || !cursor->bo[0])
+		return;
+
+	drmmode_crtc->cursor_visible = TRUE;
+	drmmode_crtc->cursor_buf = cursor->front;
+	drmmode_crtc->cursor_moved = FALSE;
+	drmmode_crtc->cursor_update_ns = armsoc_monotonic_ns();
+	__atomic_fetch_add(&drmmode->cursor->updates, 1, __ATOMIC_RELAXED);
+
+	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE) {
+		if (drmmode_cursor_atomic_update(crtc))
+			return;
+
+		drmmode_cursor_plane_geometry(crtc, &crtc_x, &crtc_y, &w, &h,
+				&src_x, &src_y);
+
+		/* note src coords (last 4 args) are in Q16 format */
+		if (!drmModeSetPlane(drmmode->fd, cursor->ovr->plane_id,
+				drmmode_crtc->crtc_id,
+				cursor->fb_id[drmmode_crtc->cursor_buf], 0,
+				crtc_x, crtc_y, w, h, src_x<<16, src_y<<16,
+				w<<16, h<<16))
+			drmmode_cursor_shown(cursor, drmmode_crtc->cursor_buf);
+	} else {
+		w = pARMSOC->drmmode_interface->cursor_width;
+		h = pARMSOC->drmmode_interface->cursor_height;
+		pad = pARMSOC->drmmode_interface->cursor_padding;
+
+		/* get padded width */
+		w = w + 2 * pad;
+		/* get x of padded cursor */
+		drmmode_cursor_get_pos(drmmode_crtc, &crtc_x, &crtc_y);
+		crtc_x -= pad;
+
+		if (update_image &&
+		    !drmModeSetCursor(drmmode->fd,
+					 drmmode_crtc->crtc_id,
+					 cursor->handle[drmmode_crtc->cursor_buf],
+					 w, h))
+			drmmode_cursor_shown(cursor, drmmode_crtc->cursor_buf);
+		drmModeMoveCursor(drmmode->fd,
+				  drmmode_crtc->crtc_id,
+				  crtc_x, crtc_y);
+	}
+}
+
+static void
+drmmode_show_cursor(xf86CrtcPtr crtc)
+{
+	drmmode_show_cursor_image(crtc, TRUE);
+}
+
+/* Show the cursor where it moved to on the CRTCs its moves were held on */
+static CARD32
+drmmode_cursor_timer(OsTimerPtr timer, CARD32 time, void *arg)
+{
+	ScrnInfoPtr pScrn = arg;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	int i;
+
+	if (drmmode->cursor)
+		drmmode->cursor->timer_pending = FALSE;
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
+
+		if (drmmode_crtc->cursor_moved)
+			drmmode_show_cursor_image(crtc, FALSE);
+	}
+
+	return 0;
+}
+
+static void
+drmmode_set_cursor_position(xf86CrtcPtr crtc, int x, int y)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	uint64_t period, elapsed;
+
+	if (!cursor)
+		return;
+
+	/* This runs on the X input thread, if the server has one */
+	drmmode_cursor_set_pos(drmmode_crtc, x, y);
+	__atomic_fetch_add(&cursor->moves, 1, __ATOMIC_RELAXED);
+
+	/* A CRTC turned off by DPMS shows it there once it is back on */
+	if (drmmode_crtc->dpms_mode != DPMSModeOn) {
+		drmmode_crtc->cursor_moved = TRUE;
+		return;
+	}
+
+	/*
+	 * A fast mouse moves the pointer far more often than the display
+	 * refreshes. The first move of a burst is shown right away, later ones
+	 * at most once per frame, the latest position winning.
+	 */
+	period = drmmode_frame_period_ns(crtc->scrn, crtc);
+	elapsed = armsoc_monotonic_ns() - drmmode_crtc->cursor_update_ns;
+	if (elapsed < period) {
+		drmmode_crtc->cursor_moved = TRUE;
+		if (!cursor->timer_pending) {
+			cursor->timer = TimerSet(cursor->timer, 0,
+					(period - elapsed + 999999) / 1000000,
+					drmmode_cursor_timer, crtc->scrn);
+			cursor->timer_pending = TRUE;
+		}
+		return;
+	}
+
+	/*
+	 * Show the cursor at a different possition without updating the image
+	 * when possible (HWCURSOR_API_PLANE doesn't have a way to update
+	 * cursor position without updating the image too).
+	 */
+	drmmode_show_cursor_image(crtc, FALSE);
+}
+
+/*
+ * The cursor format is ARGB so the image can be copied straight over.
+ * Columns of CURSORPAD blank pixels are maintained down either side
+ * of the destination image. This is a workaround for a bug causing
+ * corruption when the cursor reaches the screen edges in some DRM
+ * drivers.
+ */
+static void set_cursor_image(xf86CrtcPtr crtc, uint32_t *d, CARD32 *s)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	int row;
+	void *dst;
+	const char *src_row;
+	char *dst_row;
+	uint32_t cursorh = pARMSOC->drmmode_interface->cursor_height;
+	uint32_t cursorw = pARMSOC->drmmode_interface->cursor_width;
+	uint32_t cursorpad = pARMSOC->drmmode_interface->cursor_padding;
+
+	dst = d;
+	for (row = 0; row < cursorh; row += 1) {
+		/* we're operating with ARGB data (4 bytes per pixel) */
+		src_row = (const char *)s + row * 4 * cursorw;
+		dst_row = (char *)dst + row * 4 * (cursorw + 2 * cursorpad);
+
+		/* set first CURSORPAD pixels in row to 0 */
+		memset(dst_row, 0, (4 * cursorpad));
+		/* copy cursor image pixel row across */
+		memcpy(dst_row + (4 * cursorpad), src_row, 4 * cursorw);
+		/* set last CURSORPAD pixels in row to 0 */
+		memset(dst_row + 4 * (cursorpad + cursorw),
+				0, (4 * cursorpad));
+	}
+}
+
+/* 64-bit FNV-1a, taken a pixel rather than a byte at a time */
+static uint64_t
+drmmode_cursor_hash(const CARD32 *image, int count)
+{
+	uint64_t hash = 14695981039346656037ull;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		hash ^= image[i];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+/* Whether crtc is the first enabled CRTC, on which cursors are loaded first */
+static Bool
+drmmode_crtc_first_enabled(xf86CrtcPtr crtc)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		if (config->crtc[i]->enabled)
+			return config->crtc[i] == crtc;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Toolkits often re-send the cursor which is already loaded: an image
+ * whose hash matches the last one loaded on the CRTC isn't copied again.
+ * The server loads an image on each enabled CRTC in turn, so it is only
+ * hashed on the first one. A new image goes into a buffer the kernel isn't
+ * scanning out, so that the cursor on screen never tears, and the CRTC
+ * then switches to it if it shows the cursor.
+ */
+static void
+drmmode_load_cursor_argb(xf86CrtcPtr crtc, CARD32 *image)
+{
+	uint32_t *d;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_crtc_cursor *cursor = &drmmode_crtc->cursor;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(crtc->scrn);
+	uint64_t hash;
+	int back;
 
-		ret = FALSE;
-		if (!drmmode_revert_mode(crtc, output_ids, output_count))
-			goto cleanup;
-		else
-			goto done_setting;
+	if (!drmmode->cursor)
+		return;
+
+	if (image != drmmode->cursor->image ||
+	    drmmode_crtc_first_enabled(crtc)) {
+		drmmode->cursor->image = image;
+		drmmode->cursor->image_hash = drmmode_cursor_hash(image,
+				pARMSOC->drmmode_interface->cursor_width *
+				pARMSOC->drmmode_interface->cursor_height);
 	}
+	hash = drmmode->cursor->image_hash;
 
-	/* get the actual crtc info */
-	newcrtc = drmModeGetCrtc(drmmode->fd, drmmode_crtc->crtc_id);
-	if (!newcrtc) {
-		ERROR_MSG("couldn't get actual mode back");
+	if (!cursor->bo[0])
+		return;
 
-		ret = FALSE;
-		if (!drmmode_revert_mode(crtc, output_ids, output_count))
-			goto cleanup;
-		else
-			goto done_setting;
+	if (!cursor->image_valid || cursor->image_hash != hash) {
+		/* the last image may still be waiting to be committed, then
+		 * it can be replaced in place
+		 */
+		back = cursor->front;
+		while (drmmode_cursor_on_screen(cursor, back))
+			back = (back + 1) % DRMMODE_CURSOR_BUFS;
+		d = armsoc_bo_map(cursor->bo[back]);
+		if (!d) {
+			xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
+				"load_cursor_argb map failure\n");
+			return;
+		}
+
+		set_cursor_image(crtc, d, image);
+		cursor->front = back;
+		cursor->image_hash = hash;
+		cursor->image_valid = TRUE;
 	}
 
-	if (kmode.hdisplay != newcrtc->mode.hdisplay ||
-		kmode.vdisplay != newcrtc->mode.vdisplay) {
+	if (drmmode_crtc->cursor_visible &&
+	    drmmode_crtc->cursor_buf != cursor->front)
+		drmmode_show_cursor_image(crtc, TRUE);
+}
+
+#if XF86_CRTC_VERSION >= 7
+/*
+ * A CRTC without a plane for the cursor can't show it: failing to load or
+ * show it there makes the server fall back to a software cursor.
+ */
+static Bool
+drmmode_load_cursor_argb_check(xf86CrtcPtr crtc, CARD32 *image)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+
+	drmmode_load_cursor_argb(crtc, image);
+	return drmmode_crtc->cursor.bo[0] != NULL;
+}
+
+static Bool
+drmmode_show_cursor_check(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+
+	if (!drmmode_crtc->cursor.bo[0])
+		return FALSE;
+
+	drmmode_show_cursor(crtc);
+	return TRUE;
+}
+#endif
+
+/* Free the cursor buffers, and their fbs if they have some */
+static void
+drmmode_cursor_free_bufs(ScrnInfoPtr pScrn, struct drmmode_crtc_cursor *cursor)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	int i;
+
+	for (i = 0; i < DRMMODE_CURSOR_BUFS; i++) {
+		if (cursor->fb_id[i] &&
+		    drmModeRmFB(drmmode->fd, cursor->fb_id[i]))
+			ERROR_MSG("drmModeRmFB() failed");
+		if (cursor->bo[i])
+			armsoc_bo_unreference(cursor->bo[i]);
+		cursor->fb_id[i] = 0;
+		cursor->handle[i] = 0;
+		cursor->bo[i] = NULL;
+	}
+	cursor->front = 0;
+	cursor->image_valid = FALSE;
+	cursor->scanout = DRMMODE_CURSOR_NONE << 8 | DRMMODE_CURSOR_NONE;
+}
+
+/*
+ * Allocate the cursor buffers, allowing for the cursor padding, and with
+ * add_fb an fb for each of them to show on a plane.
+ */
+static Bool
+drmmode_cursor_alloc_bufs(ScrnInfoPtr pScrn, struct drmmode_crtc_cursor *cursor,
+		Bool add_fb)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	uint32_t handles[4], pitches[4], offsets[4]; /* we only use [0] */
+	int w, h, pad;
+	int i;
+
+	w = pARMSOC->drmmode_interface->cursor_width;
+	h = pARMSOC->drmmode_interface->cursor_height;
+	pad = pARMSOC->drmmode_interface->cursor_padding;
+	cursor->scanout = DRMMODE_CURSOR_NONE << 8 | DRMMODE_CURSOR_NONE;
+
+	for (i = 0; i < DRMMODE_CURSOR_BUFS; i++) {
+		/* allow for cursor padding in the bo */
+		cursor->bo[i] = armsoc_bo_new_with_dim(pARMSOC->dev,
+					w + 2 * pad, h,
+					0, 32, ARMSOC_BO_SCANOUT);
+		if (!cursor->bo[i]) {
+			ERROR_MSG("HW cursor: buffer allocation failed");
+			goto fail;
+		}
+
+		cursor->handle[i] = armsoc_bo_handle(cursor->bo[i]);
+		if (!add_fb)
+			continue;
+
+		handles[0] = cursor->handle[i];
+		pitches[0] = armsoc_bo_pitch(cursor->bo[i]);
+		offsets[0] = 0;
+
+		/* allow for cursor padding in the fb */
+		if (drmModeAddFB2(drmmode->fd, w + 2 * pad, h,
+				DRM_FORMAT_ARGB8888, handles, pitches, offsets,
+				&cursor->fb_id[i], 0)) {
+			ERROR_MSG("HW cursor: drmModeAddFB2 failed: %s",
+						strerror(errno));
+			goto fail;
+		}
+	}
+
+	return TRUE;
+
+fail:
+	drmmode_cursor_free_bufs(pScrn, cursor);
+	return FALSE;
+}
+
+/* Whether one of our CRTCs already shows its cursor on plane_id */
+static Bool
+drmmode_plane_is_cursor(ScrnInfoPtr pScrn, uint32_t plane_id)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
+
+		if (drmmode_crtc->cursor.ovr &&
+		    drmmode_crtc->cursor.ovr->plane_id == plane_id)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Find a free plane which can show the cursor on crtc, preferring the
+ * kernel's cursor planes to overlays. Returns it along with its
+ * properties, or NULL.
+ */
+static drmModePlanePtr
+drmmode_cursor_find_plane(xf86CrtcPtr crtc, drmModePlaneResPtr plane_res,
+		struct drmmode_prop_table **props)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	drmModePlanePtr best = NULL;
+	uint32_t i;
+
+	*props = NULL;
+
+	for (i = 0; i < plane_res->count_planes; i++) {
+		uint32_t plane_id = plane_res->planes[i];
+		drmModeObjectPropertiesPtr values;
+		struct drmmode_prop_table *t;
+		drmModePlanePtr plane;
+		uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+
+		if (drmmode_plane_is_primary(pScrn, plane_id) ||
+		    drmmode_plane_is_cursor(pScrn, plane_id))
+			continue;
+
+		plane = drmModeGetPlane(drmmode->fd, plane_id);
+		if (!plane)
+			continue;
+
+		if (!(plane->possible_crtcs & (1 << drmmode_crtc->pipe))) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		t = drmmode_prop_table_new(drmmode->fd, plane_id,
+				DRM_MODE_OBJECT_PLANE, &values);
+		if (t) {
+			drmmode_prop_value(values->props, values->prop_values,
+					values->count_props,
+					drmmode_prop_find(t, "type"), &type);
+			drmModeFreeObjectProperties(values);
+		}
+
+		/* the first overlay will do, until a cursor plane turns up */
+		if (type == DRM_PLANE_TYPE_PRIMARY ||
+		    (best && type != DRM_PLANE_TYPE_CURSOR)) {
+			drmmode_prop_table_free(t);
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		if (best) {
+			drmmode_prop_table_free(*props);
+			drmModeFreePlane(best);
+		}
+		best = plane;
+		*props = t;
+
+		if (type == DRM_PLANE_TYPE_CURSOR)
+			break;
+	}
+
+	return best;
+}
+
+/* Free the cursor buffers and plane of crtc */
+static void
+drmmode_cursor_fini_crtc(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_crtc_cursor *cursor = &drmmode_crtc->cursor;
 
+	drmmode_cursor_free_bufs(crtc->scrn, cursor);
+	if (cursor->ovr)
+		drmModeFreePlane(cursor->ovr);
+	drmmode_prop_table_free(cursor->kms_props);
+	memset(cursor, 0, sizeof(*cursor));
+}
+
+/* Give crtc a cursor plane of its own, and buffers to show on it */
+static Bool
+drmmode_cursor_init_crtc_plane(xf86CrtcPtr crtc, drmModePlaneResPtr plane_res)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_crtc_cursor *cursor = &drmmode_crtc->cursor;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_prop_table *props;
+	drmModePlanePtr ovr;
+
+	ovr = drmmode_cursor_find_plane(crtc, plane_res, &props);
+	if (!ovr) {
+		WARNING_MSG("HW cursor: no plane for CRTC %d",
+				drmmode_crtc->pipe);
+		return FALSE;
+	}
+
+	/* props first, as init_plane_for_cursor may look properties up */
+	cursor->ovr = ovr;
+	cursor->kms_props = props;
+
+	if (pARMSOC->drmmode_interface->init_plane_for_cursor &&
+		pARMSOC->drmmode_interface->init_plane_for_cursor(
+				drmmode->fd, ovr->plane_id)) {
+		ERROR_MSG("Failed driver-specific cursor initialization");
+		drmmode_cursor_fini_crtc(crtc);
+		return FALSE;
+	}
+
+#ifdef HAVE_DRM_ATOMIC
+	/* without its properties, the plane is updated through SetPlane */
+	if (drmmode->atomic && props)
+		drmmode_plane_props_init(props, &cursor->props);
+#endif
+
+	if (!drmmode_cursor_alloc_bufs(pScrn, cursor, TRUE)) {
+		drmmode_cursor_fini_crtc(crtc);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static Bool
+drmmode_cursor_init_plane(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_cursor_rec *cursor;
+	drmModePlaneRes *plane_resources;
+	int w, h;
+	int i, count = 0;
+
+	if (drmmode->cursor) {
+		INFO_MSG("cursor already initialized");
+		return TRUE;
+	}
+
+	if (!xf86LoaderCheckSymbol("drmModeGetPlaneResources")) {
 		ERROR_MSG(
-			"drm did not set requested mode! (requested %dx%d, actual %dx%d)",
-			kmode.hdisplay, kmode.vdisplay,
-			newcrtc->mode.hdisplay,
-			newcrtc->mode.vdisplay);
+				"HW cursor not supported (needs libdrm 2.4.30 or higher)");
+		return FALSE;
+	}
 
-		ret = FALSE;
-		if (!drmmode_revert_mode(crtc, output_ids, output_count))
-			goto cleanup;
-		else
-			goto done_setting;
+#ifdef DRM_CLIENT_CAP_UNIVERSAL_PLANES
+	/* The kernel's cursor planes are only listed with universal planes,
+	 * the primary planes being skipped by their type
+	 */
+	drmSetClientCap(drmmode->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+#endif
+
+	/* find an unused plane for the mouse cursor on each CRTC */
+	plane_resources = drmModeGetPlaneResources(drmmode->fd);
+	if (!plane_resources) {
+		ERROR_MSG("HW cursor: drmModeGetPlaneResources failed: %s",
+						strerror(errno));
+		return FALSE;
 	}
 
-	drmmode_get_underscan(drmmode->fd, drmmode_crtc->crtc_id, &xu, &yu);
-	drmmode_crtc->underscan_x = xu;
-	drmmode_crtc->underscan_y = yu;
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		if (drmmode_cursor_init_crtc_plane(xf86_config->crtc[i],
+				plane_resources))
+			count++;
+	}
 
-	/* When called on a resize, crtc->mode already contains the
-	 * resized values so we can't use this for recovery.
-	 * We can't read it out of the crtc either as mode_valid is 0.
-	 * Instead we save the last good mode set here & fallback to
-	 * that on failure.
+	drmModeFreePlaneResources(plane_resources);
+
+	/*
+	 * A CRTC without a plane refuses the cursor, see
+	 * drmmode_load_cursor_argb_check(), so that the server draws it in
+	 * software. Older servers can't be told, so every CRTC needs one.
 	 */
-	DEBUG_MSG("Saving last good values");
-	drmmode_crtc->last_good_x = crtc->x;
-	drmmode_crtc->last_good_y = crtc->y;
-	drmmode_crtc->last_good_rotation = crtc->rotation;
-	if (drmmode_crtc->last_good_mode) {
-		if (drmmode_crtc->last_good_mode->name)
-			free((void *) drmmode_crtc->last_good_mode->name);
-		free(drmmode_crtc->last_good_mode);
+#if XF86_CRTC_VERSION >= 7
+	if (!count) {
+#else
+	if (count < xf86_config->num_crtc) {
+#endif
+		ERROR_MSG("not enough planes for HW cursor");
+		goto fail;
+	}
+
+	cursor = calloc(1, sizeof(struct drmmode_cursor_rec));
+	if (!cursor) {
+		ERROR_MSG("HW cursor: calloc failed");
+		goto fail;
+	}
+
+	w = pARMSOC->drmmode_interface->cursor_width;
+	h = pARMSOC->drmmode_interface->cursor_height;
+
+	if (!xf86_cursors_init(pScreen, w, h, HARDWARE_CURSOR_ARGB)) {
+		ERROR_MSG("xf86_cursors_init() failed");
+		free(cursor);
+		goto fail;
+	}
+
+	INFO_MSG("HW cursor initialized on %d of %d CRTCs", count,
+			xf86_config->num_crtc);
+	drmmode->cursor = cursor;
+	return TRUE;
+
+fail:
+	for (i = 0; i < xf86_config->num_crtc; i++)
+		drmmode_cursor_fini_crtc(xf86_config->crtc[i]);
+	return FALSE;
+}
+
+static Bool
+drmmode_cursor_init_standard(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_cursor_rec *cursor;
+	int w, h;
+	int i;
+
+	if (drmmode->cursor) {
+		INFO_MSG("cursor already initialized");
+		return TRUE;
+	}
+
+	if (!xf86LoaderCheckSymbol("drmModeSetCursor") ||
+	    !xf86LoaderCheckSymbol("drmModeMoveCursor")) {
+		ERROR_MSG(
+				"Standard HW cursor not supported (needs libdrm 2.4.3 or higher)");
+		return FALSE;
 	}
-	drmmode_crtc->last_good_mode = xf86DuplicateMode(&crtc->mode);
 
-	ret = TRUE;
+	cursor = calloc(1, sizeof(struct drmmode_cursor_rec));
+	if (!cursor) {
+		ERROR_MSG("HW cursor (standard): calloc failed");
+		return FALSE;
+	}
 
-done_setting:
-	/* Turn on any outputs on this crtc that may have been disabled: */
-	for (i = 0; i < xf86_config->num_output; i++) {
-		xf86OutputPtr output = xf86_config->output[i];
+	w = pARMSOC->drmmode_interface->cursor_width;
+	h = pARMSOC->drmmode_interface->cursor_height;
 
-		if (output->crtc != crtc)
-			continue;
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
 
-		drmmode_output_dpms(output, DPMSModeOn);
+		if (!drmmode_cursor_alloc_bufs(pScrn, &drmmode_crtc->cursor,
+				FALSE))
+			goto fail;
 	}
 
-#if !RELOAD_CURSORS_DEPRECATED
-	/* if hw cursor is initialized, reload it */
-	if (drmmode->cursor)
-		xf86_reload_cursors(pScrn->pScreen);
-#endif
+	if (!xf86_cursors_init(pScreen, w, h, HARDWARE_CURSOR_ARGB | HARDWARE_CURSOR_UPDATE_UNHIDDEN)) {
+		ERROR_MSG("xf86_cursors_init() failed");
+		goto fail;
+	}
 
-cleanup:
-	if (newcrtc)
-		drmModeFreeCrtc(newcrtc);
+	INFO_MSG("HW cursor initialized");
+	drmmode->cursor = cursor;
+	return TRUE;
 
-	if (output_ids)
-		free(output_ids);
+fail:
+	for (i = 0; i < xf86_config->num_crtc; i++)
+		drmmode_cursor_fini_crtc(xf86_config->crtc[i]);
+	free(cursor);
+	return FALSE;
+}
 
-	if (!ret && drmmode_crtc->last_good_mode) {
-		/* If there was a problem, restore the last good mode: */
-		crtc->x = drmmode_crtc->last_good_x;
-		crtc->y = drmmode_crtc->last_good_y;
-		crtc->rotation = drmmode_crtc->last_good_rotation;
-		crtc->mode = *drmmode_crtc->last_good_mode;
-	}
+Bool drmmode_cursor_init(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
 
-	TRACE_EXIT();
-	return ret;
+	INFO_MSG("HW cursor init()");
+
+	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE)
+		return drmmode_cursor_init_plane(pScreen);
+	else /* HWCURSOR_API_STANDARD */
+		return drmmode_cursor_init_standard(pScreen);
 }
 
-static void
-drmmode_hide_cursor(xf86CrtcPtr crtc)
+void drmmode_cursor_fini(ScreenPtr pScreen)
 {
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
 	struct drmmode_cursor_rec *cursor = drmmode->cursor;
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	int i;
 
 	if (!cursor)
 		return;
 
-	drmmode_crtc->cursor_visible = FALSE;
+	drmmode->cursor = NULL;
+	TimerFree(cursor->timer);
+	xf86_cursors_fini(pScreen);
+	/* staged updates must not outlive the cursor fbs */
+	drmmode_atomic_flush(pScrn);
+	for (i = 0; i < xf86_config->num_crtc; i++)
+		drmmode_cursor_fini_crtc(xf86_config->crtc[i]);
+	free(cursor);
+}
 
-	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE) {
-		/* set plane's fb_id to 0 to disable it */
-		drmModeSetPlane(drmmode->fd, cursor->ovr->plane_id,
-				drmmode_crtc->crtc_id, 0, 0,
-				0, 0, 0, 0, 0, 0, 0, 0);
-	} else { /* HWCURSOR_API_STANDARD */
-		/* set handle to 0 to disable the cursor */
-		drmModeSetCursor(drmmode->fd, drmmode_crtc->crtc_id,
-				 0, 0, 0);
-	}
+/* Log how many pointer moves the HW cursor coalesced into how many updates */
+void
+drmmode_cursor_dump_stats(ScrnInfoPtr pScrn)
+{
+	struct drmmode_cursor_rec *cursor = drmmode_from_scrn(pScrn)->cursor;
+
+	if (cursor)
+		INFO_MSG("HW cursor: %lu moves, %lu updates",
+				__atomic_load_n(&cursor->moves,
+					__ATOMIC_RELAXED),
+				__atomic_load_n(&cursor->updates,
+					__ATOMIC_RELAXED));
 }
 
 /*
- * The argument "update_image" controls whether the cursor image needs
- * to be updated by the HW or not. This is ignored by HWCURSOR_API_PLANE
- * which doesn't allow changing the cursor possition without updating
- * the image too.
+ * Log what keeping the copies of the root up to date costs: the CPU reads
+ * the root, which is uncached on some display controllers.
  */
-static void
-drmmode_show_cursor_image(xf86CrtcPtr crtc, Bool update_image)
+void
+drmmode_redisplay_dump_stats(ScrnInfoPtr pScrn)
 {
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	struct drmmode_cursor_rec *cursor = drmmode->cursor;
-	int crtc_x, crtc_y, src_x, src_y;
-	int w, h, pad;
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
 
-	if (!cursor)
-		return;
+	if (drmmode->redisplays)
+		INFO_MSG("CRTC copies: %lu redraws, %llu pixels in %llu us",
+				drmmode->redisplays,
+				(unsigned long long)drmmode->redisplay_pixels,
+				(unsigned long long)
+				(drmmode->redisplay_ns / 1000));
+}
 
-	drmmode_crtc->cursor_visible = TRUE;
+uint32_t drmmode_get_crtc_id(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	xf86OutputPtr output = config->output[config->compat_output];
+	xf86CrtcPtr crtc = output->crtc;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
 
-	w = pARMSOC->drmmode_interface->cursor_width;
-	h = pARMSOC->drmmode_interface->cursor_height;
-	pad = pARMSOC->drmmode_interface->cursor_padding;
+	return drmmode_crtc->crtc_id;
+}
 
-	/* get padded width */
-	w = w + 2 * pad;
-	/* get x of padded cursor */
-	crtc_x = cursor->x - pad;
-	crtc_y = cursor->y;
+/* Duration of a frame of crtc's mode in ns, or 0 if it has none */
+static uint64_t
+drmmode_mode_period_ns(xf86CrtcPtr crtc)
+{
+	DisplayModePtr mode = &crtc->mode;
 
-	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE) {
-		src_x = 0;
-		src_y = 0;
-
-		/* calculate clipped x, y, w & h if cursor is off edges */
-		if (crtc_x < 0) {
-			src_x += -crtc_x;
-			w -= -crtc_x;
-			crtc_x = 0;
-		}
+	if (!crtc->enabled || mode->Clock <= 0)
+		return 0;
 
-		if (crtc_y < 0) {
-			src_y += -crtc_y;
-			h -= -crtc_y;
-			crtc_y = 0;
-		}
+	/* Clock is in kHz */
+	return (uint64_t)mode->HTotal * mode->VTotal * 1000000 / mode->Clock;
+}
 
-		if ((crtc_x + w) > crtc->mode.HDisplay)
-			w = crtc->mode.HDisplay - crtc_x;
+/**
+ * Return the duration of a frame on crtc, or if it is NULL or has no mode,
+ * on the first enabled CRTC, or of a 60Hz frame if none is enabled.
+ */
+uint64_t
+drmmode_frame_period_ns(ScrnInfoPtr pScrn, xf86CrtcPtr crtc)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	uint64_t period = crtc ? drmmode_mode_period_ns(crtc) : 0;
+	int i;
 
-		if ((crtc_y + h) > crtc->mode.VDisplay)
-			h = crtc->mode.VDisplay - crtc_y;
+	for (i = 0; !period && i < config->num_crtc; i++)
+		period = drmmode_mode_period_ns(config->crtc[i]);
 
-		crtc_x += drmmode_crtc->underscan_x;
-		crtc_y += drmmode_crtc->underscan_y;
+	return period ? period : 1000000000 / 60;
+}
 
-		/* note src coords (last 4 args) are in Q16 format */
-		drmModeSetPlane(drmmode->fd, cursor->ovr->plane_id,
-			drmmode_crtc->crtc_id, cursor->fb_id, 0,
-			crtc_x, crtc_y, w, h, src_x<<16, src_y<<16,
-			w<<16, h<<16);
-	} else {
-		if (update_image)
-			drmModeSetCursor(drmmode->fd,
-					 drmmode_crtc->crtc_id,
-					 cursor->handle, w, h);
-		drmModeMoveCursor(drmmode->fd,
-				  drmmode_crtc->crtc_id,
-				  crtc_x, crtc_y);
+/*
+ * DRI2's frame counter is that of the first CRTC, which vblank requests
+ * address when they don't name a pipe.
+ */
+Bool
+drmmode_get_msc(ScrnInfoPtr pScrn, uint64_t *ust, uint64_t *msc)
+{
+	xf86CrtcPtr crtc = XF86_CRTC_CONFIG_PTR(pScrn)->crtc[0];
+
+	if (!drmmode_crtc_msc(crtc, ust, msc)) {
+		ERROR_MSG("get vblank counter failed: %s", strerror(errno));
+		return FALSE;
 	}
+
+	return TRUE;
 }
 
-static void
-drmmode_show_cursor(xf86CrtcPtr crtc)
+/*
+ * Time in microseconds at which DRI2's frame counter reaches msc, but no
+ * earlier than its next frame, counting frames of the mode of its CRTC.
+ * This paces swaps while the CRTC is turned off and has no vblank events.
+ */
+uint64_t
+drmmode_msc_ust(ScrnInfoPtr pScrn, uint64_t msc)
 {
-	drmmode_show_cursor_image(crtc, TRUE);
+	xf86CrtcPtr crtc = XF86_CRTC_CONFIG_PTR(pScrn)->crtc[0];
+	uint64_t ust, cur;
+
+	if (!drmmode_crtc_msc(crtc, &ust, &cur))
+		return armsoc_monotonic_ns() / 1000;
+
+	return ust + (msc > cur ? msc - cur : 1) *
+			(drmmode_frame_period_ns(pScrn, crtc) / 1000);
 }
 
-static void
-drmmode_set_cursor_position(xf86CrtcPtr crtc, int x, int y)
+/*
+ * Request a vblank event for priv when DRI2's frame counter reaches msc,
+ * see drmmode_get_msc(). Fails if the CRTC is turned off, as there is then
+ * no vblank to wait for.
+ */
+int
+drmmode_queue_vblank(ScrnInfoPtr pScrn, uint64_t msc, void *priv)
 {
+	xf86CrtcPtr crtc = XF86_CRTC_CONFIG_PTR(pScrn)->crtc[0];
 	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	drmVBlank vbl;
 
-	if (!cursor)
-		return;
+	if (!drmmode_crtc_on(crtc))
+		return -1;
 
-	cursor->x = x;
-	cursor->y = y;
+	vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT |
+			drmmode_crtc_vblank_pipe(drmmode_crtc->pipe);
+	vbl.request.sequence = msc - drmmode_crtc->msc_offset;
+	vbl.request.signal = (unsigned long)priv;
 
-	/*
-	 * Show the cursor at a different possition without updating the image
-	 * when possible (HWCURSOR_API_PLANE doesn't have a way to update
-	 * cursor position without updating the image too).
-	 */
-	drmmode_show_cursor_image(crtc, FALSE);
+	return drmWaitVBlank(drmmode_crtc->drmmode->fd, &vbl);
 }
 
-/*
- * The cursor format is ARGB so the image can be copied straight over.
- * Columns of CURSORPAD blank pixels are maintained down either side
- * of the destination image. This is a workaround for a bug causing
- * corruption when the cursor reaches the screen edges in some DRM
- * drivers.
+/**
+ * Find the enabled CRTC which scans out most of the given box of the
+ * framebuffer, and build a model of where its beam is from the timestamp
+ * of its last vblank and the timings of its current mode.
+ *
+ * Rotated or transformed CRTCs don't scan the framebuffer out line by line,
+ * so no model is returned for them.
  */
-static void set_cursor_image(xf86CrtcPtr crtc, uint32_t *d, CARD32 *s)
+Bool
+drmmode_crtc_scanline_model(ScrnInfoPtr pScrn, const BoxRec *box,
+		struct drmmode_scanline_model *model)
 {
-	ScrnInfoPtr pScrn = crtc->scrn;
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	int row;
-	void *dst;
-	const char *src_row;
-	char *dst_row;
-	uint32_t cursorh = pARMSOC->drmmode_interface->cursor_height;
-	uint32_t cursorw = pARMSOC->drmmode_interface->cursor_width;
-	uint32_t cursorpad = pARMSOC->drmmode_interface->cursor_padding;
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc;
+	xf86CrtcPtr best = NULL;
+	int best_coverage = 0;
+	DisplayModePtr mode;
+	drmVBlank vbl;
+	int i;
 
-	dst = d;
-	for (row = 0; row < cursorh; row += 1) {
-		/* we're operating with ARGB data (4 bytes per pixel) */
-		src_row = (const char *)s + row * 4 * cursorw;
-		dst_row = (char *)dst + row * 4 * (cursorw + 2 * cursorpad);
+	if (!pARMSOC->drmmode_interface->vblank_query_supported)
+		return FALSE;
 
-		/* set first CURSORPAD pixels in row to 0 */
-		memset(dst_row, 0, (4 * cursorpad));
-		/* copy cursor image pixel row across */
-		memcpy(dst_row + (4 * cursorpad), src_row, 4 * cursorw);
-		/* set last CURSORPAD pixels in row to 0 */
-		memset(dst_row + 4 * (cursorpad + cursorw),
-				0, (4 * cursorpad));
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		int x1, y1, x2, y2;
+
+		if (!drmmode_crtc_on(crtc))
+			continue;
+
+		x1 = max(box->x1, crtc->x);
+		y1 = max(box->y1, crtc->y);
+		x2 = min(box->x2, crtc->x + crtc->mode.HDisplay);
+		y2 = min(box->y2, crtc->y + crtc->mode.VDisplay);
+		if (x1 >= x2 || y1 >= y2)
+			continue;
+
+		if ((x2 - x1) * (y2 - y1) > best_coverage) {
+			best_coverage = (x2 - x1) * (y2 - y1);
+			best = crtc;
+		}
 	}
+
+	if (!best || best->rotation != RR_Rotate_0 || best->transform_in_use)
+		return FALSE;
+
+	mode = &best->mode;
+	if (mode->Clock <= 0 || mode->HTotal <= 0 ||
+	    mode->VTotal < mode->VDisplay)
+		return FALSE;
+
+	drmmode_crtc = best->driver_private;
+	vbl.request.type = DRM_VBLANK_RELATIVE |
+			drmmode_crtc_vblank_pipe(drmmode_crtc->pipe);
+	vbl.request.sequence = 0;
+	vbl.request.signal = 0;
+	if (drmWaitVBlank(drmmode_crtc->drmmode->fd, &vbl))
+		return FALSE;
+
+	model->y = best->y;
+	model->vdisplay = mode->VDisplay;
+	model->vtotal = mode->VTotal;
+	/* Clock is in kHz */
+	model->line_ns = (uint64_t)mode->HTotal * 1000000 / mode->Clock;
+	model->vblank_ns = (uint64_t)vbl.reply.tval_sec * 1000000000 +
+			(uint64_t)vbl.reply.tval_usec * 1000;
+
+	return model->line_ns > 0;
 }
 
-static void
-drmmode_load_cursor_argb(xf86CrtcPtr crtc, CARD32 *image)
+/*
+ * A page flip of one or more CRTCs. The kernel sends an event for each CRTC,
+ * legacy flips and atomic commits alike; the swap completes once all of them
+ * have arrived.
+ */
+struct drmmode_flip {
+	void *priv;
+	/* CRTC flip events still to arrive */
+	int pending;
+	/* the CRTCs which did flip were put back on the root */
+	Bool aborted;
+	/* set for flips of the root, which are counted in its root_flips */
+	struct drmmode_rec *root;
+#ifdef HAVE_DRM_ATOMIC
+	/* set for atomic flips, which are counted in its flips_pending */
+	struct drmmode_rec *atomic;
+#endif
+};
+
+static struct drmmode_flip *
+drmmode_flip_new(void *priv)
 {
-	uint32_t *d;
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	struct drmmode_flip *flip = calloc(1, sizeof(*flip));
 
-	if (!cursor)
-		return;
+	if (flip)
+		flip->priv = priv;
 
-	d = armsoc_bo_map(cursor->bo);
-	if (!d) {
-		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
-			"load_cursor_argb map failure\n");
-		return;
+	return flip;
+}
+
+/*
+ * Per-CRTC scanout: a DRI2 window which exactly covers the viewport of one
+ * CRTC, on a screen made of several, is flipped on that CRTC alone. The CRTC
+ * is moved off the root scanout buffer by a mode set to the window's buffer,
+ * then page flipped between its buffers, while the other CRTCs carry on
+ * scanning out the root.
+ */
+
+/**
+ * Return the enabled CRTC whose viewport is exactly box, or NULL. Rotated
+ * or transformed CRTCs don't qualify: they scan out a shadow buffer; nor
+ * do CRTCs turned off by DPMS.
+ */
+xf86CrtcPtr
+drmmode_crtc_covering(ScrnInfoPtr pScrn, const BoxRec *box)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
+
+		if (!drmmode_crtc_on(crtc) || crtc->rotation != RR_Rotate_0 ||
+		    crtc->transform_in_use || drmmode_crtc->rotate_bo ||
+		    drmmode_crtc->copy_bo)
+			continue;
+
+		if (box->x1 == crtc->x && box->y1 == crtc->y &&
+		    box->x2 == crtc->x + crtc->mode.HDisplay &&
+		    box->y2 == crtc->y + crtc->mode.VDisplay)
+			return crtc;
 	}
 
-	set_cursor_image(crtc, d, image);
+	return NULL;
 }
 
+/*
+ * Whether crtc scans out a shadow or a copy of the root, which page flips
+ * of the root leave alone: the copy is redrawn from the new root buffer.
+ */
 static Bool
-drmmode_cursor_init_plane(ScreenPtr pScreen)
+drmmode_crtc_shadowed(xf86CrtcPtr crtc)
 {
-	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
-	struct drmmode_cursor_rec *cursor;
-	drmModePlaneRes *plane_resources;
-	drmModePlane *ovr;
-	int w, h, pad;
-	uint32_t handles[4], pitches[4], offsets[4]; /* we only use [0] */
-
-	if (drmmode->cursor) {
-		INFO_MSG("cursor already initialized");
-		return TRUE;
-	}
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
 
-	if (!xf86LoaderCheckSymbol("drmModeGetPlaneResources")) {
-		ERROR_MSG(
-				"HW cursor not supported (needs libdrm 2.4.30 or higher)");
-		return FALSE;
-	}
+	return drmmode_crtc->rotate_bo || drmmode_crtc->copy_bo;
+}
 
-	/* find an unused plane which can be used as a mouse cursor.  Note
-	 * that we cheat a bit, in order to not burn one overlay per crtc,
-	 * and only show the mouse cursor on one crtc at a time
-	 */
-	plane_resources = drmModeGetPlaneResources(drmmode->fd);
-	if (!plane_resources) {
-		ERROR_MSG("HW cursor: drmModeGetPlaneResources failed: %s",
-						strerror(errno));
-		return FALSE;
-	}
+/*
+ * Whether the enabled CRTCs all scan out a shadow or are turned off by
+ * DPMS, so that a page flip of the root would show nothing, and swaps must
+ * copy to it instead.
+ */
+static Bool
+drmmode_root_shadowed(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i, shadowed = 0;
 
-	if (plane_resources->count_planes < 1) {
-		ERROR_MSG("not enough planes for HW cursor");
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
+	for (i = 0; i < config->num_crtc; i++) {
+		if (!config->crtc[i]->enabled)
+			continue;
+		if (drmmode_crtc_on(config->crtc[i]) &&
+		    !drmmode_crtc_shadowed(config->crtc[i]))
+			return FALSE;
+		shadowed++;
 	}
 
-	ovr = drmModeGetPlane(drmmode->fd, plane_resources->planes[0]);
-	if (!ovr) {
-		ERROR_MSG("HW cursor: drmModeGetPlane failed: %s",
-					strerror(errno));
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
-	}
+	return shadowed > 0;
+}
 
-	if (pARMSOC->drmmode_interface->init_plane_for_cursor &&
-		pARMSOC->drmmode_interface->init_plane_for_cursor(
-				drmmode->fd, ovr->plane_id)) {
-		ERROR_MSG("Failed driver-specific cursor initialization");
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
-	}
+/* Scan out fb_id from (x, y) in crtc's current mode, see commit_mode */
+static int
+drmmode_crtc_set_fb(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y,
+		Bool sync)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	uint32_t *output_ids;
+	drmModeModeInfo kmode;
+	int ret;
 
-	cursor = calloc(1, sizeof(struct drmmode_cursor_rec));
-	if (!cursor) {
-		ERROR_MSG("HW cursor: calloc failed");
-		drmModeFreePlane(ovr);
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
-	}
+	output_ids = calloc(xf86_config->num_output, sizeof(uint32_t));
+	if (!output_ids)
+		return -ENOMEM;
 
-	cursor->ovr = ovr;
+	drmmode_ConvertToKMode(crtc->scrn, &kmode, &crtc->mode);
+	ret = drmmode_crtc_commit_mode(crtc, fb_id, x, y, output_ids,
+			drmmode_crtc_output_ids(crtc, output_ids), &kmode, sync);
+	free(output_ids);
 
-	w = pARMSOC->drmmode_interface->cursor_width;
-	h = pARMSOC->drmmode_interface->cursor_height;
-	pad = pARMSOC->drmmode_interface->cursor_padding;
+	return ret;
+}
 
-	/* allow for cursor padding in the bo */
-	cursor->bo  = armsoc_bo_new_with_dim(pARMSOC->dev,
-				w + 2 * pad, h,
-				0, 32, ARMSOC_BO_SCANOUT);
+/* Copy the frame bo holds into the root under the CRTC's viewport */
+static void
+drmmode_crtc_copy_to_root(xf86CrtcPtr crtc, struct armsoc_bo *bo)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct armsoc_bo *root = pARMSOC->scanout;
+	int x = drmmode_crtc->scanout_x;
+	int y = drmmode_crtc->scanout_y;
+	int width, height;
+	void *src, *dst;
+
+	/* The root may have been resized meanwhile */
+	width = min((int)armsoc_bo_width(bo),
+			(int)armsoc_bo_width(root) - x);
+	height = min((int)armsoc_bo_height(bo),
+			(int)armsoc_bo_height(root) - y);
+	if (width <= 0 || height <= 0 ||
+	    armsoc_bo_bpp(bo) != armsoc_bo_bpp(root))
+		return;
 
-	if (!cursor->bo) {
-		ERROR_MSG("HW cursor: buffer allocation failed");
-		free(cursor);
-		drmModeFreePlane(ovr);
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
+	src = armsoc_bo_map(bo);
+	dst = armsoc_bo_map(root);
+	if (!src || !dst) {
+		ERROR_MSG("Couldn't map buffers to copy CRTC %d's frame",
+				drmmode_crtc->pipe);
+		return;
 	}
 
-	handles[0] = armsoc_bo_handle(cursor->bo);
-	pitches[0] = armsoc_bo_pitch(cursor->bo);
-	offsets[0] = 0;
+	/* The client's GPU may still be rendering to the bo */
+	if (!ARMSOCPrepareBoAccess(pScrn, bo))
+		return;
 
-	/* allow for cursor padding in the fb */
-	if (drmModeAddFB2(drmmode->fd, w + 2 * pad, h, DRM_FORMAT_ARGB8888,
-			handles, pitches, offsets, &cursor->fb_id, 0)) {
-		ERROR_MSG("HW cursor: drmModeAddFB2 failed: %s",
-					strerror(errno));
-		armsoc_bo_unreference(cursor->bo);
-		free(cursor);
-		drmModeFreePlane(ovr);
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
-	}
+	if (!pixman_blt(src, dst,
+			armsoc_bo_pitch(bo) / sizeof(uint32_t),
+			armsoc_bo_pitch(root) / sizeof(uint32_t),
+			armsoc_bo_bpp(bo), armsoc_bo_bpp(root),
+			0, 0, x, y, width, height))
+		ERROR_MSG("Pixman failed to copy CRTC %d's frame to the root",
+				drmmode_crtc->pipe);
 
-	if (!xf86_cursors_init(pScreen, w, h, HARDWARE_CURSOR_ARGB)) {
-		ERROR_MSG("xf86_cursors_init() failed");
-		if (drmModeRmFB(drmmode->fd, cursor->fb_id))
-			ERROR_MSG("drmModeRmFB() failed");
+	ARMSOCFinishBoAccess(pScrn, bo);
+}
 
-		armsoc_bo_unreference(cursor->bo);
-		free(cursor);
-		drmModeFreePlane(ovr);
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
-	}
+/* Forget the CRTC's own scanout, once it is back on the root */
+static void
+drmmode_crtc_release_scanout(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct armsoc_bo *bo = drmmode_crtc->flip_bo ?
+			drmmode_crtc->flip_bo : drmmode_crtc->scanout_bo;
 
-	INFO_MSG("HW cursor initialized");
-	drmmode->cursor = cursor;
-	drmModeFreePlaneResources(plane_resources);
-	return TRUE;
+	if (!drmmode_crtc->scanout_bo)
+		return;
+
+	/* Bring the root up to date with the window's latest frame, unless
+	 * that was done when the restore was deferred: X may have drawn
+	 * to the root since.
+	 */
+	if (!drmmode_crtc->restore_pending)
+		drmmode_crtc_copy_to_root(crtc, bo);
+	drmmode_crtc->restore_pending = FALSE;
+
+	armsoc_bo_unreference(drmmode_crtc->scanout_bo);
+	armsoc_bo_unreference(drmmode_crtc->flip_bo);
+	drmmode_crtc->scanout_bo = NULL;
+	drmmode_crtc->flip_bo = NULL;
 }
 
-static Bool
-drmmode_cursor_init_standard(ScreenPtr pScreen)
+/**
+ * Flip a single CRTC to bo, which must have a framebuffer the size of the
+ * CRTC's mode. The first flip moves the CRTC off the root with a mode set
+ * that waits for bo to reach the screen, so the flip is complete on return
+ * and the next one can't find a commit still in flight; the following ones
+ * are page flips.
+ *
+ * Returns 1 if a page flip event will follow, 0 if the flip is already
+ * complete, or a negative value on failure.
+ */
+int
+drmmode_page_flip_crtc(xf86CrtcPtr crtc, struct armsoc_bo *bo, void *priv)
 {
-	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	ScrnInfoPtr pScrn = crtc->scrn;
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
-	struct drmmode_cursor_rec *cursor;
-	int w, h, pad;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	uint32_t fb_id = armsoc_bo_get_fb(bo);
+	struct drmmode_flip *flip;
+
+	/* A window covers the CRTC again before it went back on the root:
+	 * carry on flipping instead */
+	drmmode_crtc->restore_pending = FALSE;
+
+	if (!drmmode_crtc->scanout_bo) {
+		if (drmmode_crtc_set_fb(crtc, fb_id, 0, 0, TRUE)) {
+			WARNING_MSG("failed to scan out a window on CRTC %d: %s",
+					drmmode_crtc->pipe, strerror(errno));
+			return -1;
+		}
 
-	if (drmmode->cursor) {
-		INFO_MSG("cursor already initialized");
-		return TRUE;
+		armsoc_bo_reference(bo);
+		drmmode_crtc->scanout_bo = bo;
+		drmmode_crtc->scanout_x = crtc->x;
+		drmmode_crtc->scanout_y = crtc->y;
+		return 0;
 	}
 
-	if (!xf86LoaderCheckSymbol("drmModeSetCursor") ||
-	    !xf86LoaderCheckSymbol("drmModeMoveCursor")) {
-		ERROR_MSG(
-				"Standard HW cursor not supported (needs libdrm 2.4.3 or higher)");
-		return FALSE;
-	}
+	if (!pARMSOC->drmmode_interface->use_page_flip_events) {
+		if (drmModePageFlip(drmmode_crtc->drmmode->fd,
+				drmmode_crtc->crtc_id, fb_id, 0, NULL)) {
+			WARNING_MSG("flip queue failed: %s", strerror(errno));
+			return -1;
+		}
 
-	cursor = calloc(1, sizeof(struct drmmode_cursor_rec));
-	if (!cursor) {
-		ERROR_MSG("HW cursor (standard): calloc failed");
-		return FALSE;
+		set_scanout_bo(pScrn, crtc, bo);
+		return 0;
 	}
 
-	w = pARMSOC->drmmode_interface->cursor_width;
-	h = pARMSOC->drmmode_interface->cursor_height;
-	pad = pARMSOC->drmmode_interface->cursor_padding;
-
-	/* allow for cursor padding in the bo */
-	cursor->bo  = armsoc_bo_new_with_dim(pARMSOC->dev,
-				w + 2 * pad, h,
-				0, 32, ARMSOC_BO_SCANOUT);
+	flip = drmmode_flip_new(priv);
+	if (!flip)
+		return -1;
 
-	if (!cursor->bo) {
-		ERROR_MSG("HW cursor (standard): buffer allocation failed");
-		free(cursor);
-		return FALSE;
+	if (drmModePageFlip(drmmode_crtc->drmmode->fd, drmmode_crtc->crtc_id,
+			fb_id, DRM_MODE_PAGE_FLIP_EVENT, flip)) {
+		WARNING_MSG("flip queue failed: %s", strerror(errno));
+		free(flip);
+		return -1;
 	}
+	flip->pending = 1;
 
-	cursor->handle = armsoc_bo_handle(cursor->bo);
+	armsoc_bo_reference(bo);
+	armsoc_bo_unreference(drmmode_crtc->flip_bo);
+	drmmode_crtc->flip_bo = bo;
+	return 1;
+}
 
-	if (!xf86_cursors_init(pScreen, w, h, HARDWARE_CURSOR_ARGB | HARDWARE_CURSOR_UPDATE_UNHIDDEN)) {
-		ERROR_MSG("xf86_cursors_init() failed");
-		if (drmModeRmFB(drmmode->fd, cursor->fb_id))
-			ERROR_MSG("drmModeRmFB() failed");
+/* Whether bo is, or is about to be, scanned out by a CRTC of its own */
+Bool
+drmmode_scanout_busy(ScrnInfoPtr pScrn, struct armsoc_bo *bo)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
 
-		armsoc_bo_unreference(cursor->bo);
-		free(cursor);
-		return FALSE;
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (drmmode_crtc->scanout_bo == bo ||
+		    drmmode_crtc->flip_bo == bo)
+			return TRUE;
 	}
 
-	INFO_MSG("HW cursor initialized");
-	drmmode->cursor = cursor;
-	return TRUE;
+	return FALSE;
 }
 
-Bool drmmode_cursor_init(ScreenPtr pScreen)
+/**
+ * Put a CRTC that scans out a window of its own back on the root scanout
+ * buffer, once the root holds the window's latest frame.
+ */
+void
+drmmode_crtc_restore_scanout(xf86CrtcPtr crtc)
 {
-	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	ScrnInfoPtr pScrn = crtc->scrn;
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
 
-	INFO_MSG("HW cursor init()");
+	if (!drmmode_crtc->scanout_bo)
+		return;
 
-	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE)
-		return drmmode_cursor_init_plane(pScreen);
-	else /* HWCURSOR_API_STANDARD */
-		return drmmode_cursor_init_standard(pScreen);
+	drmmode_crtc_release_scanout(crtc);
+
+	/* Switching back to the VT sets the modes from scratch. Wait for the
+	 * root to reach the screen, so that a flip to a window right after
+	 * doesn't find this commit still in flight.
+	 */
+	if (pScrn->vtSema && drmmode_crtc_on(crtc) && drmmode_crtc_set_fb(crtc,
+			armsoc_bo_get_fb(pARMSOC->scanout), crtc->x, crtc->y,
+			TRUE))
+		ERROR_MSG("failed to restore CRTC %d to the root: %s",
+				drmmode_crtc->pipe, strerror(errno));
 }
 
-void drmmode_cursor_fini(ScreenPtr pScreen)
+/**
+ * Like drmmode_crtc_restore_scanout(), for the window tree hooks: the root
+ * is brought up to date right away, before X draws anything else to it,
+ * but the mode set waits for drmmode_flush_restores().
+ */
+void
+drmmode_crtc_defer_restore(xf86CrtcPtr crtc)
 {
-	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
-	struct drmmode_cursor_rec *cursor = drmmode->cursor;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
 
-	if (!cursor)
+	if (!drmmode_crtc->scanout_bo || drmmode_crtc->restore_pending)
 		return;
 
-	drmmode->cursor = NULL;
-	xf86_cursors_fini(pScreen);
-	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE)
-		drmModeRmFB(drmmode->fd, cursor->fb_id);
-	armsoc_bo_unreference(cursor->bo);
-	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE)
-		drmModeFreePlane(cursor->ovr);
-	free(cursor);
+	drmmode_crtc_copy_to_root(crtc, drmmode_crtc->flip_bo ?
+			drmmode_crtc->flip_bo : drmmode_crtc->scanout_bo);
+	drmmode_crtc->restore_pending = TRUE;
 }
 
-uint32_t drmmode_get_crtc_id(ScrnInfoPtr pScrn)
+/* Put the CRTCs waiting for it back on the root, see above */
+void
+drmmode_flush_restores(ScrnInfoPtr pScrn)
 {
 	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
-	xf86OutputPtr output = config->output[config->compat_output];
-	xf86CrtcPtr crtc = output->crtc;
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	int i;
 
-	return drmmode_crtc->crtc_id;
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (drmmode_crtc->restore_pending)
+			drmmode_crtc_restore_scanout(config->crtc[i]);
+	}
 }
 
 #if 1 == ARMSOC_SUPPORT_GAMMA
@@ -963,16 +3355,32 @@ drmmode_crtc_shadow_destroy(xf86CrtcPtr crtc, PixmapPtr rotate_pixmap, void *dat
 	}
 }
 
+static void
+drmmode_crtc_destroy(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+
+	drmmode_crtc_copy_free(crtc);
+	drmmode_prop_table_free(drmmode_crtc->kms_props);
+	drmmode_crtc->kms_props = NULL;
+}
+
 static const xf86CrtcFuncsRec drmmode_crtc_funcs = {
 		.dpms = drmmode_crtc_dpms,
 		.set_mode_major = drmmode_set_mode_major,
+		.set_origin = drmmode_set_origin,
 		.set_cursor_position = drmmode_set_cursor_position,
 		.show_cursor = drmmode_show_cursor,
 		.hide_cursor = drmmode_hide_cursor,
 		.load_cursor_argb = drmmode_load_cursor_argb,
+#if XF86_CRTC_VERSION >= 7
+		.show_cursor_check = drmmode_show_cursor_check,
+		.load_cursor_argb_check = drmmode_load_cursor_argb_check,
+#endif
 		.shadow_create = drmmode_crtc_shadow_create,
 		.shadow_allocate = drmmode_crtc_shadow_allocate,
 		.shadow_destroy = drmmode_crtc_shadow_destroy,
+		.destroy = drmmode_crtc_destroy,
 #if 1 == ARMSOC_SUPPORT_GAMMA
 		.gamma_set = drmmode_gamma_set,
 #endif
@@ -993,8 +3401,16 @@ drmmode_crtc_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode, int num)
 
 	drmmode_crtc = xnfcalloc(1, sizeof(struct drmmode_crtc_private_rec));
 	drmmode_crtc->crtc_id = drmmode->mode_res->crtcs[num];
+	drmmode_crtc->pipe = num;
 	drmmode_crtc->drmmode = drmmode;
 	drmmode_crtc->last_good_mode = NULL;
+	/* Off until the first mode set, counting frames from now */
+	drmmode_crtc->dpms_mode = DPMSModeOff;
+	drmmode_crtc->blank_ust = armsoc_monotonic_ns() / 1000;
+	drmmode_crtc->kms_props = drmmode_prop_table_new(drmmode->fd,
+			drmmode_crtc->crtc_id, DRM_MODE_OBJECT_CRTC, NULL);
+	drmmode_crtc_init_rotation(drmmode_crtc, drmmode_crtc->kms_props,
+			drmmode_crtc->crtc_id, DRM_MODE_OBJECT_CRTC);
 
 	INFO_MSG("Got CRTC: %d (id: %d)",
 			num, drmmode_crtc->crtc_id);
@@ -1004,18 +3420,61 @@ drmmode_crtc_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode, int num)
 	return;
 }
 
+/*
+ * Read a connector as the kernel last probed it, without probing it again,
+ * which can take a slow DDC read. Older libdrm can only probe.
+ */
+static drmModeConnectorPtr
+drmmode_get_connector_current(int fd, uint32_t connector_id)
+{
+#ifdef HAVE_DRM_GET_CONNECTOR_CURRENT
+	return drmModeGetConnectorCurrent(fd, connector_id);
+#else
+	return drmModeGetConnector(fd, connector_id);
+#endif
+}
+
+/* The id of the EDID blob of connector, 0 if it has none */
+static uint64_t
+drmmode_connector_edid(struct drmmode_output_priv *drmmode_output,
+		drmModeConnectorPtr connector)
+{
+	drmModePropertyPtr prop;
+	uint64_t edid;
+
+	prop = drmmode_prop_find(drmmode_output->kms_props, "EDID");
+	if (!prop || !(prop->flags & DRM_MODE_PROP_BLOB) ||
+	    !drmmode_prop_value(connector->props, connector->prop_values,
+			connector->count_props, prop, &edid))
+		return 0;
+
+	return edid;
+}
+
 static xf86OutputStatus
 drmmode_output_detect(xf86OutputPtr output)
 {
-	/* go to the hw and retrieve a new output struct */
 	struct drmmode_output_priv *drmmode_output = output->driver_private;
 	struct drmmode_rec *drmmode = drmmode_output->drmmode;
 	xf86OutputStatus status;
-	drmModeFreeConnector(drmmode_output->connector);
 
-	drmmode_output->connector =
-			drmModeGetConnector(drmmode->fd,
-					drmmode_output->output_id);
+	/* Probing for a hotplug event, or on a fast startup, leaves the
+	 * connectors which didn't change as they are, otherwise go to the
+	 * hw and retrieve a new output struct.
+	 */
+	if (!drmmode->probe_changed_only || drmmode_output->changed) {
+		drmModeFreeConnector(drmmode_output->connector);
+
+		drmmode_output->connector =
+				drmModeGetConnector(drmmode->fd,
+						drmmode_output->output_id);
+
+		/* A hotplug can bring properties along, e.g. on DisplayPort */
+		drmmode_prop_table_add(drmmode_output->kms_props,
+				drmmode_output->connector->props,
+				drmmode_output->connector->count_props);
+		drmmode_output->changed = FALSE;
+	}
 
 	switch (drmmode_output->connector->connection) {
 	case DRM_MODE_CONNECTED:
@@ -1042,6 +3501,17 @@ drmmode_output_mode_valid(xf86OutputPtr output, DisplayModePtr mode)
 	return MODE_OK;
 }
 
+/* Forget the modes drmmode_output_get_modes() last built */
+static void
+drmmode_output_free_modes(struct drmmode_output_priv *drmmode_output)
+{
+	while (drmmode_output->modes)
+		xf86DeleteMode(&drmmode_output->modes, drmmode_output->modes);
+	free(drmmode_output->kmodes);
+	drmmode_output->kmodes = NULL;
+	drmmode_output->count_kmodes = 0;
+}
+
 static DisplayModePtr
 drmmode_output_get_modes(xf86OutputPtr output)
 {
@@ -1049,9 +3519,12 @@ drmmode_output_get_modes(xf86OutputPtr output)
 	struct drmmode_output_priv *drmmode_output = output->driver_private;
 	drmModeConnectorPtr connector = drmmode_output->connector;
 	struct drmmode_rec *drmmode = drmmode_output->drmmode;
+	struct drmmode_crtc_private_rec *drmmode_crtc;
 	DisplayModePtr modes = NULL;
-	drmModePropertyPtr prop;
+	drmModePropertyBlobPtr blob;
 	xf86MonPtr ddc_mon = NULL;
+	Bool edid_changed = FALSE;
+	uint64_t edid;
 	int i;
 	int xu = 0, yu = 0;
 
@@ -1059,29 +3532,44 @@ drmmode_output_get_modes(xf86OutputPtr output)
 	if (connector->encoder_id > 0) {
 		drmModeEncoderPtr enc;
 		enc = drmModeGetEncoder(drmmode->fd, connector->encoder_id);
-		if (enc)
-			drmmode_get_underscan(drmmode->fd, enc->crtc_id, &xu, &yu);
+		if (enc) {
+			drmmode_crtc = drmmode_crtc_from_id(pScrn, enc->crtc_id);
+			if (drmmode_crtc)
+				drmmode_get_underscan(drmmode_crtc, &xu, &yu);
+			drmModeFreeEncoder(enc);
+		}
 	}
 
-	/* look for an EDID property */
-	for (i = 0; i < connector->count_props; i++) {
-		prop = drmModeGetProperty(drmmode->fd, connector->props[i]);
-		if (!prop)
-			continue;
-
-		if ((prop->flags & DRM_MODE_PROP_BLOB) &&
-		    !strcmp(prop->name, "EDID")) {
+	/* look for an EDID property. The kernel makes a new blob on every
+	 * probe, but the same monitor needn't be interpreted again.
+	 */
+	edid = drmmode_connector_edid(drmmode_output, connector);
+	if (edid) {
+		blob = drmModeGetPropertyBlob(drmmode->fd, edid);
+		if (blob && drmmode_output->edid_blob &&
+		    blob->length == drmmode_output->edid_blob->length &&
+		    !memcmp(blob->data, drmmode_output->edid_blob->data,
+				blob->length)) {
+			drmModeFreePropertyBlob(blob);
+		} else {
 			if (drmmode_output->edid_blob)
 				drmModeFreePropertyBlob(
 						drmmode_output->edid_blob);
-			drmmode_output->edid_blob =
-					drmModeGetPropertyBlob(drmmode->fd,
-						connector->prop_values[i]);
+			drmmode_output->edid_blob = blob;
+			edid_changed = TRUE;
 		}
-		drmModeFreeProperty(prop);
+	} else if (drmmode_output->edid_blob) {
+		/* the monitor went, or the new one has no EDID: forget the
+		 * old one's rather than interpret it again below
+		 */
+		drmModeFreePropertyBlob(drmmode_output->edid_blob);
+		drmmode_output->edid_blob = NULL;
+		edid_changed = TRUE;
+		xf86OutputSetEDID(output, NULL);
 	}
 
-	if (drmmode_output->edid_blob)
+	/* The X server forgets the monitor when it is disconnected */
+	if ((edid_changed || !output->MonInfo) && drmmode_output->edid_blob)
 		ddc_mon = xf86InterpretEDID(pScrn->scrnIndex,
 				drmmode_output->edid_blob->data);
 
@@ -1094,6 +3582,14 @@ drmmode_output_get_modes(xf86OutputPtr output)
 
 	DEBUG_MSG("count_modes: %d", connector->count_modes);
 
+	/* The same monitor with the same kernel modes gets the same list */
+	if (!edid_changed && drmmode_output->modes &&
+	    drmmode_output->modes_xu == xu && drmmode_output->modes_yu == yu &&
+	    drmmode_output->count_kmodes == connector->count_modes &&
+	    !memcmp(drmmode_output->kmodes, connector->modes,
+			connector->count_modes * sizeof(*connector->modes)))
+		return xf86DuplicateModes(pScrn, drmmode_output->modes);
+
 	/* modes should already be available */
 	for (i = 0; i < connector->count_modes; i++) {
 		DisplayModePtr mode = xnfalloc(sizeof(DisplayModeRec));
@@ -1101,6 +3597,20 @@ drmmode_output_get_modes(xf86OutputPtr output)
 		drmmode_ConvertFromKMode(pScrn, &connector->modes[i], mode, xu, yu);
 		modes = xf86ModesAdd(modes, mode);
 	}
+
+	drmmode_output_free_modes(drmmode_output);
+	drmmode_output->kmodes = malloc(connector->count_modes *
+			sizeof(*connector->modes));
+	if (drmmode_output->kmodes) {
+		memcpy(drmmode_output->kmodes, connector->modes,
+				connector->count_modes *
+				sizeof(*connector->modes));
+		drmmode_output->count_kmodes = connector->count_modes;
+		drmmode_output->modes_xu = xu;
+		drmmode_output->modes_yu = yu;
+		drmmode_output->modes = xf86DuplicateModes(pScrn, modes);
+	}
+
 	return modes;
 }
 
@@ -1112,12 +3622,13 @@ drmmode_output_destroy(xf86OutputPtr output)
 
 	if (drmmode_output->edid_blob)
 		drmModeFreePropertyBlob(drmmode_output->edid_blob);
+	drmmode_output_free_modes(drmmode_output);
 
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		drmModeFreeProperty(drmmode_output->props[i].mode_prop);
+	/* The drmModeProperty of each belongs to a property table */
+	for (i = 0; i < drmmode_output->num_props; i++)
 		free(drmmode_output->props[i].atoms);
-	}
 	free(drmmode_output->props);
+	drmmode_prop_table_free(drmmode_output->kms_props);
 
 	for (i = 0; i < drmmode_output->connector->count_encoders; i++)
 		drmModeFreeEncoder(drmmode_output->encoders[i]);
@@ -1136,26 +3647,13 @@ drmmode_output_dpms(xf86OutputPtr output, int mode)
 	drmModeConnectorPtr connector = drmmode_output->connector;
 	drmModePropertyPtr prop;
 	struct drmmode_rec *drmmode = drmmode_output->drmmode;
-	int mode_id = -1, i;
 
-	for (i = 0; i < connector->count_props; i++) {
-		prop = drmModeGetProperty(drmmode->fd, connector->props[i]);
-		if (!prop)
-			continue;
-		if ((prop->flags & DRM_MODE_PROP_ENUM) &&
-		    !strcmp(prop->name, "DPMS")) {
-			mode_id = connector->props[i];
-			drmModeFreeProperty(prop);
-			break;
-		}
-		drmModeFreeProperty(prop);
-	}
-
-	if (mode_id < 0)
+	prop = drmmode_prop_find(drmmode_output->kms_props, "DPMS");
+	if (!prop || !(prop->flags & DRM_MODE_PROP_ENUM))
 		return;
 
 	drmModeConnectorSetProperty(drmmode->fd, connector->connector_id,
-			mode_id, mode);
+			prop->prop_id, mode);
 }
 
 static Bool
@@ -1210,15 +3708,29 @@ drmmode_output_create_resources(xf86OutputPtr output)
 	uint32_t value;
 	int i, j, err;
 	drmModeEncoderPtr enc;
-	drmModeObjectPropertiesPtr crtcprops;
+	struct drmmode_crtc_private_rec *drmmode_crtc = NULL;
+	drmModeObjectPropertiesPtr crtcprops = NULL;
 	int n_crtcprops;
 
+	/* With FastStartup, a connector left disconnected gets its
+	 * properties once its probe, put off until after startup, has run,
+	 * see drmmode_hotplug_probe()
+	 */
+	if (drmmode_output->deferred)
+		return;
+
 	enc = drmModeGetEncoder(drmmode->fd, connector->encoder_id);
+	if (enc) {
+		drmmode_crtc = drmmode_crtc_from_id(output->scrn, enc->crtc_id);
+		drmModeFreeEncoder(enc);
+	}
 
 	drmmode_output->num_props++;
 
-	if (enc) {
-		crtcprops = drmModeObjectGetProperties(drmmode->fd, enc->crtc_id, DRM_MODE_OBJECT_CRTC);
+	if (drmmode_crtc)
+		crtcprops = drmModeObjectGetProperties(drmmode->fd,
+				drmmode_crtc->crtc_id, DRM_MODE_OBJECT_CRTC);
+	if (crtcprops) {
 		n_crtcprops = crtcprops->count_props;
 	} else {
 		crtcprops = NULL;
@@ -1235,12 +3747,10 @@ drmmode_output_create_resources(xf86OutputPtr output)
 
 	drmmode_output->num_props = 0;
 	for (i = 0; i < connector->count_props; i++) {
-		drmmode_prop = drmModeGetProperty(drmmode->fd,
+		drmmode_prop = drmmode_prop_find_id(drmmode_output->kms_props,
 			connector->props[i]);
-		if (drmmode_property_ignore(drmmode_prop)) {
-			drmModeFreeProperty(drmmode_prop);
+		if (drmmode_property_ignore(drmmode_prop))
 			continue;
-		}
 		drmmode_output->props[drmmode_output->num_props].mode_prop =
 				drmmode_prop;
 		drmmode_output->props[drmmode_output->num_props].index = i;
@@ -1252,17 +3762,15 @@ drmmode_output_create_resources(xf86OutputPtr output)
 	}
 
 	for (i = 0; i < n_crtcprops; i++) {
-		drmmode_prop = drmModeGetProperty(drmmode->fd,
+		drmmode_prop = drmmode_prop_find_id(drmmode_crtc->kms_props,
 			crtcprops->props[i]);
 
-		if (drmmode_property_ignore(drmmode_prop)) {
-			drmModeFreeProperty(drmmode_prop);
+		if (drmmode_property_ignore(drmmode_prop))
 			continue;
-		}
 		drmmode_output->props[drmmode_output->num_props].mode_prop =
 				drmmode_prop;
 		drmmode_output->props[drmmode_output->num_props].index = i;
-		drmmode_output->props[drmmode_output->num_props].drm_object_id = enc->crtc_id;
+		drmmode_output->props[drmmode_output->num_props].drm_object_id = drmmode_crtc->crtc_id;
 		drmmode_output->props[drmmode_output->num_props].drm_object =
 				DRM_MODE_OBJECT_CRTC;
 
@@ -1506,7 +4014,13 @@ drmmode_output_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode, int num)
 
 	TRACE_ENTER();
 
-	connector = drmModeGetConnector(drmmode->fd, drmmode->mode_res->connectors[num]);
+	/* A fast startup only probes the connectors found connected */
+	if (ARMSOCPTR(pScrn)->fastStartup)
+		connector = drmmode_get_connector_current(drmmode->fd,
+				drmmode->mode_res->connectors[num]);
+	else
+		connector = drmModeGetConnector(drmmode->fd,
+				drmmode->mode_res->connectors[num]);
 	if (!connector)
 		goto exit;
 
@@ -1539,6 +4053,14 @@ drmmode_output_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode, int num)
 	drmmode_output->connector = connector;
 	drmmode_output->encoders = encoders;
 	drmmode_output->drmmode = drmmode;
+	drmmode_output->kms_props = drmmode_prop_table_new(drmmode->fd,
+			connector->connector_id, DRM_MODE_OBJECT_CONNECTOR,
+			NULL);
+	if (ARMSOCPTR(pScrn)->fastStartup) {
+		drmmode_output->deferred =
+				connector->connection == DRM_MODE_DISCONNECTED;
+		drmmode_output->changed = !drmmode_output->deferred;
+	}
 
 	output->mm_width = connector->mmWidth;
 	output->mm_height = connector->mmHeight;
@@ -1627,20 +4149,71 @@ drmmode_clones_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode)
 	}
 }
 
-void set_scanout_bo(ScrnInfoPtr pScrn, struct armsoc_bo *bo)
+/**
+ * Record that bo is now scanned out: as the root scanout buffer if crtc is
+ * NULL, or by that CRTC alone otherwise. The latter is ignored if the CRTC
+ * has been put back on the root since the flip was queued.
+ */
+void set_scanout_bo(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+		struct armsoc_bo *bo)
 {
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	struct armsoc_bo *old_bo = pARMSOC->scanout;
+	struct armsoc_bo **scanout = &pARMSOC->scanout;
+	struct armsoc_bo *old_bo;
 
 	/* It had better have a framebuffer if we're scanning it out */
 	assert(armsoc_bo_get_fb(bo));
 
+	if (crtc) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
+
+		if (drmmode_crtc->flip_bo == bo) {
+			armsoc_bo_unreference(drmmode_crtc->flip_bo);
+			drmmode_crtc->flip_bo = NULL;
+		}
+
+		if (!drmmode_crtc->scanout_bo)
+			return;
+
+		scanout = &drmmode_crtc->scanout_bo;
+	}
+
+	old_bo = *scanout;
 	armsoc_bo_reference(bo);
-	pARMSOC->scanout = bo;
+	*scanout = bo;
 	armsoc_bo_unreference(old_bo);
 }
 
-static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
+/*
+ * Clear the part of a reshaped scanout bo outside the old_width x
+ * old_height area it showed before, the rest of which is still in place.
+ */
+static void
+clear_exposed_scanout(ScrnInfoPtr pScrn, struct armsoc_bo *bo,
+		int old_width, int old_height)
+{
+	int width = armsoc_bo_width(bo), height = armsoc_bo_height(bo);
+
+	if (old_width < width &&
+	    armsoc_bo_clear_area(bo, old_width, 0, width - old_width,
+			min(old_height, height)))
+		ERROR_MSG("Couldn't clear the scanout bo");
+	if (old_height < height &&
+	    armsoc_bo_clear_area(bo, 0, old_height, width,
+			height - old_height))
+		ERROR_MSG("Couldn't clear the scanout bo");
+}
+
+/*
+ * Resize the root scanout buffer. It is reshaped in place when its memory
+ * is large enough, keeping the high-water allocation across mode switches,
+ * and only the newly visible area is cleared. The framebuffer the root had
+ * before is then returned in old_fb_id, for the caller to remove once no
+ * CRTC scans it out. Otherwise a buffer of the new size replaces it.
+ */
+static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height,
+		uint32_t *old_fb_id)
 {
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
 	ScreenPtr pScreen = pScrn->pScreen;
@@ -1651,48 +4224,38 @@ static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
 
 	pScrn->virtualX = width;
 	pScrn->virtualY = height;
+	*old_fb_id = 0;
 
 	if ((width != armsoc_bo_width(pARMSOC->scanout))
 	      || (height != armsoc_bo_height(pARMSOC->scanout))
 	      || (pScrn->bitsPerPixel != armsoc_bo_bpp(pARMSOC->scanout))) {
 		struct armsoc_bo *new_scanout;
-
-		/* allocate new scanout buffer */
-		new_scanout = armsoc_bo_new_with_dim(pARMSOC->dev,
-				width, height,
-				pScrn->bitsPerPixel, pScrn->bitsPerPixel,
-				ARMSOC_BO_SCANOUT);
-		if (!new_scanout) {
-			/* Try to use the previous buffer if the new resolution
-			 * is smaller than the one on buffer creation
-			 */
-			DEBUG_MSG(
-					"allocate new scanout buffer failed - resizing existing bo");
-			/* Remove the old fb from the bo */
-			if (armsoc_bo_rm_fb(pARMSOC->scanout))
-				return FALSE;
-
-			/* Resize the bo */
-			if (armsoc_bo_resize(pARMSOC->scanout, width, height)) {
-				armsoc_bo_clear(pARMSOC->scanout);
-				if (armsoc_bo_add_fb(pARMSOC->scanout))
-					ERROR_MSG(
-							"Failed to add framebuffer to the existing scanout buffer");
-				return FALSE;
-			}
-
-			/* Add new fb to the bo */
-			if (armsoc_bo_clear(pARMSOC->scanout))
-				return FALSE;
-
-			if (armsoc_bo_add_fb(pARMSOC->scanout)) {
+		int old_width = armsoc_bo_width(pARMSOC->scanout);
+		int old_height = armsoc_bo_height(pARMSOC->scanout);
+
+		if (pScrn->bitsPerPixel == armsoc_bo_bpp(pARMSOC->scanout) &&
+		    !armsoc_bo_reshape(pARMSOC->scanout, width, height,
+				old_fb_id)) {
+			DEBUG_MSG("reshaped the existing scanout buffer");
+			clear_exposed_scanout(pScrn, pARMSOC->scanout,
+					old_width, old_height);
+			pitch = armsoc_bo_pitch(pARMSOC->scanout);
+		} else {
+			/* allocate new scanout buffer */
+			new_scanout = armsoc_bo_new_with_dim(pARMSOC->dev,
+					width, height,
+					pScrn->bitsPerPixel,
+					pScrn->bitsPerPixel,
+					pARMSOC->perCrtcScanout ?
+					ARMSOC_BO_NON_SCANOUT :
+					ARMSOC_BO_SCANOUT);
+			if (!new_scanout) {
 				ERROR_MSG(
-						"Failed to add framebuffer to the existing scanout buffer");
+						"Failed to allocate a %dx%d scanout buffer",
+						width, height);
 				return FALSE;
 			}
-
-			pitch = armsoc_bo_pitch(pARMSOC->scanout);
-		} else {
+
 			DEBUG_MSG("allocated new scanout buffer okay");
 			pitch = armsoc_bo_pitch(new_scanout);
 			/* clear new BO and add FB */
@@ -1701,7 +4264,8 @@ static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
 				return FALSE;
 			}
 
-			if (armsoc_bo_add_fb(new_scanout)) {
+			if (!pARMSOC->perCrtcScanout &&
+			    armsoc_bo_add_fb(new_scanout)) {
 				ERROR_MSG(
 						"Failed to add framebuffer to the new scanout buffer");
 				armsoc_bo_unreference(new_scanout);
@@ -1723,7 +4287,7 @@ static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
 				}
 			}
 			/* use new scanout buffer */
-			set_scanout_bo(pScrn, new_scanout);
+			set_scanout_bo(pScrn, NULL, new_scanout);
 			/* set_scanout_bo takes its own reference,
 			 * we have no other hold on this. */
 			armsoc_bo_unreference(new_scanout);
@@ -1762,30 +4326,50 @@ drmmode_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height)
 	int i;
 	xf86CrtcConfigPtr xf86_config;
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	uint32_t fb_id, old_fb_id;
 
 	TRACE_ENTER();
 
-	/* FIXME: is there a correct way to handle a resolution change request
-	 * if we're in the middle of a page flip? */
-	while (pARMSOC->pending_flips > 0)
+	/* A page flip of the root still in flight would put a buffer of
+	 * the old size back on it once complete. Other swaps don't mind.
+	 */
+	while (drmmode->root_flips > 0)
 		drmmode_wait_for_event(pScrn);
 
-	if (!resize_scanout_bo(pScrn, width, height))
+	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+	if (!resize_scanout_bo(pScrn, width, height, &old_fb_id))
 		return FALSE;
 
+	if (armsoc_bo_get_fb(pARMSOC->scanout) == fb_id) {
+		TRACE_EXIT();
+		return TRUE;
+	}
+
 	/* Framebuffer needs to be reset on all CRTCs, not just
-	 * those that have repositioned */
+	 * those that have repositioned. Those which keep their mode only
+	 * need the new one, those the driver rotates not even that.
+	 */
 	xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
 	for (i = 0; i < xf86_config->num_crtc; i++) {
 		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
 
-		if (!crtc->enabled)
+		if (!drmmode_crtc_on(crtc) || drmmode_crtc->copy_bo)
 			continue;
 
-		drmmode_set_mode_major(crtc, &crtc->mode,
-				crtc->rotation, crtc->x, crtc->y);
+		if (!pScrn->vtSema || drmmode_crtc->scanout_bo ||
+		    drmmode_crtc_set_fb(crtc,
+				armsoc_bo_get_fb(pARMSOC->scanout),
+				crtc->x, crtc->y, FALSE))
+			drmmode_set_mode_major(crtc, &crtc->mode,
+					crtc->rotation, crtc->x, crtc->y);
 	}
 
+	if (old_fb_id)
+		drmModeRmFB(drmmode->fd, old_fb_id);
+
 	TRACE_EXIT();
 	return TRUE;
 }
@@ -1795,13 +4379,137 @@ static const xf86CrtcConfigFuncsRec drmmode_xf86crtc_config_funcs = {
 };
 
 
+#ifdef HAVE_DRM_ATOMIC
+/*
+ * Use atomic commits for mode sets and page flips if the kernel supports
+ * them and exposes every property they need, so that flips of several
+ * CRTCs are all or nothing and mode sets are validated before they are
+ * applied.
+ */
+static void
+drmmode_atomic_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmModePlaneResPtr plane_res;
+	uint32_t j;
+	int i;
+
+	if (drmSetClientCap(drmmode->fd, DRM_CLIENT_CAP_ATOMIC, 1))
+		return;
+
+	plane_res = drmModeGetPlaneResources(drmmode->fd);
+	if (!plane_res)
+		goto fail;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		for (j = 0; j < plane_res->count_planes &&
+				!drmmode_crtc->primary_plane_id; j++) {
+			drmModePlanePtr plane = drmModeGetPlane(drmmode->fd,
+					plane_res->planes[j]);
+			struct drmmode_prop_table *props;
+			drmModeObjectPropertiesPtr values;
+			uint64_t type = 0;
+
+			if (!plane)
+				continue;
+
+			if (!(plane->possible_crtcs & (1 << drmmode_crtc->pipe))) {
+				drmModeFreePlane(plane);
+				continue;
+			}
+
+			props = drmmode_prop_table_new(drmmode->fd,
+					plane->plane_id, DRM_MODE_OBJECT_PLANE,
+					&values);
+			if (props) {
+				if (drmmode_prop_value(values->props,
+						values->prop_values,
+						values->count_props,
+						drmmode_prop_find(props, "type"),
+						&type) &&
+				    type == DRM_PLANE_TYPE_PRIMARY &&
+				    drmmode_plane_props_init(props,
+						&drmmode_crtc->primary)) {
+					drmmode_crtc->primary_plane_id =
+							plane->plane_id;
+					/* its rotation replaces the CRTC's */
+					drmmode_crtc_init_rotation(
+						drmmode_crtc, props,
+						plane->plane_id,
+						DRM_MODE_OBJECT_PLANE);
+				}
+
+				drmModeFreeObjectProperties(values);
+				drmmode_prop_table_free(props);
+			}
+			drmModeFreePlane(plane);
+		}
+
+		drmmode_crtc->mode_id_prop = drmmode_prop_table_id(
+				drmmode_crtc->kms_props, "MODE_ID");
+		drmmode_crtc->active_prop = drmmode_prop_table_id(
+				drmmode_crtc->kms_props, "ACTIVE");
+
+		if (!drmmode_crtc->primary_plane_id ||
+		    !drmmode_crtc->mode_id_prop || !drmmode_crtc->active_prop) {
+			drmModeFreePlaneResources(plane_res);
+			goto fail;
+		}
+	}
+
+	drmModeFreePlaneResources(plane_res);
+
+	for (i = 0; i < config->num_output; i++) {
+		struct drmmode_output_priv *drmmode_output =
+				config->output[i]->driver_private;
+
+		drmmode_output->crtc_id_prop = drmmode_prop_table_id(
+				drmmode_output->kms_props, "CRTC_ID");
+		if (!drmmode_output->crtc_id_prop)
+			goto fail;
+	}
+
+	drmmode->atomic = TRUE;
+	INFO_MSG("Using atomic commits for mode sets and page flips");
+	return;
+
+fail:
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		drmmode_crtc->primary_plane_id = 0;
+		memset(&drmmode_crtc->primary, 0,
+				sizeof(drmmode_crtc->primary));
+		drmmode_crtc->mode_id_prop = 0;
+		drmmode_crtc->active_prop = 0;
+		if (drmmode_crtc->rotation_obj_type == DRM_MODE_OBJECT_PLANE) {
+			drmmode_crtc->rotation_prop = 0;
+			drmmode_crtc->hw_rotations = 0;
+			drmmode_crtc_init_rotation(drmmode_crtc,
+					drmmode_crtc->kms_props,
+					drmmode_crtc->crtc_id,
+					DRM_MODE_OBJECT_CRTC);
+		}
+	}
+
+	drmSetClientCap(drmmode->fd, DRM_CLIENT_CAP_ATOMIC, 0);
+}
+#endif
+
 Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp)
 {
 	struct drmmode_rec *drmmode;
+	uint64_t t[5];
 	int i;
 
 	TRACE_ENTER();
 
+	t[0] = armsoc_monotonic_ns();
+
 	drmmode = calloc(1, sizeof *drmmode);
 	if (!drmmode)
 		return FALSE;
@@ -1831,8 +4539,18 @@ Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp)
 				drmmode->mode_res->max_width,
 				drmmode->mode_res->max_height);
 	}
-	xf86CrtcSetSizeRange(pScrn, 320, 200, drmmode->mode_res->max_width,
-			drmmode->mode_res->max_height);
+	t[1] = armsoc_monotonic_ns();
+
+	if (ARMSOCPTR(pScrn)->perCrtcScanout)
+		xf86CrtcSetSizeRange(pScrn, 320, 200,
+				max(drmmode->mode_res->max_width,
+					ARMSOC_PER_CRTC_MAX_SIZE),
+				max(drmmode->mode_res->max_height,
+					ARMSOC_PER_CRTC_MAX_SIZE));
+	else
+		xf86CrtcSetSizeRange(pScrn, 320, 200,
+				drmmode->mode_res->max_width,
+				drmmode->mode_res->max_height);
 
 	if (ARMSOCPTR(pScrn)->crtcNum == -1) {
 		INFO_MSG("Adding all CRTCs");
@@ -1858,8 +4576,25 @@ Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp)
 			drmmode_output_init(pScrn, drmmode, i);
 	}
 	drmmode_clones_init(pScrn, drmmode);
+	t[2] = armsoc_monotonic_ns();
+
+#ifdef HAVE_DRM_ATOMIC
+	drmmode_atomic_init(pScrn, drmmode);
+#endif
+	t[3] = armsoc_monotonic_ns();
 
+	/* A fast startup probes the connectors found connected alone */
+	drmmode->probe_changed_only = ARMSOCPTR(pScrn)->fastStartup;
 	xf86InitialConfiguration(pScrn, TRUE);
+	drmmode->probe_changed_only = FALSE;
+	t[4] = armsoc_monotonic_ns();
+
+	INFO_MSG("KMS setup took %u ms: resources %u, CRTCs and outputs %u, atomic %u, initial configuration %u",
+			(unsigned)((t[4] - t[0]) / 1000000),
+			(unsigned)((t[1] - t[0]) / 1000000),
+			(unsigned)((t[2] - t[1]) / 1000000),
+			(unsigned)((t[3] - t[2]) / 1000000),
+			(unsigned)((t[4] - t[3]) / 1000000));
 
 	TRACE_EXIT();
 
@@ -1876,7 +4611,7 @@ drmmode_adjust_frame(ScrnInfoPtr pScrn, int x, int y)
 	if (!crtc || !crtc->enabled)
 		return;
 
-	drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation, x, y);
+	drmmode_set_origin(crtc, x, y);
 }
 
 /*
@@ -1887,7 +4622,24 @@ static void
 page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
 		unsigned int tv_usec, void *user_data)
 {
-	ARMSOCDRI2SwapComplete(user_data);
+	struct drmmode_flip *flip = user_data;
+
+	if (--flip->pending > 0)
+		return;
+
+#ifdef HAVE_DRM_ATOMIC
+	if (flip->atomic)
+		flip->atomic->flips_pending--;
+#endif
+	if (flip->root)
+		flip->root->root_flips--;
+
+	if (flip->aborted)
+		ARMSOCDRI2FlipAborted(flip->priv);
+	else
+		ARMSOCDRI2SwapComplete(flip->priv);
+
+	free(flip);
 }
 
 static void
@@ -1903,43 +4655,350 @@ static drmEventContext event_context = {
 		.vblank_handler = vblank_handler,
 };
 
-int
-drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv)
+#ifdef HAVE_DRM_ATOMIC
+/*
+ * Flip the primary planes of all enabled CRTCs in a single commit, which
+ * also carries the plane updates staged since the last one and the latest
+ * cursor state.
+ */
+static int
+drmmode_page_flip_atomic(ScrnInfoPtr pScrn, uint32_t fb_id, uint32_t flags,
+		struct drmmode_flip *flip)
 {
-	ScreenPtr pScreen = draw->pScreen;
-	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
 	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
-	struct drmmode_crtc_private_rec *crtc = config->crtc[0]->driver_private;
-	struct drmmode_rec *mode = crtc->drmmode;
-	int ret, i, failed = 0, num_flipped = 0;
-	unsigned int flags = 0;
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	drmModeAtomicReqPtr req;
+	uint32_t cursors = 0;
+	int mark, ret;
+	int i, num_flipped = 0;
 
-	if (pARMSOC->drmmode_interface->use_page_flip_events)
-		flags |= DRM_MODE_PAGE_FLIP_EVENT;
+	req = drmmode_atomic_pending(drmmode);
+	if (!req)
+		return -1;
+
+	mark = drmModeAtomicGetCursor(req);
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *crtc =
+				config->crtc[i]->driver_private;
+
+		if (drmmode_cursor_stage(config->crtc[i], req,
+				&crtc->cursor.staged))
+			cursors |= 1u << i;
+	}
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *crtc =
+				config->crtc[i]->driver_private;
+
+		if (!drmmode_crtc_on(config->crtc[i]) ||
+		    drmmode_crtc_shadowed(config->crtc[i]))
+			continue;
+
+		if (drmModeAtomicAddProperty(req, crtc->primary_plane_id,
+				crtc->primary.fb_id, fb_id) < 0) {
+			ret = -1;
+			goto out_rollback;
+		}
+		num_flipped++;
+	}
+
+	if (!num_flipped) {
+		ret = 0;
+		goto out_rollback;
+	}
+
+	if (drmModeAtomicCommit(drmmode->fd, req,
+			flags | DRM_MODE_ATOMIC_NONBLOCK, flip)) {
+		WARNING_MSG("atomic flip failed: %s", strerror(errno));
+		ret = -1;
+		goto out_rollback;
+	}
+
+	drmModeAtomicFree(req);
+	drmmode->pending = NULL;
+	drmmode_cursor_staged_shown(config, cursors);
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *crtc =
+				config->crtc[i]->driver_private;
+
+		crtc->pan_pending = FALSE;
+	}
+
+	if (flip) {
+		flip->pending = num_flipped;
+		flip->atomic = drmmode;
+		drmmode->flips_pending++;
+	}
+
+	return num_flipped;
+
+out_rollback:
+	/* keep the staged updates for drmmode_atomic_flush() */
+	drmModeAtomicSetCursor(req, mark);
+	for (i = 0; i < config->num_crtc; i++) {
+		if (cursors & (1u << i))
+			drmmode_cursor_restage(config->crtc[i]);
+	}
+	return ret;
+}
+
+/**
+ * Commit the plane updates staged since the last commit, along with any
+ * cursor update the input thread couldn't commit itself. While an atomic
+ * page flip is in flight they are left for the next one instead, so that
+ * a frame takes a single commit. If the commit fails, the CRTCs it was to
+ * pan are moved with a mode set instead.
+ */
+void
+drmmode_atomic_flush(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	uint32_t cursors = 0;
+	Bool failed = FALSE;
+	int i;
+
+	if (!drmmode->atomic || drmmode->flips_pending || !pScrn->vtSema)
+		return;
+
+	if (!drmmode_atomic_pending(drmmode))
+		return;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *crtc =
+				config->crtc[i]->driver_private;
+
+		if (drmmode_cursor_stage(config->crtc[i], drmmode->pending,
+				&crtc->cursor.staged))
+			cursors |= 1u << i;
+	}
+
+	if (!drmModeAtomicGetCursor(drmmode->pending))
+		return;
+
+	/* A commit still in flight makes the kernel refuse a nonblocking
+	 * one; then wait for it rather than let the updates pile up.
+	 */
+	if (drmModeAtomicCommit(drmmode->fd, drmmode->pending,
+			DRM_MODE_ATOMIC_NONBLOCK, NULL) &&
+	    (errno != EBUSY ||
+	     drmModeAtomicCommit(drmmode->fd, drmmode->pending, 0, NULL))) {
+		WARNING_MSG("atomic plane update failed: %s", strerror(errno));
+		failed = TRUE;
+	} else
+		drmmode_cursor_staged_shown(config, cursors);
+
+	drmModeAtomicFree(drmmode->pending);
+	drmmode->pending = NULL;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
+
+		if (failed && drmmode_crtc->pan_pending)
+			drmmode_set_mode_major(crtc, &crtc->mode,
+					crtc->rotation, crtc->x, crtc->y);
+		drmmode_crtc->pan_pending = FALSE;
+	}
+}
+#else
+void
+drmmode_atomic_flush(ScrnInfoPtr pScrn)
+{
+}
+#endif
+
+/*
+ * Flip the enabled CRTCs one by one. If one of them fails, those already
+ * flipped are put back on the root, so that all heads show the same frame.
+ */
+static int
+drmmode_page_flip_legacy(ScrnInfoPtr pScrn, uint32_t fb_id, uint32_t flags,
+		struct drmmode_flip *flip)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_crtc_private_rec *crtc;
+	int ret, i, j, num_flipped = 0;
 
-	/* if we can flip, we must be fullscreen.. so flip all CRTC's.. */
 	for (i = 0; i < config->num_crtc; i++) {
 		crtc = config->crtc[i]->driver_private;
 
-		if (!config->crtc[i]->enabled)
+		if (!drmmode_crtc_on(config->crtc[i]) ||
+		    drmmode_crtc_shadowed(config->crtc[i]))
 			continue;
 
-		ret = drmModePageFlip(mode->fd, crtc->crtc_id,
-				fb_id, flags, priv);
+		ret = drmModePageFlip(crtc->drmmode->fd, crtc->crtc_id,
+				fb_id, flags, flip);
 		if (ret) {
-			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
-					"flip queue failed: %s\n",
-					strerror(errno));
-			failed = 1;
-		} else
-			num_flipped += 1;
+			WARNING_MSG("flip queue failed: %s", strerror(errno));
+			break;
+		}
+		num_flipped++;
+	}
+
+	if (i < config->num_crtc) {
+		for (j = 0; j < i; j++) {
+			if (!drmmode_crtc_on(config->crtc[j]) ||
+			    drmmode_crtc_shadowed(config->crtc[j]))
+				continue;
+
+			if (drmmode_crtc_set_fb(config->crtc[j],
+					armsoc_bo_get_fb(pARMSOC->scanout),
+					config->crtc[j]->x, config->crtc[j]->y,
+					FALSE))
+				ERROR_MSG("failed to roll back the flip of CRTC %d: %s",
+						j, strerror(errno));
+		}
+
+		/* The events of the CRTCs which did flip are still due */
+		if (!flip || !num_flipped)
+			return -1;
+
+		flip->aborted = TRUE;
+	}
+
+	if (flip)
+		flip->pending = num_flipped;
+
+	return num_flipped;
+}
+
+/**
+ * Flip all enabled CRTCs to fb_id, which must be the size of the root,
+ * save those scanning out a shadow or copy and those turned off by DPMS.
+ * If none is left, fail so that the swap copies to the root instead.
+ *
+ * Returns the number of CRTCs flipped, 0 if none is enabled, or a negative
+ * value if the flip failed and the screen was left as it was. When page
+ * flip events are used, a successful flip completes with
+ * ARMSOCDRI2SwapComplete(priv), or ARMSOCDRI2FlipAborted(priv) if it had to
+ * be rolled back after some CRTCs had flipped.
+ */
+int
+drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv)
+{
+	ScreenPtr pScreen = draw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_flip *flip = NULL;
+	uint32_t flags = 0;
+	int ret;
+
+	if (drmmode_root_shadowed(pScrn))
+		return -1;
+
+	if (pARMSOC->drmmode_interface->use_page_flip_events) {
+		flip = drmmode_flip_new(priv);
+		if (!flip)
+			return -1;
+		flags |= DRM_MODE_PAGE_FLIP_EVENT;
 	}
 
-	if (failed)
-		return -(num_flipped + 1);
+#ifdef HAVE_DRM_ATOMIC
+	if (drmmode_from_scrn(pScrn)->atomic)
+		ret = drmmode_page_flip_atomic(pScrn, fb_id, flags, flip);
 	else
-		return num_flipped;
+#endif
+		ret = drmmode_page_flip_legacy(pScrn, fb_id, flags, flip);
+
+	if (ret <= 0) {
+		free(flip);
+	} else if (flip) {
+		flip->root = drmmode_from_scrn(pScrn);
+		flip->root->root_flips++;
+	}
+
+	return ret;
+}
+
+/* Time without hotplug events after which the outputs are probed */
+#define ARMSOC_HOTPLUG_SETTLE_MS	200
+
+/*
+ * Probe the outputs once a burst of hotplug events, such as a flaky cable
+ * makes, has settled. The connectors are read as the kernel last probed
+ * them first: only those whose connection or EDID changed since, or which
+ * an event named, are probed again, and RandR is only told if any did.
+ *
+ * This also runs once the screen is up after a fast startup, to set up the
+ * connectors which were disconnected then.
+ */
+static void
+drmmode_hotplug_probe(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	drmModeConnectorPtr current;
+	uint64_t start = armsoc_monotonic_ns();
+	int i, changed = 0, deferred = 0;
+
+	for (i = 0; i < config->num_output; i++) {
+		struct drmmode_output_priv *drmmode_output =
+				config->output[i]->driver_private;
+		drmModeConnectorPtr connector = drmmode_output->connector;
+
+		if (drmmode_output->deferred) {
+			drmmode_output->deferred = FALSE;
+			drmmode_output_create_resources(config->output[i]);
+			drmmode_output->changed = TRUE;
+			deferred++;
+		}
+
+		current = drmmode_get_connector_current(drmmode->fd,
+				drmmode_output->output_id);
+		if (!current || current->connection != connector->connection ||
+		    drmmode_connector_edid(drmmode_output, current) !=
+		    drmmode_connector_edid(drmmode_output, connector))
+			drmmode_output->changed = TRUE;
+		drmModeFreeConnector(current);
+
+		if (drmmode_output->changed)
+			changed++;
+	}
+
+	DEBUG_MSG("hotplug: %d of %d connectors changed", changed,
+			config->num_output);
+
+	if (changed) {
+		drmmode->probe_changed_only = TRUE;
+		RRGetInfo(xf86ScrnToScreen(pScrn), TRUE);
+		drmmode->probe_changed_only = FALSE;
+	}
+
+	if (deferred)
+		INFO_MSG("Set up %d connectors left disconnected at startup in %u ms",
+				deferred, (unsigned)
+				((armsoc_monotonic_ns() - start) / 1000000));
+}
+
+/*
+ * Timers run with the input lock held, which probing the outputs over DDC
+ * would hold for too long, stalling the input thread and the cursor. So
+ * the timer only asks for the probe, which drmmode_hotplug_handler() runs
+ * from the block handler.
+ */
+static CARD32
+drmmode_hotplug_timer(OsTimerPtr timer, CARD32 time, void *arg)
+{
+	ScrnInfoPtr pScrn = arg;
+
+	drmmode_from_scrn(pScrn)->hotplug_pending = TRUE;
+	return 0;
+}
+
+/* Probe the outputs if the hotplug timer fired, see drmmode_hotplug_probe() */
+void
+drmmode_hotplug_handler(ScrnInfoPtr pScrn)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+
+	if (!drmmode->hotplug_pending)
+		return;
+
+	drmmode->hotplug_pending = FALSE;
+	drmmode_hotplug_probe(pScrn);
 }
 
 /*
@@ -1952,11 +5011,13 @@ drmmode_handle_uevents(int fd, void *closure)
 {
 	ScrnInfoPtr pScrn = closure;
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
 	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
 	struct udev_device *dev;
-	const char *hotplug;
+	const char *hotplug, *connector;
 	struct stat s;
 	dev_t udev_devnum;
+	int i;
 
 	dev = udev_monitor_receive_device(drmmode->uevent_monitor);
 	if (!dev)
@@ -1975,13 +5036,27 @@ drmmode_handle_uevents(int fd, void *closure)
 	}
 
 	hotplug = udev_device_get_property_value(dev, "HOTPLUG");
+	connector = udev_device_get_property_value(dev, "CONNECTOR");
 
 	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "hotplug=%s, match=%d\n", hotplug,
 			!memcmp(&s.st_rdev, &udev_devnum, sizeof(dev_t)));
 
 	if (memcmp(&s.st_rdev, &udev_devnum, sizeof(dev_t)) == 0 &&
 			hotplug && atoi(hotplug) == 1) {
-		RRGetInfo(xf86ScrnToScreen(pScrn), TRUE);
+		/* The kernel names the connector an event is about, if
+		 * recent enough.
+		 */
+		for (i = 0; connector && i < config->num_output; i++) {
+			struct drmmode_output_priv *drmmode_output =
+					config->output[i]->driver_private;
+
+			if (drmmode_output->output_id == atoi(connector))
+				drmmode_output->changed = TRUE;
+		}
+
+		drmmode->hotplug_timer = TimerSet(drmmode->hotplug_timer, 0,
+				ARMSOC_HOTPLUG_SETTLE_MS, drmmode_hotplug_timer,
+				pScrn);
 	}
 	udev_device_unref(dev);
 }
@@ -2029,6 +5104,9 @@ drmmode_uevent_fini(ScrnInfoPtr pScrn)
 
 	TRACE_ENTER();
 
+	TimerFree(drmmode->hotplug_timer);
+	drmmode->hotplug_timer = NULL;
+
 	if (drmmode->uevent_handler) {
 		struct udev *u = udev_monitor_get_udev(drmmode->uevent_monitor);
 		xf86RemoveGeneralHandler(drmmode->uevent_handler);
@@ -2071,13 +5149,111 @@ drmmode_wait_for_event(ScrnInfoPtr pScrn)
 	drmHandleEvent(drmmode->fd, &event_context);
 }
 
+static void
+drmmode_redisplay_damage_fini(ScrnInfoPtr pScrn)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+
+	if (!drmmode->redisplay_damage)
+		return;
+
+#if XORG_VERSION_CURRENT < XORG_VERSION_NUMERIC(1, 14, 99, 2, 0)
+	DamageUnregister(
+		&pScrn->pScreen->GetScreenPixmap(pScrn->pScreen)->drawable,
+		drmmode->redisplay_damage);
+#else
+	DamageUnregister(drmmode->redisplay_damage);
+#endif
+	DamageDestroy(drmmode->redisplay_damage);
+	drmmode->redisplay_damage = NULL;
+}
+
+/**
+ * Bring the copies of the root the CRTCs scan out, rotated or not, up to
+ * date with it, redrawing only what was drawn since the last call. Called
+ * from the screen's block handler, like the X server's own shadow updates.
+ */
+void
+drmmode_redisplay(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	ScreenPtr pScreen = pScrn->pScreen;
+	RegionPtr damage = NULL;
+	uint64_t pixels, start;
+	int i, copies = 0;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (config->crtc[i]->enabled && drmmode_crtc->copy_bo)
+			copies++;
+	}
+
+	if (!copies) {
+		drmmode_redisplay_damage_fini(pScrn);
+		return;
+	}
+
+	/* Until the root is tracked, the copies are redrawn whole */
+	if (drmmode->redisplay_damage) {
+		damage = DamageRegion(drmmode->redisplay_damage);
+	} else {
+		drmmode->redisplay_damage = DamageCreate(NULL, NULL,
+				DamageReportNone, TRUE, pScreen, NULL);
+		if (!drmmode->redisplay_damage) {
+			ERROR_MSG("Couldn't track damage to the screen");
+			return;
+		}
+		DamageRegister(&pScreen->GetScreenPixmap(pScreen)->drawable,
+				drmmode->redisplay_damage);
+	}
+
+	if (!pScrn->vtSema)
+		return;
+
+	pixels = drmmode->redisplay_pixels;
+	start = armsoc_monotonic_ns();
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
+
+		if (drmmode_crtc_on(crtc) && drmmode_crtc->copy_bo &&
+		    !drmmode_crtc->scanout_bo)
+			drmmode_crtc_redisplay(crtc, damage);
+	}
+	if (drmmode->redisplay_pixels != pixels) {
+		drmmode->redisplays++;
+		drmmode->redisplay_ns += armsoc_monotonic_ns() - start;
+	}
+
+	DamageEmpty(drmmode->redisplay_damage);
+}
+
 void
 drmmode_screen_init(ScrnInfoPtr pScrn)
 {
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
 	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
 
 	drmmode_uevent_init(pScrn);
 
+	/* Set up the connectors a fast startup left alone once the server
+	 * has had the time to show the first frame. Like hotplug probes, this
+	 * runs from the block handler rather than the timer, which holds the
+	 * input lock, see drmmode_hotplug_handler().
+	 */
+	if (pARMSOC->fastStartup)
+		drmmode->hotplug_timer = TimerSet(drmmode->hotplug_timer, 0,
+				ARMSOC_HOTPLUG_SETTLE_MS, drmmode_hotplug_timer,
+				pScrn);
+
+	drmmode->rotate_pool = armsoc_rotate_pool_new(pARMSOC->rotateThreads);
+	if (pARMSOC->rotateThreads > 1 && !drmmode->rotate_pool)
+		WARNING_MSG("Couldn't start the screen rotation threads");
+
 #if HAVE_NOTIFY_FD
 	SetNotifyFd(drmmode->fd, drmmode_notify_fd, X_NOTIFY_READ, NULL);
 #else
@@ -2092,7 +5268,22 @@ drmmode_screen_init(ScrnInfoPtr pScrn)
 void
 drmmode_screen_fini(ScrnInfoPtr pScrn)
 {
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
 	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	int i;
+
+	drmmode_redisplay_damage_fini(pScrn);
+	for (i = 0; i < config->num_crtc; i++)
+		drmmode_crtc_copy_free(config->crtc[i]);
+	armsoc_rotate_pool_free(drmmode->rotate_pool);
+	drmmode->rotate_pool = NULL;
+
+#ifdef HAVE_DRM_ATOMIC
+	if (drmmode->pending) {
+		drmModeAtomicFree(drmmode->pending);
+		drmmode->pending = NULL;
+	}
+#endif
 
 #if HAVE_NOTIFY_FD
 	RemoveNotifyFd(drmmode->fd);
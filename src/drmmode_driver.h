@@ -130,6 +130,12 @@ struct drmmode_interface {
 	int (*gem_set_domain)(int fd, struct armsoc_gem_set_domain gsd);
 };
 
+/* Return the id of the property called name of the KMS object obj_id, or 0.
+ * The properties of the objects the driver uses are looked up once, so this
+ * costs no ioctl.
+ */
+uint32_t drmmode_object_prop_id(int fd, uint32_t obj_id, const char *name);
+
 extern struct drmmode_interface exynos_interface;
 extern struct drmmode_interface pl111_interface;
 extern struct drmmode_interface meson_interface;
@@ -84,33 +84,11 @@ struct drm_exynos_gem_create {
 static int init_plane_for_cursor(int drm_fd, uint32_t plane_id)
 {
 	int res = -1;
-	drmModeObjectPropertiesPtr props;
-	props = drmModeObjectGetProperties(drm_fd, plane_id,
-			DRM_MODE_OBJECT_PLANE);
-
-	if (props) {
-		int i;
-
-		for (i = 0; i < props->count_props; i++) {
-			drmModePropertyPtr this_prop;
-			this_prop = drmModeGetProperty(drm_fd, props->props[i]);
-
-			if (this_prop) {
-				if (!strncmp(this_prop->name, "zpos",
-							DRM_PROP_NAME_LEN)) {
-					res = drmModeObjectSetProperty(drm_fd,
-							plane_id,
-							DRM_MODE_OBJECT_PLANE,
-							this_prop->prop_id,
-							1);
-					drmModeFreeProperty(this_prop);
-					break;
-				}
-				drmModeFreeProperty(this_prop);
-			}
-		}
-		drmModeFreeObjectProperties(props);
-	}
+	uint32_t zpos = drmmode_object_prop_id(drm_fd, plane_id, "zpos");
+
+	if (zpos)
+		res = drmModeObjectSetProperty(drm_fd, plane_id,
+				DRM_MODE_OBJECT_PLANE, zpos, 1);
 
 	if (res) {
 		/* Try the old method */